@@ -0,0 +1,95 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "bench.h"
+
+// Every allocation in the process comes through here, so a benchmark can
+// check that a path allocates nothing once it is warmed up.
+static std::atomic<uint64_t> allocationCount = 0;
+
+static void *allocate(size_t size, size_t alignment) {
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	size = size == 0 ? 1 : size;
+	void *p;
+	if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+		p = std::malloc(size);
+	} else {
+#ifdef _WIN32
+		p = _aligned_malloc(size, alignment);
+#else
+		// aligned_alloc wants a multiple of the alignment
+		p = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+	}
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+static void deallocate(void *p, size_t alignment) {
+#ifdef _WIN32
+	if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+		_aligned_free(p);
+		return;
+	}
+#else
+	(void)alignment;
+#endif
+	std::free(p);
+}
+
+void *operator new(size_t size) {
+	return allocate(size, 0);
+}
+
+void *operator new[](size_t size) {
+	return allocate(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+	return allocate(size, static_cast<size_t>(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+	return allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept {
+	deallocate(p, 0);
+}
+
+void operator delete[](void *p) noexcept {
+	deallocate(p, 0);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	deallocate(p, 0);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+	deallocate(p, 0);
+}
+
+void operator delete(void *p, std::align_val_t alignment) noexcept {
+	deallocate(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *p, std::align_val_t alignment) noexcept {
+	deallocate(p, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *p, size_t, std::align_val_t alignment) noexcept {
+	deallocate(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void *p, size_t, std::align_val_t alignment) noexcept {
+	deallocate(p, static_cast<size_t>(alignment));
+}
+
+namespace lpvpn::bench {
+	uint64_t allocations() {
+		return allocationCount.load(std::memory_order_relaxed);
+	}
+}
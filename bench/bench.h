@@ -0,0 +1,92 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ip.h"
+
+namespace lpvpn::bench {
+	using namespace lpvpn::ip;
+
+	// keeps the compiler from optimizing away a result nobody reads
+	template<typename T>
+	inline void keep(const T &value) {
+#if defined(__GNUC__) || defined(__clang__)
+		asm volatile("" : : "r,m"(value) : "memory");
+#else
+		static volatile const void *sink;
+		sink = &value;
+#endif
+	}
+
+	struct Result {
+		std::string name;
+		// bytes handled per operation, 0 if throughput makes no sense
+		size_t bytes;
+		uint64_t iterations;
+		double nsPerOp;
+		// anything else worth knowing about the run, see Runner::annotate
+		std::vector<std::pair<std::string, double>> stats;
+	};
+
+	class Runner {
+		public:
+		Runner(std::chrono::milliseconds minTime, const std::string &filter);
+
+		// calls fn(i) in doubling batches until one batch takes at least
+		// minTime, and records that batch
+		template<typename F>
+		void run(const std::string &name, size_t bytes, F fn) {
+			if (!selected(name)) {
+				lastRecorded = false;
+				return;
+			}
+			uint64_t iterations = 1;
+			while (true) {
+				auto start = Clock::now();
+				for (uint64_t i = 0; i < iterations; i++) {
+					fn(i);
+				}
+				auto elapsed = Clock::now() - start;
+				if (elapsed >= minTime) {
+					auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+					record({name, bytes, iterations, ns / iterations, {}});
+					return;
+				}
+				iterations *= 2;
+			}
+		}
+
+		// whether the filter lets name run
+		bool selected(const std::string &name) const {
+			return filter.empty() || name.find(filter) != std::string::npos;
+		}
+		// attaches a statistic to the result of the last run(), if it ran
+		void annotate(const std::string &key, double value);
+		void writeJSON(std::ostream &out);
+
+		private:
+		using Clock = std::chrono::steady_clock;
+
+		void record(Result result);
+
+		std::chrono::milliseconds minTime;
+		std::string filter;
+		std::vector<Result> results;
+		bool lastRecorded = false;
+	};
+
+	// builds a valid IPv4 packet of size bytes with a TCP or UDP header
+	std::vector<uint8_t> makePacket(Protocol protocol, size_t size, Address4 src, Address4 dst);
+	// operator new calls so far, across all threads
+	uint64_t allocations();
+
+	void packetSuite(Runner &runner);
+	void routeSuite(Runner &runner);
+	void steamSuite(Runner &runner);
+	void aeadSuite(Runner &runner);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <thread>
+
+#include "event.h"
+#include "tun.h"
+#include "udp.h"
+#include "loopback.h"
+
+namespace lpvpn::e2e {
+	// Stands in for SteamNet with a direct UDP path, both directions over
+	// localhost. Sends are deferred and leave when the sending side's TUN
+	// burst ends, as they do behind SteamNet::flush().
+	class Direct {
+		public:
+		Direct(tun::Tun &a, tun::Tun &b);
+		~Direct();
+
+		// from is 0 for a, 1 for b
+		void send(int from, std::span<const uint8_t> packet);
+		void flush(int from);
+		// stops delivering, the sockets stay open until destruction
+		void stop();
+		Loopback::Stats stats();
+
+		private:
+		event::Loop loop;
+		std::thread thread;
+		event::Loop::TimerID tickTimer;
+		tun::Tun *tuns[2];
+		std::unique_ptr<udp::Transport> ends[2];
+		std::atomic<bool> running = true;
+
+		std::atomic<uint64_t> packetCount = 0;
+		std::atomic<uint64_t> byteCount = 0;
+		std::atomic<uint64_t> dropCount = 0;
+	};
+}
@@ -0,0 +1,80 @@
+#include "loopback.h"
+
+#define RECEIVE_BATCH 64
+
+namespace lpvpn::e2e {
+	Loopback::Loopback(tun::Tun &to, size_t capacity): to(to), capacity(capacity) {
+		thread = std::thread([this]() {
+			deliver();
+		});
+	}
+
+	Loopback::~Loopback() {
+		stop();
+	}
+
+	void Loopback::stop() {
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			running = false;
+		}
+		cv.notify_all();
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	void Loopback::send(std::span<const uint8_t> packet) {
+		std::unique_lock<std::mutex> lk(mutex);
+		if (queue.size() >= capacity) {
+			dropCount++;
+			return;
+		}
+		std::vector<uint8_t> message;
+		if (!spare.empty()) {
+			message = std::move(spare.back());
+			spare.pop_back();
+		}
+		message.assign(packet.begin(), packet.end());
+		queue.push_back(std::move(message));
+		auto wasEmpty = queue.size() == 1;
+		lk.unlock();
+		if (wasEmpty) {
+			cv.notify_one();
+		}
+	}
+
+	Loopback::Stats Loopback::stats() {
+		return { packetCount.load(), byteCount.load(), dropCount.load() };
+	}
+
+	void Loopback::deliver() {
+		std::vector<std::vector<uint8_t>> burst;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lk(mutex);
+				for (auto &message : burst) {
+					spare.push_back(std::move(message));
+				}
+				burst.clear();
+				cv.wait(lk, [this]() {
+					return !running || !queue.empty();
+				});
+				if (!running) {
+					return;
+				}
+				while (!queue.empty() && burst.size() < RECEIVE_BATCH) {
+					burst.push_back(std::move(queue.front()));
+					queue.pop_front();
+				}
+			}
+			for (auto &message : burst) {
+				packetCount++;
+				byteCount += message.size();
+				auto packet = ip::Packet(message);
+				to.write(packet);
+			}
+			to.flush();
+		}
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "tun.h"
+
+namespace lpvpn::e2e {
+	// Stands in for SteamNet in one direction. Like Steam it copies every
+	// packet into a message, queues it with a bounded budget (dropping
+	// when full, as unreliable sends do) and delivers bursts from a receive
+	// thread, calling flush() on the destination after each burst.
+	class Loopback {
+		public:
+		struct Stats {
+			uint64_t packets;
+			uint64_t bytes;
+			uint64_t drops;
+		};
+
+		Loopback(tun::Tun &to, size_t capacity);
+		~Loopback();
+
+		void send(std::span<const uint8_t> packet);
+		// stops delivering, later sends are queued and never written
+		void stop();
+		Stats stats();
+
+		private:
+		void deliver();
+
+		tun::Tun &to;
+		size_t capacity;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<std::vector<uint8_t>> queue;
+		std::vector<std::vector<uint8_t>> spare;
+		bool running = true;
+		std::thread thread;
+
+		std::atomic<uint64_t> packetCount = 0;
+		std::atomic<uint64_t> byteCount = 0;
+		std::atomic<uint64_t> dropCount = 0;
+	};
+}
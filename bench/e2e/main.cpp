@@ -0,0 +1,469 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "node.h"
+#include "loopback.h"
+#include "direct.h"
+#include "log.h"
+
+#define TCP_PORT 5201
+#define UDP_PORT 5202
+#define ECHO_PORT 5203
+#define LOOPBACK_CAPACITY 4096
+#define TCP_CHUNK (128 * 1024)
+// keep every Nth one-way latency sample under load, plenty for p99
+#define SAMPLE_EVERY 16
+
+using namespace lpvpn;
+using namespace lpvpn::ip;
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+	std::string name;
+	double seconds = 0;
+	// packets that crossed the transport, both directions
+	uint64_t packets = 0;
+	// packets the transport queue had no room for
+	uint64_t drops = 0;
+	// payload bytes the application received
+	uint64_t goodput = 0;
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	std::vector<double> latencyUs = {};
+	double cpuSeconds = 0;
+};
+
+// everything one test needs: two nodes and a transport in each direction,
+// either in-process queues or direct UDP over localhost
+struct Pair {
+	std::unique_ptr<e2e::Node> a;
+	std::unique_ptr<e2e::Node> b;
+	std::unique_ptr<e2e::Loopback> aToB;
+	std::unique_ptr<e2e::Loopback> bToA;
+	std::unique_ptr<e2e::Direct> direct;
+
+	Pair(const tun::Tun::Options &options, bool udp) {
+		a = std::make_unique<e2e::Node>(Subnet4({100, 64, 0, 1}, 10), options);
+		b = std::make_unique<e2e::Node>(Subnet4({100, 64, 0, 2}, 10), options);
+		if (udp) {
+			direct = std::make_unique<e2e::Direct>(a->tun(), b->tun());
+			a->tun().onData([this](ip::Packet &packet) {
+				direct->send(0, packet.packet);
+			});
+			a->tun().onFlush([this]() {
+				direct->flush(0);
+			});
+			b->tun().onData([this](ip::Packet &packet) {
+				direct->send(1, packet.packet);
+			});
+			b->tun().onFlush([this]() {
+				direct->flush(1);
+			});
+			return;
+		}
+		aToB = std::make_unique<e2e::Loopback>(b->tun(), LOOPBACK_CAPACITY);
+		bToA = std::make_unique<e2e::Loopback>(a->tun(), LOOPBACK_CAPACITY);
+		a->tun().onData([this](ip::Packet &packet) {
+			aToB->send(packet.packet);
+		});
+		b->tun().onData([this](ip::Packet &packet) {
+			bToA->send(packet.packet);
+		});
+	}
+
+	~Pair() {
+		// stop writing into the devices, then close them while the links
+		// their readers feed are still around
+		if (direct != nullptr) {
+			direct->stop();
+		} else {
+			aToB->stop();
+			bToA->stop();
+		}
+		a.reset();
+		b.reset();
+	}
+
+	uint64_t packets() {
+		if (direct != nullptr) {
+			return direct->stats().packets;
+		}
+		return aToB->stats().packets + bToA->stats().packets;
+	}
+
+	uint64_t drops() {
+		if (direct != nullptr) {
+			return direct->stats().drops;
+		}
+		return aToB->stats().drops + bToA->stats().drops;
+	}
+};
+
+static int socketOrThrow(int type) {
+	auto fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::system_error(errno, std::generic_category(), "Failed to create socket");
+	}
+	return fd;
+}
+
+static struct sockaddr_in sockAddr(Address4 addr, uint16_t port) {
+	struct sockaddr_in sin = {};
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	memcpy(&sin.sin_addr, addr.addr.data(), 4);
+	return sin;
+}
+
+static void setTimeout(int fd, std::chrono::milliseconds timeout) {
+	struct timeval tv = {};
+	tv.tv_sec = timeout.count() / 1000;
+	tv.tv_usec = (timeout.count() % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static double cpuSeconds() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	auto toSeconds = [](struct timeval tv) {
+		return tv.tv_sec + tv.tv_usec / 1e6;
+	};
+	return toSeconds(usage.ru_utime) + toSeconds(usage.ru_stime);
+}
+
+static int64_t nowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// iperf style bulk transfer from a to b over a single TCP connection
+static Result runTCP(Pair &pair, std::chrono::seconds duration) {
+	Result result = {"tcp"};
+	std::atomic<bool> listening = false;
+	std::atomic<uint64_t> received = 0;
+
+	std::thread server([&]() {
+		pair.b->enter();
+		auto listener = socketOrThrow(SOCK_STREAM);
+		int one = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		auto sin = sockAddr(pair.b->addr(), TCP_PORT);
+		if (bind(listener, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0 || listen(listener, 1) < 0) {
+			throw std::system_error(errno, std::generic_category(), "Failed to listen");
+		}
+		listening = true;
+		listening.notify_all();
+		auto conn = accept(listener, nullptr, nullptr);
+		std::vector<uint8_t> buf(TCP_CHUNK);
+		while (true) {
+			auto n = recv(conn, buf.data(), buf.size(), 0);
+			if (n <= 0) {
+				break;
+			}
+			received += n;
+		}
+		close(conn);
+		close(listener);
+	});
+	listening.wait(false);
+
+	auto startPackets = pair.packets();
+	auto startDrops = pair.drops();
+	auto startCPU = cpuSeconds();
+	auto start = Clock::now();
+	std::thread client([&]() {
+		pair.a->enter();
+		auto fd = socketOrThrow(SOCK_STREAM);
+		auto sin = sockAddr(pair.b->addr(), TCP_PORT);
+		if (connect(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0) {
+			throw std::system_error(errno, std::generic_category(), "Failed to connect");
+		}
+		std::vector<uint8_t> buf(TCP_CHUNK, 0x5A);
+		auto deadline = start + duration;
+		while (Clock::now() < deadline) {
+			auto n = ::send(fd, buf.data(), buf.size(), 0);
+			if (n <= 0) {
+				break;
+			}
+			result.sent += n;
+		}
+		shutdown(fd, SHUT_WR);
+		close(fd);
+	});
+	client.join();
+	server.join();
+
+	result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	result.cpuSeconds = cpuSeconds() - startCPU;
+	result.packets = pair.packets() - startPackets;
+	result.drops = pair.drops() - startDrops;
+	result.received = received;
+	result.goodput = received;
+	return result;
+}
+
+// a blasts small datagrams at b, each stamped with its send time so b can
+// sample one-way latency under load
+static Result runUDP(Pair &pair, std::chrono::seconds duration, size_t size) {
+	Result result = {"udp/" + std::to_string(size)};
+	size = std::max(size, sizeof(int64_t));
+	std::atomic<bool> bound = false;
+	std::atomic<bool> done = false;
+	uint64_t received = 0;
+	uint64_t receivedBytes = 0;
+
+	std::thread server([&]() {
+		pair.b->enter();
+		auto fd = socketOrThrow(SOCK_DGRAM);
+		int rcvbuf = 8 * 1024 * 1024;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		auto sin = sockAddr(pair.b->addr(), UDP_PORT);
+		if (bind(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0) {
+			throw std::system_error(errno, std::generic_category(), "Failed to bind");
+		}
+		setTimeout(fd, std::chrono::milliseconds(200));
+		bound = true;
+		bound.notify_all();
+		std::vector<uint8_t> buf(65536);
+		while (true) {
+			auto n = recv(fd, buf.data(), buf.size(), 0);
+			if (n < 0) {
+				if (done) {
+					break;
+				}
+				continue;
+			}
+			if (static_cast<size_t>(n) < sizeof(int64_t)) {
+				continue;
+			}
+			if (received++ % SAMPLE_EVERY == 0) {
+				int64_t sentAt;
+				memcpy(&sentAt, buf.data(), sizeof(sentAt));
+				result.latencyUs.push_back((nowNs() - sentAt) / 1e3);
+			}
+			receivedBytes += n;
+		}
+		close(fd);
+	});
+	bound.wait(false);
+
+	auto startPackets = pair.packets();
+	auto startDrops = pair.drops();
+	auto startCPU = cpuSeconds();
+	auto start = Clock::now();
+	std::thread client([&]() {
+		pair.a->enter();
+		auto fd = socketOrThrow(SOCK_DGRAM);
+		auto sin = sockAddr(pair.b->addr(), UDP_PORT);
+		if (connect(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0) {
+			throw std::system_error(errno, std::generic_category(), "Failed to connect");
+		}
+		std::vector<uint8_t> buf(size, 0x5A);
+		auto deadline = start + duration;
+		while (Clock::now() < deadline) {
+			auto sentAt = nowNs();
+			memcpy(buf.data(), &sentAt, sizeof(sentAt));
+			if (::send(fd, buf.data(), buf.size(), 0) > 0) {
+				result.sent++;
+			}
+		}
+		close(fd);
+	});
+	client.join();
+	auto elapsed = Clock::now() - start;
+	done = true;
+	server.join();
+
+	result.seconds = std::chrono::duration<double>(elapsed).count();
+	result.cpuSeconds = cpuSeconds() - startCPU;
+	result.packets = pair.packets() - startPackets;
+	result.drops = pair.drops() - startDrops;
+	result.received = received;
+	result.goodput = receivedBytes;
+	return result;
+}
+
+// one datagram in flight at a time, measures round trip latency when idle
+static Result runPing(Pair &pair, std::chrono::seconds duration) {
+	Result result = {"ping"};
+	std::atomic<bool> bound = false;
+	std::atomic<bool> done = false;
+
+	std::thread server([&]() {
+		pair.b->enter();
+		auto fd = socketOrThrow(SOCK_DGRAM);
+		auto sin = sockAddr(pair.b->addr(), ECHO_PORT);
+		if (bind(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0) {
+			throw std::system_error(errno, std::generic_category(), "Failed to bind");
+		}
+		setTimeout(fd, std::chrono::milliseconds(200));
+		bound = true;
+		bound.notify_all();
+		uint8_t buf[64];
+		while (!done) {
+			struct sockaddr_in from;
+			socklen_t fromLen = sizeof(from);
+			auto n = recvfrom(fd, buf, sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &fromLen);
+			if (n > 0) {
+				sendto(fd, buf, n, 0, reinterpret_cast<sockaddr *>(&from), fromLen);
+			}
+		}
+		close(fd);
+	});
+	bound.wait(false);
+
+	auto startPackets = pair.packets();
+	auto startDrops = pair.drops();
+	auto startCPU = cpuSeconds();
+	auto start = Clock::now();
+	std::thread client([&]() {
+		pair.a->enter();
+		auto fd = socketOrThrow(SOCK_DGRAM);
+		auto sin = sockAddr(pair.b->addr(), ECHO_PORT);
+		if (connect(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0) {
+			throw std::system_error(errno, std::generic_category(), "Failed to connect");
+		}
+		setTimeout(fd, std::chrono::milliseconds(100));
+		uint8_t buf[64] = {};
+		auto deadline = start + duration;
+		while (Clock::now() < deadline) {
+			auto sentAt = Clock::now();
+			if (::send(fd, buf, sizeof(buf), 0) <= 0) {
+				continue;
+			}
+			result.sent++;
+			if (recv(fd, buf, sizeof(buf), 0) > 0) {
+				result.received++;
+				result.goodput += sizeof(buf);
+				result.latencyUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sentAt).count());
+			}
+		}
+		close(fd);
+	});
+	client.join();
+	auto elapsed = Clock::now() - start;
+	done = true;
+	server.join();
+
+	result.seconds = std::chrono::duration<double>(elapsed).count();
+	result.cpuSeconds = cpuSeconds() - startCPU;
+	result.packets = pair.packets() - startPackets;
+	result.drops = pair.drops() - startDrops;
+	return result;
+}
+
+static double percentile(std::vector<double> &samples, double p) {
+	if (samples.empty()) {
+		return 0;
+	}
+	auto index = static_cast<size_t>(p * (samples.size() - 1));
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index];
+}
+
+static void writeJSON(std::ostream &out, const tun::Tun::Options &options, const std::string &transport, std::vector<Result> &results) {
+	out << "{\n";
+	out << "\t\"version\": \"" LPVPN_VERSION "\",\n";
+	out << "\t\"git\": \"" LPVPN_GIT_VERSION "\",\n";
+	out << "\t\"transport\": \"" << transport << "\",\n";
+	out << "\t\"queues\": " << options.queues << ",\n";
+	out << "\t\"offload\": " << (options.offload ? "true" : "false") << ",\n";
+	out << "\t\"uring\": " << (options.uring ? "true" : "false") << ",\n";
+	out << "\t\"tests\": [";
+	out << std::setprecision(3) << std::fixed;
+	for (size_t i = 0; i < results.size(); i++) {
+		auto &result = results[i];
+		out << (i == 0 ? "\n" : ",\n");
+		out << "\t\t{\"name\": \"" << result.name << "\"";
+		out << ", \"seconds\": " << result.seconds;
+		out << ", \"packets\": " << result.packets;
+		out << ", \"pps\": " << result.packets / result.seconds;
+		out << ", \"gbps\": " << result.goodput * 8 / result.seconds / 1e9;
+		out << ", \"drops\": " << result.drops;
+		out << ", \"sent\": " << result.sent;
+		out << ", \"received\": " << result.received;
+		out << ", \"p50_us\": " << percentile(result.latencyUs, 0.5);
+		out << ", \"p99_us\": " << percentile(result.latencyUs, 0.99);
+		out << ", \"cpu_ns_per_packet\": " << (result.packets == 0 ? 0 : result.cpuSeconds * 1e9 / result.packets);
+		out << "}";
+	}
+	out << "\n\t]\n}\n";
+}
+
+int main(int argc, char **argv) {
+	tun::Tun::Options options;
+	auto duration = std::chrono::seconds(5);
+	std::string test = "all";
+	std::string outFilename;
+	size_t udpSize = 64;
+	std::string transport = "loopback";
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+			duration = std::chrono::seconds(atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--test") == 0 && i + 1 < argc) {
+			// tcp, udp, ping or all
+			test = argv[++i];
+		} else if (strcmp(argv[i], "--udp-size") == 0 && i + 1 < argc) {
+			udpSize = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--queues") == 0 && i + 1 < argc) {
+			options.queues = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--offload") == 0) {
+			options.offload = true;
+		} else if (strcmp(argv[i], "--uring") == 0) {
+			options.uring = true;
+		} else if (strcmp(argv[i], "--transport") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "loopback") == 0 || strcmp(argv[i + 1], "udp") == 0)) {
+			transport = argv[++i];
+		} else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+			outFilename = argv[++i];
+		} else {
+			std::cerr << "usage: " << argv[0] << " [--test tcp|udp|ping|all] [--duration <s>] [--udp-size <bytes>]"
+				" [--queues <n>] [--offload] [--uring] [--transport loopback|udp] [--out <file.json>]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<Result> results;
+	try {
+		Pair pair(options, transport == "udp");
+		if (test == "all" || test == "ping") {
+			results.push_back(runPing(pair, duration));
+		}
+		if (test == "all" || test == "udp") {
+			results.push_back(runUDP(pair, duration, udpSize));
+		}
+		if (test == "all" || test == "tcp") {
+			results.push_back(runTCP(pair, duration));
+		}
+	} catch (std::exception &e) {
+		std::cerr << "lpvpn-e2e: " << e.what() << " (needs root or CAP_NET_ADMIN and CAP_SYS_ADMIN)" << std::endl;
+		return 1;
+	}
+
+	if (outFilename.empty()) {
+		writeJSON(std::cout, options, transport, results);
+	} else {
+		std::ofstream file(outFilename);
+		writeJSON(file, options, transport, results);
+	}
+	return 0;
+}
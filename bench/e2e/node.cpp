@@ -0,0 +1,58 @@
+#include <cerrno>
+#include <exception>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "node.h"
+
+namespace lpvpn::e2e {
+	Node::Node(Subnet4 addr, const tun::Tun::Options &options): subnet(addr) {
+		// unshare only affects the calling thread, do it on a throwaway one
+		// and keep the namespace alive through its fd
+		std::exception_ptr error;
+		std::thread([&]() {
+			try {
+				if (unshare(CLONE_NEWNET) < 0) {
+					throw std::system_error(errno, std::generic_category(), "Failed to create network namespace");
+				}
+				nsFd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+				if (nsFd < 0) {
+					throw std::system_error(errno, std::generic_category(), "Failed to open network namespace");
+				}
+				device = std::make_unique<tun::Tun>(options);
+				device->setIP4(subnet);
+			} catch (...) {
+				error = std::current_exception();
+			}
+		}).join();
+		if (error != nullptr) {
+			if (nsFd >= 0) {
+				close(nsFd);
+			}
+			std::rethrow_exception(error);
+		}
+	}
+
+	Node::~Node() {
+		device.reset();
+		close(nsFd);
+	}
+
+	void Node::enter() {
+		if (setns(nsFd, CLONE_NEWNET) < 0) {
+			throw std::system_error(errno, std::generic_category(), "Failed to enter network namespace");
+		}
+	}
+
+	Address4 Node::addr() const {
+		return subnet;
+	}
+
+	tun::Tun &Node::tun() {
+		return *device;
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <memory>
+#include <string>
+
+#include "ip.h"
+#include "tun.h"
+
+namespace lpvpn::e2e {
+	using namespace lpvpn::ip;
+
+	// One data plane: a TUN device configured inside a network namespace of
+	// its own, so two nodes on one machine can't short-circuit through the
+	// local routing table.
+	class Node {
+		public:
+		Node(Subnet4 addr, const tun::Tun::Options &options);
+		~Node();
+
+		// moves the calling thread into this node's namespace, sockets it
+		// opens afterwards live there
+		void enter();
+
+		Address4 addr() const;
+		tun::Tun &tun();
+
+		private:
+		Subnet4 subnet;
+		int nsFd = -1;
+		std::unique_ptr<tun::Tun> device;
+	};
+}
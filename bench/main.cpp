@@ -0,0 +1,95 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+#include "bench.h"
+#include "log.h"
+
+namespace lpvpn::bench {
+	Runner::Runner(std::chrono::milliseconds minTime, const std::string &filter): minTime(minTime), filter(filter) {}
+
+	void Runner::record(Result result) {
+		std::cerr << std::left << std::setw(40) << result.name << std::right << std::fixed << std::setprecision(1)
+			<< std::setw(12) << result.nsPerOp << " ns/op" << std::endl;
+		results.push_back(std::move(result));
+		lastRecorded = true;
+	}
+
+	void Runner::annotate(const std::string &key, double value) {
+		if (!lastRecorded) {
+			return;
+		}
+		std::cerr << std::setw(40) << "" << std::setw(12) << std::setprecision(3) << value << " " << key << std::endl;
+		results.back().stats.push_back({key, value});
+	}
+
+	void Runner::writeJSON(std::ostream &out) {
+		out << "{\n";
+		out << "\t\"version\": \"" LPVPN_VERSION "\",\n";
+		out << "\t\"git\": \"" LPVPN_GIT_VERSION "\",\n";
+		out << "\t\"benchmarks\": [";
+		for (size_t i = 0; i < results.size(); i++) {
+			auto &result = results[i];
+			out << (i == 0 ? "\n" : ",\n");
+			out << "\t\t{\"name\": \"" << result.name << "\"";
+			out << ", \"bytes\": " << result.bytes;
+			out << ", \"iterations\": " << result.iterations;
+			out << std::setprecision(3) << std::fixed;
+			out << ", \"ns_per_op\": " << result.nsPerOp;
+			out << ", \"mpps\": " << 1e3 / result.nsPerOp;
+			out << ", \"gbps\": " << result.bytes * 8 / result.nsPerOp;
+			for (auto &[key, value] : result.stats) {
+				out << ", \"" << key << "\": " << value;
+			}
+			out << "}";
+		}
+		out << "\n\t]\n}\n";
+	}
+}
+
+using namespace lpvpn;
+
+int main(int argc, char **argv) {
+	std::string filter;
+	std::string outFilename;
+	auto minTime = std::chrono::milliseconds(200);
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			// only run benchmarks whose name contains this
+			filter = argv[++i];
+		} else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+			minTime = std::chrono::milliseconds(atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+			outFilename = argv[++i];
+		} else {
+			std::cerr << "usage: " << argv[0] << " [--filter <substring>] [--min-time <ms>] [--out <file.json>]" << std::endl;
+			return 1;
+		}
+	}
+
+	// the core logs through std::clog, keep that out of the results
+	std::clog.rdbuf(nullptr);
+
+	bench::Runner runner(minTime, filter);
+	try {
+		bench::packetSuite(runner);
+		bench::routeSuite(runner);
+		bench::steamSuite(runner);
+		bench::aeadSuite(runner);
+	} catch (const std::exception &e) {
+		// a benchmark found its path misbehaving
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	if (outFilename.empty()) {
+		runner.writeJSON(std::cout);
+	} else {
+		std::ofstream file(outFilename);
+		runner.writeJSON(file);
+	}
+	return 0;
+}
@@ -0,0 +1,388 @@
+#include <atomic>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#include "bench.h"
+#include "batch.h"
+#include "worker.h"
+#include "frag.h"
+#include "fec.h"
+#include "storm.h"
+
+namespace lpvpn::bench {
+	// sizes seen in practice: pure ACKs, the IPv4 minimum MTU, our default
+	// batching MTU and a full Ethernet frame's worth of tunnel payload
+	static const size_t PACKET_SIZES[] = {64, 576, 1200, 1400};
+
+	std::vector<uint8_t> makePacket(Protocol protocol, size_t size, Address4 src, Address4 dst) {
+		std::vector<uint8_t> buffer(size);
+		auto p = buffer.data();
+		p[0] = 0x45;
+		p[2] = static_cast<uint8_t>(size >> 8);
+		p[3] = static_cast<uint8_t>(size & 0xFF);
+		p[4] = 0x12;
+		p[5] = 0x34;
+		p[8] = 64;
+		p[9] = protocol;
+		memcpy(p + 12, src.addr.data(), 4);
+		memcpy(p + 16, dst.addr.data(), 4);
+		size_t headerLen = 20;
+		p[20] = 0xC3;
+		p[21] = 0x50;
+		p[22] = 0x1F;
+		p[23] = 0x90;
+		if (protocol == PROTOCOL_TCP) {
+			p[32] = 5 << 4;
+			p[33] = 0x10;
+			p[34] = 0xFF;
+			p[35] = 0xFF;
+			headerLen += 20;
+		} else {
+			auto length = size - 20;
+			p[24] = static_cast<uint8_t>(length >> 8);
+			p[25] = static_cast<uint8_t>(length & 0xFF);
+			headerLen += 8;
+		}
+		for (size_t i = headerLen; i < size; i++) {
+			p[i] = static_cast<uint8_t>(i * 7);
+		}
+		auto packet4 = Packet4(buffer);
+		packet4.recalculateChecksum();
+		packet4.recalculateL4Checksum();
+		return buffer;
+	}
+
+	// what setSrcAddr / setDstAddr did before incremental checksums: copy
+	// the address, then run a byte-wise sum over the whole packet
+	static void legacyRecalculateChecksum(std::span<uint8_t> packet) {
+		uint16_t checksum = 0;
+		for (size_t i = 0; i < packet.size(); i++) {
+			if (i == 10 || i == 11) {
+				continue;
+			}
+			uint16_t prev = checksum;
+			checksum += packet[i];
+			if (checksum < prev) {
+				checksum++;
+			}
+		}
+		keep(checksum);
+	}
+
+	static void legacySetAddrs(std::span<uint8_t> packet, Address4 src, Address4 dst) {
+		memcpy(packet.data() + 12, src.addr.data(), 4);
+		legacyRecalculateChecksum(packet);
+		memcpy(packet.data() + 16, dst.addr.data(), 4);
+		legacyRecalculateChecksum(packet);
+	}
+
+	// RFC 1071 the plain way: big endian words, one at a time
+	static uint16_t scalarSum(std::span<const uint8_t> data) {
+		uint32_t sum = 0;
+		for (size_t i = 0; i < data.size(); i += 2) {
+			sum += (data[i] << 8) | (i + 1 < data.size() ? data[i + 1] : 0);
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		}
+		return static_cast<uint16_t>(sum);
+	}
+
+	// rebuilds both checksums of a copy of packet from scratch
+	static std::vector<uint8_t> recomputed(std::span<const uint8_t> packet) {
+		std::vector<uint8_t> copy(packet.begin(), packet.end());
+		auto packet4 = Packet4(copy);
+		packet4.recalculateChecksum();
+		packet4.recalculateL4Checksum();
+		return copy;
+	}
+
+	// The incremental rewrites and the vectorized sum have to land on
+	// what a full recompute gives, for every length and alignment
+	static void checkChecksums() {
+		std::mt19937 rng(1624);
+		auto byte = [&]() {
+			return static_cast<uint8_t>(rng());
+		};
+		auto fail = [](const std::string &what) {
+			throw std::runtime_error("checksum/verify: " + what);
+		};
+
+		// 16 alignments of every length up to a jumbo frame and then some,
+		// random and all ones (the most carries)
+		std::vector<uint8_t> buffer(9100 + 16);
+		for (auto fill : {0, 1}) {
+			for (auto &b : buffer) {
+				b = fill == 0 ? byte() : 0xFF;
+			}
+			for (size_t size = 0; size <= 9100; size += size < 256 ? 1 : 97) {
+				for (size_t offset = 0; offset < 16; offset++) {
+					auto data = std::span<const uint8_t>(buffer).subspan(offset, size);
+					if (onesComplementSum(data) != scalarSum(data)) {
+						fail("sum of " + std::to_string(size) + " bytes at offset " + std::to_string(offset));
+					}
+				}
+			}
+		}
+		std::vector<uint8_t> huge(1 << 20, 0xFF);
+		if (onesComplementSum(huge) != scalarSum(huge)) {
+			fail("sum of 1 MiB");
+		}
+
+		// address rewrites of random TCP and UDP packets, odd lengths too
+		for (size_t round = 0; round < 2000; round++) {
+			auto protocol = round % 2 == 0 ? PROTOCOL_TCP : PROTOCOL_UDP;
+			auto size = 48 + rng() % 1400;
+			auto packet = makePacket(protocol, size, Address4(static_cast<uint32_t>(rng())), Address4(static_cast<uint32_t>(rng())));
+			for (size_t i = 48; i < size; i++) {
+				packet[i] = byte();
+			}
+			packet = recomputed(packet);
+			auto packet4 = Packet4(packet);
+			packet4.setAddrs(Address4(static_cast<uint32_t>(rng())), Address4(static_cast<uint32_t>(rng())));
+			if (packet != recomputed(packet)) {
+				fail("setAddrs on a " + std::to_string(size) + " byte " + (protocol == PROTOCOL_TCP ? "TCP" : "UDP") + " packet");
+			}
+		}
+		// a UDP sender that left the checksum out keeps it out
+		auto unchecked = makePacket(PROTOCOL_UDP, 128, Address4({10, 0, 0, 1}), Address4({10, 0, 0, 2}));
+		unchecked[26] = 0;
+		unchecked[27] = 0;
+		Packet4(unchecked).setAddrs(Address4({100, 64, 1, 2}), Address4({100, 100, 3, 4}));
+		if (unchecked[26] != 0 || unchecked[27] != 0) {
+			fail("setAddrs filled in a disabled UDP checksum");
+		}
+
+		// MSS clamps with the option at every word alignment
+		for (size_t nops = 0; nops < 4; nops++) {
+			for (size_t round = 0; round < 200; round++) {
+				auto syn = makePacket(PROTOCOL_TCP, 64, Address4(static_cast<uint32_t>(rng())), Address4(static_cast<uint32_t>(rng())));
+				syn[33] = 0x02;
+				syn[34] = byte();
+				syn[35] = byte();
+				// 8 option bytes: nops NOPs, the MSS, then end of options
+				auto options = syn.data() + 40;
+				auto mss = static_cast<uint16_t>(536 + rng() % 9000);
+				memset(options, 0, 8);
+				memset(options, 1, nops);
+				options[nops] = 2;
+				options[nops + 1] = 4;
+				options[nops + 2] = static_cast<uint8_t>(mss >> 8);
+				options[nops + 3] = static_cast<uint8_t>(mss);
+				syn[32] = 7 << 4;
+				syn = recomputed(syn);
+				auto clamp = static_cast<uint16_t>(536 + rng() % 1000);
+				Packet4(syn).clampMSS(clamp);
+				if (syn != recomputed(syn)) {
+					fail("clampMSS with " + std::to_string(nops) + " NOPs before the option");
+				}
+			}
+		}
+	}
+
+	void packetSuite(Runner &runner) {
+		auto src = Address4({100, 64, 1, 2});
+		auto dst = Address4({100, 100, 3, 4});
+		// alternate between two mappings so every rewrite changes something
+		Address4 srcs[2] = {src, Address4({100, 65, 9, 8})};
+		Address4 dsts[2] = {dst, Address4({100, 101, 7, 6})};
+
+		for (auto size : PACKET_SIZES) {
+			auto suffix = "/" + std::to_string(size);
+			auto udp = makePacket(PROTOCOL_UDP, size, src, dst);
+			auto tcp = makePacket(PROTOCOL_TCP, size, src, dst);
+
+			runner.run("parse" + suffix, size, [&](uint64_t) {
+				auto packet = Packet(udp);
+				if (packet.version() != 4) {
+					return;
+				}
+				auto packet4 = packet.toPacket4();
+				auto addr = packet4.dstAddr();
+				keep(packet4.srcAddr().toUint32());
+				keep(addr.isBroadcast() || addr.isMulticast());
+				keep(packet4.protocol());
+			});
+
+			runner.run("rewrite/legacy" + suffix, size, [&](uint64_t i) {
+				legacySetAddrs(tcp, srcs[i & 1], dsts[i & 1]);
+			});
+
+			runner.run("rewrite/incremental/tcp" + suffix, size, [&](uint64_t i) {
+				auto packet4 = Packet4(tcp);
+				packet4.setAddrs(srcs[i & 1], dsts[i & 1]);
+			});
+
+			runner.run("rewrite/incremental/udp" + suffix, size, [&](uint64_t i) {
+				auto packet4 = Packet4(udp);
+				packet4.setAddrs(srcs[i & 1], dsts[i & 1]);
+			});
+
+			runner.run("checksum/full" + suffix, size, [&](uint64_t) {
+				auto packet4 = Packet4(tcp);
+				packet4.recalculateChecksum();
+				packet4.recalculateL4Checksum();
+			});
+		}
+		if (runner.selected("checksum/verify")) {
+			checkChecksums();
+		}
+
+		runner.run("address/from_uint32", 0, [&](uint64_t i) {
+			keep(Address4(static_cast<uint32_t>(i)).toUint32());
+		});
+
+		runner.run("address/to_string", 0, [&](uint64_t i) {
+			keep(Address4(static_cast<uint32_t>(i)).toString());
+		});
+
+		auto range = Subnet4({100, 64, 0, 0}, 10);
+		runner.run("address/classify", 0, [&](uint64_t i) {
+			auto addr = range.start() + static_cast<uint32_t>(i);
+			keep(addr.isBroadcast() || addr.isMulticast());
+		});
+
+		auto flow = makePacket(PROTOCOL_TCP, 64, Address4({100, 64, 0, 1}), Address4({100, 64, 0, 2}));
+		runner.run("worker/flow_hash", 0, [&](uint64_t i) {
+			flow[20] = static_cast<uint8_t>(i);
+			auto packet = Packet(flow);
+			keep(worker::flowHash(packet));
+		});
+
+		// a SYN with the usual MSS of 1460, put back before every clamp
+		auto syn = makePacket(PROTOCOL_TCP, 64, src, dst);
+		syn[32] = 6 << 4;
+		syn[33] = 0x02;
+		syn[40] = 2;
+		syn[41] = 4;
+		runner.run("mss/clamp", 0, [&](uint64_t) {
+			syn[42] = 0x05;
+			syn[43] = 0xB4;
+			auto packet4 = Packet4(syn);
+			keep(packet4.clampMSS(1160));
+		});
+
+		// a full offloaded segment cut down to a 1200 byte tunnel MTU
+		for (size_t size : {1400, 9000}) {
+			auto frame = makePacket(PROTOCOL_UDP, size, src, dst);
+			frag::Reassembler reassembler;
+			runner.run("frag/roundtrip/" + std::to_string(size), size, [&](uint64_t i) {
+				frag::split(static_cast<uint32_t>(i), frame, 1200, [&](std::span<const uint8_t> piece) {
+					keep(reassembler.add(1, piece).size());
+				});
+			});
+		}
+
+		// the GF(2^8) multiply-add every parity byte goes through
+		{
+			std::vector<uint8_t> src(fec::SHARD_SIZE, 0x5A);
+			std::vector<uint8_t> dst(fec::SHARD_SIZE);
+			runner.run("fec/mul_add/scalar", src.size(), [&](uint64_t i) {
+				fec::gf::mulAddScalar(dst.data(), src.data(), static_cast<uint8_t>(i | 2), src.size());
+			});
+			runner.run(std::string("fec/mul_add/") + fec::gf::kernel(), src.size(), [&](uint64_t i) {
+				fec::gf::mulAdd(dst.data(), src.data(), static_cast<uint8_t>(i | 2), src.size());
+			});
+		}
+
+		// full groups of 1200 byte frames with as much parity as there can
+		// be; decode rebuilds that many lost frames from every group
+		{
+			std::vector<std::vector<uint8_t>> frames;
+			for (size_t i = 0; i < fec::MAX_DATA; i++) {
+				frames.push_back(makePacket(PROTOCOL_UDP, 1200, src, dst));
+				frames.back()[4] = static_cast<uint8_t>(i);
+			}
+			fec::Encoder encoder;
+			encoder.setLoss(1, 1);
+			std::vector<uint8_t> data;
+			std::vector<std::vector<uint8_t>> parity;
+			runner.run("fec/encode/1200", 1200, [&](uint64_t i) {
+				encoder.encode(1, frames[i % fec::MAX_DATA], data, parity);
+				keep(parity.size());
+			});
+			runner.annotate("parity", fec::MAX_PARITY);
+
+			// one group on the wire, repeated with fresh group numbers
+			std::vector<std::vector<uint8_t>> wire;
+			fec::Encoder groupEncoder;
+			groupEncoder.setLoss(1, 1);
+			for (auto &frame : frames) {
+				groupEncoder.encode(1, frame, data, parity);
+				wire.push_back(data);
+			}
+			for (auto &p : parity) {
+				wire.push_back(p);
+			}
+			fec::Decoder decoder;
+			runner.run("fec/decode/1200", 1200 * fec::MAX_DATA, [&](uint64_t i) {
+				size_t delivered = 0;
+				// skip the first MAX_PARITY data frames, parity makes up for them
+				for (size_t n = fec::MAX_PARITY; n < wire.size(); n++) {
+					frame::writeU16(wire[n].data() + 1, static_cast<uint16_t>(i));
+					delivered += decoder.receive(1, wire[n]).size();
+				}
+				keep(delivered);
+			});
+			runner.annotate("lost", fec::MAX_PARITY);
+		}
+
+		// a discovery broadcast repeated at a fixed clock, so half the
+		// copies fall in the dedup window and the bucket limits the rest
+		{
+			auto announce = makePacket(PROTOCOL_UDP, 128, src, Address4({255, 255, 255, 255}));
+			storm::Limiter limiter({1000, 10, std::chrono::milliseconds(1)});
+			auto start = storm::Limiter::Clock::now();
+			uint64_t admitted = 0;
+			uint64_t total = 0;
+			// the clock keeps going across calibration runs
+			runner.run("storm/admit/128", 128, [&](uint64_t) {
+				auto packet4 = Packet4(announce);
+				admitted += limiter.admit(packet4, start + std::chrono::microseconds(total * 500));
+				total++;
+			});
+			runner.annotate("admitted_share", total == 0 ? 0 : double(admitted) / total);
+		}
+
+		// outbound workers each feeding their own peer, with a send that
+		// does about as much work as one into Steam. The time is the first
+		// worker's, the others run flat out beside it.
+		for (size_t workers : {1, 2, 4}) {
+			auto packet = makePacket(PROTOCOL_UDP, 400, src, dst);
+			batch::Batcher batcher(std::chrono::microseconds(1000), 1200, [](uint64_t, std::span<const uint8_t> message) {
+				uint32_t sum = 0;
+				for (size_t round = 0; round < 4; round++) {
+					for (auto byte : message) {
+						sum = sum * 31 + byte;
+					}
+				}
+				keep(sum);
+			});
+			std::atomic<bool> running = true;
+			std::atomic<uint64_t> total = 0;
+			std::vector<std::thread> others;
+			for (size_t i = 1; i < workers; i++) {
+				others.emplace_back([&, i]() {
+					uint64_t count = 0;
+					while (running.load(std::memory_order_relaxed)) {
+						batcher.enqueue(i, packet);
+						count++;
+					}
+					total += count;
+				});
+			}
+			uint64_t count = 0;
+			auto start = std::chrono::steady_clock::now();
+			runner.run("batch/enqueue/workers/" + std::to_string(workers), packet.size(), [&](uint64_t) {
+				batcher.enqueue(0, packet);
+				count++;
+			});
+			running = false;
+			for (auto &thread : others) {
+				thread.join();
+			}
+			auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+			runner.annotate("total_mpps", (total + count) / elapsed);
+		}
+	}
+}
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include "bench.h"
+#include "route.h"
+#include "batch.h"
+#include "igmp.h"
+#include "pool.h"
+#include "cache.h"
+
+// matches MAX_BROADCAST in steam.cpp
+#define FANOUT 16
+#define QUERIES 1024
+
+namespace lpvpn::bench {
+	static const size_t PEER_COUNTS[] = {16, 256, 4096};
+	static const uint64_t STEAM_ID_BASE = 76561197960265728ull;
+
+	// an IGMPv2 membership report for group
+	static std::vector<uint8_t> makeReport(Address4 src, Address4 group) {
+		std::vector<uint8_t> buffer(28);
+		auto p = buffer.data();
+		p[0] = 0x45;
+		p[3] = 28;
+		p[8] = 1;
+		p[9] = PROTOCOL_IGMP;
+		memcpy(p + 12, src.addr.data(), 4);
+		memcpy(p + 16, group.addr.data(), 4);
+		p[20] = 0x16;
+		memcpy(p + 24, group.addr.data(), 4);
+		return buffer;
+	}
+
+	void routeSuite(Runner &runner) {
+		for (auto count : PEER_COUNTS) {
+			auto suffix = "/" + std::to_string(count);
+
+			std::mt19937_64 rng(count);
+			route::AddressAllocator addrs;
+			std::vector<route::Peer> list;
+			while (list.size() < count) {
+				auto steamID = STEAM_ID_BASE + (rng() & 0xFFFFFFFF);
+				if (!addrs.find(steamID)) {
+					list.push_back({steamID, addrs.assign(steamID)});
+				}
+			}
+			route::PeerTable table;
+			table.publish(list);
+
+			std::vector<size_t> queries(QUERIES);
+			for (auto &query : queries) {
+				query = rng() % count;
+			}
+
+			runner.run("lookup/addr" + suffix, 0, [&](uint64_t i) {
+				auto reader = table.read();
+				keep(reader.find(list[queries[i % QUERIES]].addr));
+			});
+
+			runner.run("lookup/steam_id" + suffix, 0, [&](uint64_t i) {
+				auto reader = table.read();
+				keep(reader.find(list[queries[i % QUERIES]].steamID));
+			});
+
+			// a quarter of the peers joined the group, long enough ago that
+			// it is no longer flooded
+			igmp::Snooper snooper;
+			auto group = Address4({239, 1, 2, 3});
+			auto joined = igmp::Snooper::Clock::now();
+			auto now = joined + igmp::QUERY_INTERVAL;
+			for (size_t i = 0; i < count; i += 4) {
+				auto report = makeReport(list[i].addr, group);
+				auto packet4 = Packet4(report);
+				snooper.observe(list[i].steamID, packet4, joined);
+			}
+
+			for (auto size : {64, 1200}) {
+				auto sizeSuffix = suffix + "/" + std::to_string(size);
+				auto broadcast = makePacket(PROTOCOL_UDP, size, list[0].addr, Address4({255, 255, 255, 255}));
+				auto multicast = makePacket(PROTOCOL_UDP, size, list[0].addr, group);
+				size_t sentBytes = 0;
+				std::vector<uint64_t> targets;
+				batch::Batcher batcher(std::chrono::microseconds(1000), 1200, [&](uint64_t, std::span<const uint8_t> message) {
+					sentBytes += message.size();
+				});
+
+				runner.run("fanout/flood" + sizeSuffix, size * std::min<size_t>(count, FANOUT), [&](uint64_t) {
+					auto reader = table.read();
+					targets.clear();
+					for (auto &peer : reader.peers()) {
+						if (targets.size() >= FANOUT) {
+							break;
+						}
+						targets.push_back(peer.steamID);
+					}
+					batcher.enqueue(targets, pool::Buffer::copy(broadcast));
+				});
+
+				std::vector<uint64_t> members;
+				runner.run("fanout/multicast" + sizeSuffix, size * std::min<size_t>(count / 4, FANOUT), [&](uint64_t) {
+					auto reader = table.read();
+					if (!snooper.members(group, members, now)) {
+						return;
+					}
+					targets.clear();
+					for (auto steamID : members) {
+						if (targets.size() >= FANOUT) {
+							break;
+						}
+						if (reader.find(steamID) != nullptr) {
+							targets.push_back(steamID);
+						}
+					}
+					batcher.enqueue(targets, pool::Buffer::copy(multicast));
+				});
+				batcher.flush();
+				keep(sentBytes);
+			}
+		}
+
+		// a LAN party node only sees its friends, the larger counts check
+		// the allocator stays O(1) well past that
+		for (size_t count : {10000, 100000}) {
+			auto suffix = "/" + std::to_string(count);
+			std::mt19937_64 rng(count);
+			std::vector<uint64_t> steamIDs;
+			{
+				route::AddressAllocator unique;
+				while (steamIDs.size() < count) {
+					auto steamID = STEAM_ID_BASE + (rng() & 0xFFFFFFFF);
+					if (!unique.find(steamID)) {
+						unique.assign(steamID);
+						steamIDs.push_back(steamID);
+					}
+				}
+			}
+
+			route::AddressAllocator addrs;
+			runner.run("alloc/assign" + suffix, 0, [&](uint64_t i) {
+				if (i % count == 0) {
+					addrs = route::AddressAllocator();
+				}
+				keep(addrs.assign(steamIDs[i % count]));
+			});
+
+			// a first start lays the whole friend list out at once
+			addrs = route::AddressAllocator();
+			addrs.assignAll(steamIDs);
+			size_t away = 0;
+			for (auto &[steamID, addr] : addrs.assignments()) {
+				if (!(addr == route::AddressAllocator::compute(steamID))) {
+					away++;
+				}
+			}
+			runner.annotate("collision_rate", static_cast<double>(away) / count);
+			runner.annotate("mean_probe_distance", static_cast<double>(addrs.displaced()) / count);
+			runner.annotate("bytes_per_id", static_cast<double>(addrs.memoryUsage()) / count);
+
+			runner.run("alloc/find" + suffix, 0, [&](uint64_t i) {
+				keep(addrs.find(steamIDs[(i * 7919) % count]));
+			});
+		}
+
+		// what a restart costs before routing works, with a big friend list
+		{
+			std::mt19937_64 rng(1);
+			route::AddressAllocator addrs;
+			std::vector<cache::Entry> entries;
+			while (entries.size() < 1000) {
+				auto steamID = STEAM_ID_BASE + (rng() & 0xFFFFFFFF);
+				if (!addrs.find(steamID)) {
+					entries.push_back({steamID, addrs.assign(steamID), "friend " + std::to_string(entries.size()), (steamID & 1) != 0});
+				}
+			}
+			auto path = (std::filesystem::temp_directory_path() / "lpvpn-bench.peers.bin").string();
+
+			runner.run("cache/save/1000", 0, [&](uint64_t) {
+				cache::save(path, STEAM_ID_BASE, entries);
+			});
+			runner.run("cache/load/1000", 0, [&](uint64_t) {
+				keep(cache::load(path, STEAM_ID_BASE).size());
+			});
+			std::remove(path.c_str());
+		}
+
+		for (auto size : {64, 1200}) {
+			auto packet = makePacket(PROTOCOL_UDP, size, Address4({100, 64, 0, 1}), Address4({100, 64, 0, 2}));
+			runner.run("pool/copy/" + std::to_string(size), size, [&](uint64_t) {
+				auto buffer = pool::Buffer::copy(packet);
+				keep(buffer.data());
+			});
+		}
+	}
+}
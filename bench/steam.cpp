@@ -0,0 +1,315 @@
+#include <array>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "burst.h"
+#include "compress.h"
+#include "dispatch.h"
+#include "fec.h"
+#include "frag.h"
+#include "frame.h"
+#include "igmp.h"
+#include "route.h"
+
+#define MOCK_CHANNELS 4
+#define MOCK_QUEUE_SIZE 4096
+
+namespace lpvpn::bench {
+	class MockMessages;
+
+	// CSteamID and SteamNetworkingIdentity, as far as reading the sender goes
+	struct MockSteamID {
+		uint64_t steamID = 0;
+
+		uint64_t ConvertToUint64() const {
+			return steamID;
+		}
+	};
+
+	struct MockIdentity {
+		MockSteamID steamID;
+
+		MockSteamID GetSteamID() const {
+			return steamID;
+		}
+	};
+
+	// SteamNetworkingMessage_t's fields and methods as SteamNet uses them
+	struct MockMessage {
+		void *m_pData = nullptr;
+		int m_cbSize = 0;
+		MockIdentity m_identityPeer;
+		MockMessages *owner = nullptr;
+		std::vector<uint8_t> buffer;
+
+		int GetSize() const {
+			return m_cbSize;
+		}
+
+		void Release();
+	};
+
+	// Stands in for ISteamNetworkingMessages on one machine: sends copy the
+	// message as Steam does and queue it on its channel, receives hand out
+	// up to the requested number at once. Released messages go back on a
+	// free list, so a warmed up mock allocates nothing.
+	class MockMessages {
+		public:
+		MockMessages() {
+			messages.resize(MOCK_QUEUE_SIZE);
+			for (auto &msg : messages) {
+				msg.owner = this;
+				free.push_back(&msg);
+			}
+		}
+
+		// false where Steam would fail the send with k_EResultLimitExceeded
+		bool SendMessageToUser(uint64_t steamID, const void *data, uint32_t size, int, int channel) {
+			if (free.empty() || channel < 0 || channel >= MOCK_CHANNELS) {
+				return false;
+			}
+			auto &queue = queues[channel];
+			auto msg = free.back();
+			free.pop_back();
+			msg->buffer.resize(size);
+			memcpy(msg->buffer.data(), data, size);
+			msg->m_pData = msg->buffer.data();
+			msg->m_cbSize = static_cast<int>(size);
+			msg->m_identityPeer.steamID.steamID = steamID;
+			queue.slots[(queue.head + queue.count) % MOCK_QUEUE_SIZE] = msg;
+			queue.count++;
+			return true;
+		}
+
+		int ReceiveMessagesOnChannel(int channel, MockMessage **out, int max) {
+			if (channel < 0 || channel >= MOCK_CHANNELS) {
+				return 0;
+			}
+			auto &queue = queues[channel];
+			int count = 0;
+			while (count < max && queue.count > 0) {
+				out[count++] = queue.slots[queue.head];
+				queue.head = (queue.head + 1) % MOCK_QUEUE_SIZE;
+				queue.count--;
+			}
+			return count;
+		}
+
+		void release(MockMessage *msg) {
+			free.push_back(msg);
+		}
+
+		private:
+		struct Queue {
+			std::array<MockMessage *, MOCK_QUEUE_SIZE> slots = {};
+			size_t head = 0;
+			size_t count = 0;
+		};
+
+		std::vector<MockMessage> messages;
+		std::vector<MockMessage *> free;
+		std::array<Queue, MOCK_CHANNELS> queues;
+	};
+
+	void MockMessage::Release() {
+		owner->release(this);
+	}
+
+
+	// appends frame to a FRAME_BATCH message as the batcher lays it out
+	static void addToBatch(std::vector<uint8_t> &message, std::span<const uint8_t> frame) {
+		if (message.empty()) {
+			message.push_back(frame::FRAME_BATCH);
+		}
+		auto offset = message.size();
+		message.resize(offset + frame::BATCH_ENTRY_HEADER_SIZE + frame.size());
+		frame::writeU16(message.data() + offset, static_cast<uint16_t>(frame.size()));
+		memcpy(message.data() + offset + frame::BATCH_ENTRY_HEADER_SIZE, frame.data(), frame.size());
+	}
+
+	// an IGMPv2 report for group, as a game joining it would send
+	static std::vector<uint8_t> makeReport(Address4 src, Address4 group) {
+		auto packet = makePacket(PROTOCOL_IGMP, 28, src, group);
+		auto p = packet.data() + 20;
+		memset(p, 0, 8);
+		p[0] = 0x16;
+		memcpy(p + 4, group.addr.data(), 4);
+		return packet;
+	}
+
+	void steamSuite(Runner &runner) {
+		auto peer = Address4({100, 64, 1, 2});
+		auto local = Address4({100, 100, 3, 4});
+		const uint64_t steamID = 76561197960265728ull;
+		// the receive path SteamNet runs, fed by the mock instead of Steam
+		route::PeerTable peers;
+		peers.publish({route::Peer{steamID, peer}});
+		igmp::Snooper snooper;
+		dispatch::Receiver receiver(peers, snooper, local, 1360);
+		uint64_t delivered = 0;
+		receiver.onData([&](const route::Peer &, Packet &packet) {
+			keep(packet.packet.data());
+			delivered++;
+		});
+
+		// sends every message in wire and takes them back off the mock
+		// the way SteamNet's poll() does, until the backoff would have us
+		// wait. Returns the number of polls.
+		auto drain = [&](MockMessages &messages, burst::Backoff &backoff, std::vector<MockMessage *> &msgs, const std::vector<std::vector<uint8_t>> &wire) {
+			for (auto &message : wire) {
+				messages.SendMessageToUser(steamID, message.data(), static_cast<uint32_t>(message.size()), 0, 0);
+			}
+			uint64_t polls = 0;
+			std::optional<std::chrono::microseconds> wait = std::chrono::microseconds(0);
+			while (wait && wait->count() == 0) {
+				auto count = burst::receive(messages, 0, std::span<MockMessage *>(msgs), [&](MockMessage *msg) {
+					receiver.receive(msg);
+				});
+				wait = backoff.next(count, static_cast<int>(msgs.size()), false);
+				polls++;
+			}
+			return polls;
+		};
+
+		// the run warmed the mock's and the receiver's buffers up, from
+		// here on nothing on the path may allocate. Every round has to
+		// hand perRound packets on.
+		auto checkWarm = [&](const std::string &name, uint64_t perRound, const std::function<void()> &round) {
+			if (!runner.selected(name)) {
+				return;
+			}
+			delivered = 0;
+			auto before = allocations();
+			for (uint64_t i = 0; i < 1000; i++) {
+				round();
+			}
+			auto count = allocations() - before;
+			runner.annotate("allocations", static_cast<double>(count));
+			if (count != 0) {
+				throw std::runtime_error(name + ": " + std::to_string(count) + " allocations in 1000 warm rounds");
+			}
+			if (delivered != perRound * 1000) {
+				throw std::runtime_error(name + ": " + std::to_string(delivered) + " packets delivered in 1000 rounds, expected " + std::to_string(perRound * 1000));
+			}
+		};
+
+		// a burst of plain packets, taken a message at a time and in
+		// batches of 64
+		for (auto size : {64, 1200}) {
+			std::vector<std::vector<uint8_t>> wire(64, makePacket(PROTOCOL_UDP, size, peer, local));
+			for (size_t batch : {1, 64}) {
+				MockMessages messages;
+				burst::Backoff backoff(std::chrono::microseconds(100), std::chrono::microseconds(10000));
+				std::vector<MockMessage *> msgs(batch);
+				uint64_t polls = 0;
+				uint64_t bursts = 0;
+				auto name = "steam/burst/" + std::to_string(size) + "/batch/" + std::to_string(batch);
+				auto round = [&]() {
+					polls += drain(messages, backoff, msgs, wire);
+					bursts++;
+				};
+				runner.run(name, size * 64, [&](uint64_t) {
+					round();
+				});
+				runner.annotate("polls_per_burst", bursts == 0 ? 0 : double(polls) / bursts);
+				checkWarm(name, wire.size(), round);
+			}
+		}
+
+		// everything the data channel carries in one round: a batch with
+		// a plain packet, a compression context and a packet compressed
+		// against it and an IGMP report, an FEC group that loses a data
+		// frame to be rebuilt from parity, and a fragmented packet
+		{
+			std::vector<std::vector<uint8_t>> wire;
+			size_t bytes = 0;
+			uint64_t perRound = 0;
+
+			std::vector<uint8_t> batch;
+			auto plain = makePacket(PROTOCOL_UDP, 200, peer, local);
+			addToBatch(batch, plain);
+			auto flow = makePacket(PROTOCOL_UDP, 300, peer, local);
+			compress::Compressor compressor;
+			std::vector<uint8_t> context;
+			std::vector<uint8_t> compressed;
+			while (compressed.empty()) {
+				auto packet4 = Packet4(flow);
+				std::vector<uint8_t> out;
+				compressor.compress(steamID, packet4, out);
+				if (out[0] == frame::FRAME_CONTEXT && context.empty()) {
+					context = out;
+				} else if (out[0] == frame::FRAME_COMPRESSED) {
+					compressed = out;
+				}
+			}
+			addToBatch(batch, context);
+			addToBatch(batch, compressed);
+			auto report = makeReport(peer, Address4({239, 1, 2, 3}));
+			addToBatch(batch, report);
+			wire.push_back(batch);
+			bytes += plain.size() + flow.size() * 2 + report.size();
+			perRound += 4;
+
+			fec::Encoder encoder;
+			encoder.setLoss(steamID, 0.1);
+			std::vector<uint8_t> data;
+			std::vector<std::vector<uint8_t>> parity;
+			size_t fecStart = wire.size();
+			for (size_t i = 0; i < fec::MAX_DATA; i++) {
+				auto packet = makePacket(PROTOCOL_UDP, 1000, peer, local);
+				packet[4] = static_cast<uint8_t>(i);
+				encoder.encode(steamID, packet, data, parity);
+				// the first data frame is lost on the way
+				if (i != 0) {
+					wire.push_back(data);
+				}
+				bytes += packet.size();
+				perRound++;
+			}
+			if (parity.empty()) {
+				throw std::logic_error("steam/receive/mixed: no parity for the FEC group");
+			}
+			for (auto &p : parity) {
+				wire.push_back(p);
+			}
+			size_t fecEnd = wire.size();
+
+			auto big = makePacket(PROTOCOL_TCP, 3000, peer, local);
+			size_t fragStart = wire.size();
+			frag::split(0, big, 1200, [&](std::span<const uint8_t> piece) {
+				wire.emplace_back(piece.begin(), piece.end());
+			});
+			bytes += big.size();
+			perRound++;
+
+			MockMessages messages;
+			burst::Backoff backoff(std::chrono::microseconds(100), std::chrono::microseconds(10000));
+			std::vector<MockMessage *> msgs(64);
+			// groups and fragments already seen would be taken for
+			// duplicates, every round sends new ones
+			uint16_t group = 0;
+			uint32_t fragment = 0;
+			auto round = [&]() {
+				group++;
+				fragment++;
+				for (size_t n = fecStart; n < fecEnd; n++) {
+					frame::writeU16(wire[n].data() + 1, group);
+				}
+				for (size_t n = fragStart; n < wire.size(); n++) {
+					frame::writeU32(wire[n].data() + 1, fragment);
+				}
+				drain(messages, backoff, msgs, wire);
+			};
+			runner.run("steam/receive/mixed", bytes, [&](uint64_t) {
+				round();
+			});
+			runner.annotate("messages", static_cast<double>(wire.size()));
+			checkWarm("steam/receive/mixed", perRound, round);
+		}
+	}
+}
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+#include "aead.h"
+
+namespace lpvpn::aead {
+	static uint32_t readLE32(const uint8_t *p) {
+		return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+	}
+
+	static void writeLE32(uint8_t *p, uint32_t value) {
+		p[0] = static_cast<uint8_t>(value);
+		p[1] = static_cast<uint8_t>(value >> 8);
+		p[2] = static_cast<uint8_t>(value >> 16);
+		p[3] = static_cast<uint8_t>(value >> 24);
+	}
+
+	static uint32_t rotl(uint32_t value, int count) {
+		return (value << count) | (value >> (32 - count));
+	}
+
+	static void quarterRound(uint32_t &a, uint32_t &b, uint32_t &c, uint32_t &d) {
+		a += b; d ^= a; d = rotl(d, 16);
+		c += d; b ^= c; b = rotl(b, 12);
+		a += b; d ^= a; d = rotl(d, 8);
+		c += d; b ^= c; b = rotl(b, 7);
+	}
+
+	static void chachaInit(const Key &key, uint32_t counter, const Nonce &nonce, uint32_t state[16]) {
+		state[0] = 0x61707865;
+		state[1] = 0x3320646E;
+		state[2] = 0x79622D32;
+		state[3] = 0x6B206574;
+		for (size_t i = 0; i < 8; i++) {
+			state[4 + i] = readLE32(key.data() + 4 * i);
+		}
+		state[12] = counter;
+		for (size_t i = 0; i < 3; i++) {
+			state[13 + i] = readLE32(nonce.data() + 4 * i);
+		}
+	}
+
+	// RFC 8439 section 2.3
+	static void chachaBlock(const uint32_t state[16], uint8_t out[64]) {
+		uint32_t x[16];
+		memcpy(x, state, sizeof(x));
+		for (size_t i = 0; i < 10; i++) {
+			quarterRound(x[0], x[4], x[8], x[12]);
+			quarterRound(x[1], x[5], x[9], x[13]);
+			quarterRound(x[2], x[6], x[10], x[14]);
+			quarterRound(x[3], x[7], x[11], x[15]);
+			quarterRound(x[0], x[5], x[10], x[15]);
+			quarterRound(x[1], x[6], x[11], x[12]);
+			quarterRound(x[2], x[7], x[8], x[13]);
+			quarterRound(x[3], x[4], x[9], x[14]);
+		}
+		for (size_t i = 0; i < 16; i++) {
+			writeLE32(out + 4 * i, x[i] + state[i]);
+		}
+	}
+
+	static void chachaXor(const Key &key, uint32_t counter, const Nonce &nonce, std::span<uint8_t> data) {
+		uint32_t state[16];
+		chachaInit(key, counter, nonce, state);
+		uint8_t stream[64];
+		for (size_t offset = 0; offset < data.size(); offset += 64, state[12]++) {
+			chachaBlock(state, stream);
+			auto n = std::min<size_t>(64, data.size() - offset);
+			for (size_t i = 0; i < n; i++) {
+				data[offset + i] ^= stream[i];
+			}
+		}
+	}
+
+	// RFC 8439 section 2.5, in 26 bit limbs so no 128 bit multiply is needed
+	class Poly1305 {
+		public:
+		Poly1305(const uint8_t key[32]) {
+			r[0] = readLE32(key) & 0x3FFFFFF;
+			r[1] = (readLE32(key + 3) >> 2) & 0x3FFFF03;
+			r[2] = (readLE32(key + 6) >> 4) & 0x3FFC0FF;
+			r[3] = (readLE32(key + 9) >> 6) & 0x3F03FFF;
+			r[4] = (readLE32(key + 12) >> 8) & 0x00FFFFF;
+			for (size_t i = 0; i < 4; i++) {
+				pad[i] = readLE32(key + 16 + 4 * i);
+			}
+		}
+
+		// data padded with zeros to a multiple of 16, as the AEAD wants it
+		void updatePadded(std::span<const uint8_t> data) {
+			size_t full = data.size() & ~size_t(15);
+			for (size_t i = 0; i < full; i += 16) {
+				block(data.data() + i);
+			}
+			if (full < data.size()) {
+				uint8_t last[16] = {};
+				memcpy(last, data.data() + full, data.size() - full);
+				block(last);
+			}
+		}
+
+		void update16(const uint8_t data[16]) {
+			block(data);
+		}
+
+		void finish(uint8_t tag[16]) {
+			const uint32_t MASK = 0x3FFFFFF;
+			uint32_t c;
+			c = h[1] >> 26; h[1] &= MASK;
+			h[2] += c; c = h[2] >> 26; h[2] &= MASK;
+			h[3] += c; c = h[3] >> 26; h[3] &= MASK;
+			h[4] += c; c = h[4] >> 26; h[4] &= MASK;
+			h[0] += c * 5; c = h[0] >> 26; h[0] &= MASK;
+			h[1] += c;
+
+			// h - p, taken if it doesn't go negative
+			uint32_t g[5];
+			g[0] = h[0] + 5; c = g[0] >> 26; g[0] &= MASK;
+			g[1] = h[1] + c; c = g[1] >> 26; g[1] &= MASK;
+			g[2] = h[2] + c; c = g[2] >> 26; g[2] &= MASK;
+			g[3] = h[3] + c; c = g[3] >> 26; g[3] &= MASK;
+			g[4] = h[4] + c - (1 << 26);
+			uint32_t select = (g[4] >> 31) - 1;
+			for (size_t i = 0; i < 5; i++) {
+				h[i] = (h[i] & ~select) | (g[i] & select);
+			}
+
+			uint32_t words[4] = {
+				h[0] | (h[1] << 26),
+				(h[1] >> 6) | (h[2] << 20),
+				(h[2] >> 12) | (h[3] << 14),
+				(h[3] >> 18) | (h[4] << 8),
+			};
+			uint64_t f = 0;
+			for (size_t i = 0; i < 4; i++) {
+				f = uint64_t(words[i]) + pad[i] + (f >> 32);
+				writeLE32(tag + 4 * i, static_cast<uint32_t>(f));
+			}
+		}
+
+		private:
+		void block(const uint8_t m[16]) {
+			const uint32_t MASK = 0x3FFFFFF;
+			h[0] += readLE32(m) & MASK;
+			h[1] += (readLE32(m + 3) >> 2) & MASK;
+			h[2] += (readLE32(m + 6) >> 4) & MASK;
+			h[3] += (readLE32(m + 9) >> 6) & MASK;
+			h[4] += (readLE32(m + 12) >> 8) | (1 << 24);
+
+			uint64_t s1 = r[1] * 5, s2 = r[2] * 5, s3 = r[3] * 5, s4 = r[4] * 5;
+			uint64_t d0 = uint64_t(h[0]) * r[0] + uint64_t(h[1]) * s4 + uint64_t(h[2]) * s3 + uint64_t(h[3]) * s2 + uint64_t(h[4]) * s1;
+			uint64_t d1 = uint64_t(h[0]) * r[1] + uint64_t(h[1]) * r[0] + uint64_t(h[2]) * s4 + uint64_t(h[3]) * s3 + uint64_t(h[4]) * s2;
+			uint64_t d2 = uint64_t(h[0]) * r[2] + uint64_t(h[1]) * r[1] + uint64_t(h[2]) * r[0] + uint64_t(h[3]) * s4 + uint64_t(h[4]) * s3;
+			uint64_t d3 = uint64_t(h[0]) * r[3] + uint64_t(h[1]) * r[2] + uint64_t(h[2]) * r[1] + uint64_t(h[3]) * r[0] + uint64_t(h[4]) * s4;
+			uint64_t d4 = uint64_t(h[0]) * r[4] + uint64_t(h[1]) * r[3] + uint64_t(h[2]) * r[2] + uint64_t(h[3]) * r[1] + uint64_t(h[4]) * r[0];
+
+			uint64_t c;
+			c = d0 >> 26; h[0] = d0 & MASK;
+			d1 += c; c = d1 >> 26; h[1] = d1 & MASK;
+			d2 += c; c = d2 >> 26; h[2] = d2 & MASK;
+			d3 += c; c = d3 >> 26; h[3] = d3 & MASK;
+			d4 += c; c = d4 >> 26; h[4] = d4 & MASK;
+			h[0] += static_cast<uint32_t>(c * 5);
+			c = h[0] >> 26; h[0] &= MASK;
+			h[1] += static_cast<uint32_t>(c);
+		}
+
+		uint32_t r[5];
+		uint32_t h[5] = {};
+		uint32_t pad[4];
+	};
+
+	// RFC 8439 section 2.8
+	static void computeTag(const Key &key, const Nonce &nonce, std::span<const uint8_t> aad, std::span<const uint8_t> ciphertext, uint8_t tag[TAG_SIZE]) {
+		uint32_t state[16];
+		chachaInit(key, 0, nonce, state);
+		uint8_t polyKey[64];
+		chachaBlock(state, polyKey);
+		Poly1305 poly(polyKey);
+		poly.updatePadded(aad);
+		poly.updatePadded(ciphertext);
+		uint8_t lengths[16];
+		uint64_t sizes[2] = {aad.size(), ciphertext.size()};
+		for (size_t i = 0; i < 2; i++) {
+			writeLE32(lengths + 8 * i, static_cast<uint32_t>(sizes[i]));
+			writeLE32(lengths + 8 * i + 4, static_cast<uint32_t>(sizes[i] >> 32));
+		}
+		poly.update16(lengths);
+		poly.finish(tag);
+	}
+
+	Key randomKey() {
+		std::random_device random;
+		Key key;
+		for (size_t i = 0; i < KEY_SIZE; i += 4) {
+			writeLE32(key.data() + i, random());
+		}
+		return key;
+	}
+
+	Nonce nonce(uint64_t counter) {
+		Nonce out = {};
+		writeLE32(out.data() + 4, static_cast<uint32_t>(counter));
+		writeLE32(out.data() + 8, static_cast<uint32_t>(counter >> 32));
+		return out;
+	}
+
+	void seal(const Key &key, const Nonce &nonce, std::span<const uint8_t> aad, std::span<uint8_t> data, uint8_t *tag) {
+		chachaXor(key, 1, nonce, data);
+		computeTag(key, nonce, aad, data, tag);
+	}
+
+	bool open(const Key &key, const Nonce &nonce, std::span<const uint8_t> aad, std::span<uint8_t> data, const uint8_t *tag) {
+		uint8_t expected[TAG_SIZE];
+		computeTag(key, nonce, aad, data, expected);
+		// constant time, a timing difference would leak the tag byte by byte
+		uint8_t diff = 0;
+		for (size_t i = 0; i < TAG_SIZE; i++) {
+			diff |= expected[i] ^ tag[i];
+		}
+		if (diff != 0) {
+			return false;
+		}
+		chachaXor(key, 1, nonce, data);
+		return true;
+	}
+}
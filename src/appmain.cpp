@@ -3,6 +3,7 @@
 #include <chrono>
 #include <thread>
 #include <queue>
+#include <map>
 #include <fstream>
 #include <iostream>
 
@@ -11,6 +12,8 @@
 #include "steam.h"
 #include "tun.h"
 #include "log.h"
+#include "metrics.h"
+#include "worker.h"
 
 enum EventCode {
 	EVENT_UI_EXIT = 1,
@@ -28,6 +31,8 @@ class LogRedirect {
 	}
 
 	~LogRedirect() {
+		// the log writer runs in the background, let it catch up first
+		log::flush();
 		std::clog.rdbuf(old);
 		file.flush();
 		file.close();
@@ -45,15 +50,66 @@ int appMain(int argc, char **argv) {
 
 	// check privacy flag
 	bool privacy = false;
+	steam::SteamNet::Options netOptions;
+	tun::Tun::Options tunOptions;
+	std::string metricsFilename;
+	size_t workers = 0;
+	// parsed once errors can be shown
+	std::vector<std::string> udpAdvertise;
+	netOptions.peerCache = "lpvpn.peers.bin";
 	for (int i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--privacy") == 0 || strcmp(argv[i], "-privacy") == 0) {
 			privacy = true;
+		} else if ((strcmp(argv[i], "--batch-latency") == 0 || strcmp(argv[i], "-batch-latency") == 0) && i + 1 < argc) {
+			// microseconds a packet may wait to be coalesced with others
+			netOptions.batchLatency = std::chrono::microseconds(atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--compress-headers") == 0 || strcmp(argv[i], "-compress-headers") == 0) {
+			netOptions.compressHeaders = true;
+		} else if (strcmp(argv[i], "--tun-offload") == 0 || strcmp(argv[i], "-tun-offload") == 0) {
+			tunOptions.offload = true;
+		} else if (strcmp(argv[i], "--tun-uring") == 0 || strcmp(argv[i], "-tun-uring") == 0) {
+			tunOptions.uring = true;
+		} else if ((strcmp(argv[i], "--peer-cache") == 0 || strcmp(argv[i], "-peer-cache") == 0) && i + 1 < argc) {
+			// empty to start without one
+			netOptions.peerCache = argv[++i];
+		} else if ((strcmp(argv[i], "--tunnel-mtu") == 0 || strcmp(argv[i], "-tunnel-mtu") == 0) && i + 1 < argc) {
+			// bytes per Steam message, bigger frames are fragmented in the tunnel
+			netOptions.tunnelMTU = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--fec") == 0 || strcmp(argv[i], "-fec") == 0) {
+			netOptions.fec = true;
+		} else if ((strcmp(argv[i], "--broadcast-rate") == 0 || strcmp(argv[i], "-broadcast-rate") == 0) && i + 1 < argc) {
+			// broadcast packets per second and sender, see the drop counters
+			// by port to tune it for a game
+			netOptions.broadcastRate = atof(argv[++i]);
+		} else if ((strcmp(argv[i], "--broadcast-burst") == 0 || strcmp(argv[i], "-broadcast-burst") == 0) && i + 1 < argc) {
+			netOptions.broadcastBurst = atof(argv[++i]);
+		} else if ((strcmp(argv[i], "--broadcast-dedup") == 0 || strcmp(argv[i], "-broadcast-dedup") == 0) && i + 1 < argc) {
+			// milliseconds during which a repeated broadcast is sent once
+			netOptions.broadcastDedup = std::chrono::milliseconds(atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--udp") == 0 || strcmp(argv[i], "-udp") == 0) {
+			netOptions.udp = true;
+		} else if ((strcmp(argv[i], "--udp-port") == 0 || strcmp(argv[i], "-udp-port") == 0) && i + 1 < argc) {
+			netOptions.udpPort = static_cast<uint16_t>(atoi(argv[++i]));
+		} else if ((strcmp(argv[i], "--udp-advertise") == 0 || strcmp(argv[i], "-udp-advertise") == 0) && i + 1 < argc) {
+			// an address peers can reach the UDP port on, may be repeated
+			udpAdvertise.push_back(argv[++i]);
+		} else if ((strcmp(argv[i], "--workers") == 0 || strcmp(argv[i], "-workers") == 0) && i + 1 < argc) {
+			// forwarding threads per direction, 0 forwards on the reading thread
+			workers = atoi(argv[++i]);
+		} else if ((strcmp(argv[i], "--metrics") == 0 || strcmp(argv[i], "-metrics") == 0) && i + 1 < argc) {
+			// file to keep updated with counters in Prometheus text format
+			metricsFilename = argv[++i];
 		}
 	}
 
 	std::string logFilename = "lpvpn.log.txt";
 	LogRedirect logRedirect(logFilename);
 
+	std::unique_ptr<metrics::Exporter> metricsExporter;
+	if (!metricsFilename.empty()) {
+		metricsExporter = std::make_unique<metrics::Exporter>(metricsFilename, std::chrono::seconds(5));
+	}
+
 	std::atomic<bool> hasEvent;
 	std::mutex eventMutex;
 	std::queue<EventCode> eventQueue;
@@ -75,21 +131,81 @@ int appMain(int argc, char **argv) {
 	});
 
 	try {
+		for (auto &addr : udpAdvertise) {
+			netOptions.udpAdvertise.push_back(ip::Address4::fromString(addr));
+		}
 		auto steam = std::make_shared<steam::Steam>();
-		auto steamNet = steam::SteamNet(steam);
-		auto tun = tun::Tun();
+		// declared first so they outlive steamNet and tun, which may still
+		// dispatch into them while shutting down
+		std::unique_ptr<worker::Pipeline> outbound;
+		std::unique_ptr<worker::Pipeline> inbound;
+		auto steamNet = steam::SteamNet(steam, netOptions);
+		auto tun = tun::Tun(tunOptions);
+		// the workers call into steamNet and tun, so however this scope is
+		// left they are stopped before those go; dispatches after that are
+		// dropped
+		struct StopPipelines {
+			std::unique_ptr<worker::Pipeline> &outbound;
+			std::unique_ptr<worker::Pipeline> &inbound;
+			~StopPipelines() {
+				for (auto pipeline : {outbound.get(), inbound.get()}) {
+					if (pipeline != nullptr) {
+						pipeline->stop();
+					}
+				}
+			}
+		} stopPipelines{outbound, inbound};
 
 		auto localIP = steamNet.localAddr();
 		ui.notify("Local IP", localIP.toString());
 		tun.setIP4(localIP);
+
+		if (workers > 0) {
+			// outbound is sharded by flow and inbound by peer, so ordering
+			// holds where it matters while forwarding spreads across cores
+			outbound = std::make_unique<worker::Pipeline>("outbound", workers, [&](ip::Packet &packet) {
+				steamNet.write(packet);
+			}, [&]() {
+				steamNet.flush();
+			});
+			inbound = std::make_unique<worker::Pipeline>("inbound", workers, [&](ip::Packet &packet) {
+				tun.write(packet);
+			}, [&]() {
+				tun.flush();
+			});
+			LOG("Forwarding on " << workers << " worker(s) per direction");
+		}
+
 		tun.onData([&](ip::Packet &packet) {
+			if (outbound != nullptr) {
+				outbound->dispatch(worker::flowHash(packet), packet.packet);
+				return;
+			}
 			steamNet.write(packet);
 		});
 
+		tun.onFlush([&]() {
+			// workers flush after each of their own bursts
+			if (outbound == nullptr) {
+				steamNet.flush();
+			}
+		});
+
 		steamNet.onData([&](ip::Packet &packet) {
+			if (inbound != nullptr) {
+				inbound->dispatch(worker::sourceHash(packet), packet.packet);
+				return;
+			}
 			tun.write(packet);
 		});
 
+		steamNet.onFlush([&]() {
+			// workers flush after each of their own bursts
+			if (inbound == nullptr) {
+				tun.flush();
+			}
+		});
+
 		auto exitCb = [&](ui::MenuItem &mi){
 			std::lock_guard<std::mutex> lk(eventMutex);
 			eventQueue.push(EventCode::EVENT_UI_EXIT);
@@ -107,10 +223,23 @@ int appMain(int argc, char **argv) {
 			ui.openURL(*std::static_pointer_cast<std::string>(mi.userData));
 		};
 
-		steamNet.onEndpoints([&](std::vector<steam::SteamNet::Endpoint> &endpoints) {
+		// only touched from the onEndpoints callback, which never runs
+		// concurrently with itself
+		std::map<uint64_t, steam::SteamNet::Endpoint> endpoints;
+		steamNet.onEndpoints([&](const steam::SteamNet::EndpointDiff &diff) {
+			for (auto &endpoint : diff.removed) {
+				endpoints.erase(endpoint.steamID);
+			}
+			for (auto &endpoint : diff.added) {
+				endpoints.insert_or_assign(endpoint.steamID, endpoint);
+			}
+			for (auto &endpoint : diff.changed) {
+				endpoints.insert_or_assign(endpoint.steamID, endpoint);
+			}
+
 			auto allFriendsMenu = std::make_shared<std::vector<ui::MenuItem>>();
 			auto onlineFriendsMenu = std::make_shared<std::vector<ui::MenuItem>>();
-			for (auto &endpoint : endpoints) {
+			for (auto &[steamID, endpoint] : endpoints) {
 				auto ptr = std::make_shared<steam::SteamNet::Endpoint>(endpoint);
 				auto text = endpoint.name + " (" + endpoint.addr.toString() + ")";
 				if (privacy) {
@@ -128,6 +257,10 @@ int appMain(int argc, char **argv) {
 					}
 					text = name + " (" + ipstr + ")";
 				}
+				// only peers we've exchanged packets with have been measured
+				if (endpoint.latency.samples > 0) {
+					text += " - " + std::to_string((endpoint.latency.rtt.count() + 500) / 1000) + " ms";
+				}
 				allFriendsMenu->push_back({
 					text,
 					nullptr,
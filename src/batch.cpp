@@ -0,0 +1,183 @@
+#include <cstring>
+
+#include "batch.h"
+#include "frame.h"
+
+namespace lpvpn::batch {
+	Batcher::Batcher(std::chrono::microseconds latency, size_t mtu, SendFn send):
+		latency(latency), mtu(mtu), send(send),
+		packetCount(metrics::registry().counter("lpvpn_batch_packets_total", "Packets handed to the batcher")),
+		messageCount(metrics::registry().counter("lpvpn_batch_messages_total", "Messages sent by the batcher")),
+		batchSize(metrics::registry().histogram("lpvpn_batch_size_packets", "Packets per batched message")),
+		queued(metrics::registry().gauge("lpvpn_batch_queued_packets", "Packets waiting in batch queues")),
+		wakeups(metrics::wakeups("batch_flush")) {
+		thread = std::thread([this]() {
+			std::unique_lock<std::mutex> lk(flusherMutex);
+			while (this->running) {
+				wakeups.add();
+				woken = false;
+				wakeAt = Clock::time_point::max().time_since_epoch().count();
+				lk.unlock();
+				auto now = Clock::now();
+				auto next = Clock::time_point::max();
+				for (auto &shard : shards) {
+					std::lock_guard<std::mutex> shardLock(shard.mutex);
+					for (auto &[peer, queue] : shard.queues) {
+						if (queue.packets.empty()) {
+							continue;
+						}
+						if (queue.deadline <= now) {
+							sendQueue(shard, peer, queue);
+						} else if (queue.deadline < next) {
+							next = queue.deadline;
+						}
+					}
+				}
+				lk.lock();
+				if (woken) {
+					// a batch started behind us
+					continue;
+				}
+				wakeAt = next.time_since_epoch().count();
+				if (next == Clock::time_point::max()) {
+					cv.wait(lk);
+				} else {
+					cv.wait_until(lk, next);
+				}
+			}
+		});
+	}
+
+	Batcher::~Batcher() {
+		{
+			std::lock_guard<std::mutex> lk(flusherMutex);
+			running = false;
+		}
+		cv.notify_all();
+		thread.join();
+		flush();
+	}
+
+	void Batcher::enqueue(uint64_t peer, std::span<const uint8_t> packet) {
+		packetCount.add();
+		auto &shard = shardOf(peer);
+		std::lock_guard<std::mutex> lk(shard.mutex);
+		auto &queue = shard.queues[peer];
+		if (!fits(packet.size())) {
+			sendAlone(shard, peer, queue, packet);
+			return;
+		}
+		append(shard, peer, queue, pool::Buffer::copy(packet));
+	}
+
+	void Batcher::enqueue(uint64_t peer, const pool::Buffer &packet) {
+		packetCount.add();
+		auto &shard = shardOf(peer);
+		std::lock_guard<std::mutex> lk(shard.mutex);
+		auto &queue = shard.queues[peer];
+		if (!fits(packet.size())) {
+			sendAlone(shard, peer, queue, packet.span());
+			return;
+		}
+		append(shard, peer, queue, packet);
+	}
+
+	void Batcher::enqueue(std::span<const uint64_t> peers, const pool::Buffer &packet) {
+		packetCount.add(peers.size());
+		bool fit = fits(packet.size());
+		for (auto peer : peers) {
+			auto &shard = shardOf(peer);
+			std::lock_guard<std::mutex> lk(shard.mutex);
+			auto &queue = shard.queues[peer];
+			if (fit) {
+				append(shard, peer, queue, packet);
+			} else {
+				sendAlone(shard, peer, queue, packet.span());
+			}
+		}
+	}
+
+	Batcher::Shard &Batcher::shardOf(uint64_t peer) {
+		// Steam IDs differ mostly in their low bits
+		return shards[(peer * 0x9E3779B97F4A7C15ull >> 32) % SHARDS];
+	}
+
+	bool Batcher::fits(size_t size) const {
+		return frame::BATCH_HEADER_SIZE + frame::BATCH_ENTRY_HEADER_SIZE + size <= mtu;
+	}
+
+	void Batcher::sendAlone(Shard &shard, uint64_t peer, Queue &queue, std::span<const uint8_t> packet) {
+		// too big to share a message, keep ordering and send it on its own
+		sendQueue(shard, peer, queue);
+		messageCount.add();
+		batchSize.observe(1);
+		send(peer, packet);
+	}
+
+	// must hold the shard's mutex
+	void Batcher::append(Shard &shard, uint64_t peer, Queue &queue, const pool::Buffer &packet) {
+		auto entrySize = frame::BATCH_ENTRY_HEADER_SIZE + packet.size();
+		if (!queue.packets.empty() && queue.size + entrySize > mtu) {
+			sendQueue(shard, peer, queue);
+		}
+		if (queue.packets.empty()) {
+			queue.size = frame::BATCH_HEADER_SIZE;
+			queue.deadline = Clock::now() + latency;
+		}
+		queue.packets.push_back(packet);
+		queue.size += entrySize;
+		queued.add(1);
+		if (queue.packets.size() == 1) {
+			wake(queue.deadline);
+		}
+	}
+
+	// a queue is behind the shard's lock until it is sent, so a flusher
+	// that published wakeAt without seeing it will look again by then
+	void Batcher::wake(Clock::time_point deadline) {
+		if (deadline.time_since_epoch().count() >= wakeAt) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lk(flusherMutex);
+			woken = true;
+		}
+		cv.notify_one();
+	}
+
+	void Batcher::flush() {
+		for (auto &shard : shards) {
+			std::lock_guard<std::mutex> lk(shard.mutex);
+			for (auto &[peer, queue] : shard.queues) {
+				sendQueue(shard, peer, queue);
+			}
+		}
+	}
+
+	// sends whatever is queued for peer, must hold the shard's mutex
+	void Batcher::sendQueue(Shard &shard, uint64_t peer, Queue &queue) {
+		auto count = queue.packets.size();
+		if (count == 0) {
+			return;
+		}
+		messageCount.add();
+		batchSize.observe(count);
+		queued.add(-static_cast<int64_t>(count));
+		if (count == 1) {
+			// no point paying for the framing
+			send(peer, queue.packets[0].span());
+		} else {
+			auto &message = shard.message;
+			message.resize(queue.size);
+			message[0] = frame::FRAME_BATCH;
+			auto p = message.data() + frame::BATCH_HEADER_SIZE;
+			for (auto &packet : queue.packets) {
+				frame::writeU16(p, static_cast<uint16_t>(packet.size()));
+				memcpy(p + frame::BATCH_ENTRY_HEADER_SIZE, packet.data(), packet.size());
+				p += frame::BATCH_ENTRY_HEADER_SIZE + packet.size();
+			}
+			send(peer, message);
+		}
+		queue.packets.clear();
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "pool.h"
+
+namespace lpvpn::batch {
+	// Coalesces small packets bound for the same peer into FRAME_BATCH
+	// messages. A batch is sent once it would exceed the MTU or once its
+	// first packet has waited for the latency budget. Queues hold pool
+	// buffers, so a packet enqueued for many peers is stored once. Peers
+	// are spread over SHARDS locks and send() runs under the peer's, so
+	// workers sending to different peers rarely wait for each other while
+	// one peer's messages still leave in order.
+	class Batcher {
+		public:
+		using SendFn = std::function<void(uint64_t peer, std::span<const uint8_t> message)>;
+
+		Batcher(std::chrono::microseconds latency, size_t mtu, SendFn send);
+		~Batcher();
+
+		void enqueue(uint64_t peer, std::span<const uint8_t> packet);
+		void enqueue(uint64_t peer, const pool::Buffer &packet);
+		// fan-out: queues the same buffer for every peer
+		void enqueue(std::span<const uint64_t> peers, const pool::Buffer &packet);
+		void flush();
+
+		static const size_t SHARDS = 16;
+
+		private:
+		using Clock = std::chrono::steady_clock;
+
+		struct Queue {
+			std::vector<pool::Buffer> packets;
+			// size of the batch frame the packets will make up
+			size_t size = 0;
+			Clock::time_point deadline;
+		};
+
+		struct alignas(64) Shard {
+			std::mutex mutex;
+			std::map<uint64_t, Queue> queues;
+			// batch frames are assembled here, only touched under mutex
+			std::vector<uint8_t> message;
+		};
+
+		Shard &shardOf(uint64_t peer);
+		bool fits(size_t size) const;
+		// sends an oversized packet on its own, must hold the shard's mutex
+		void sendAlone(Shard &shard, uint64_t peer, Queue &queue, std::span<const uint8_t> packet);
+		void append(Shard &shard, uint64_t peer, Queue &queue, const pool::Buffer &packet);
+		void sendQueue(Shard &shard, uint64_t peer, Queue &queue);
+		// wakes the flusher for a deadline before the one it sleeps to
+		void wake(Clock::time_point deadline);
+
+		std::chrono::microseconds latency;
+		size_t mtu;
+		SendFn send;
+
+		std::array<Shard, SHARDS> shards;
+		// the flusher sleeps on these, never while holding a shard
+		std::mutex flusherMutex;
+		std::condition_variable cv;
+		bool woken = false;
+		// when the flusher looks next, the maximum while it is looking
+		std::atomic<Clock::rep> wakeAt = Clock::time_point::max().time_since_epoch().count();
+		std::atomic<bool> running = true;
+		std::thread thread;
+
+		metrics::Counter &packetCount;
+		metrics::Counter &messageCount;
+		metrics::Histogram &batchSize;
+		metrics::Gauge &queued;
+		metrics::Counter &wakeups;
+	};
+}
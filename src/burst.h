@@ -0,0 +1,60 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <span>
+
+namespace lpvpn::burst {
+	// Takes up to batch.size() messages off channel in one call and hands
+	// each to handle, releasing it only once handle returns so whatever
+	// handle passes on may point into it. Messages is anything shaped like
+	// ISteamNetworkingMessages, which lets the benchmarks run it against a
+	// mock without Steam. Returns how many messages there were.
+	template<typename Messages, typename Message, typename H>
+	int receive(Messages &messages, int channel, std::span<Message *> batch, H handle) {
+		auto count = messages.ReceiveMessagesOnChannel(channel, batch.data(), static_cast<int>(batch.size()));
+		for (int i = 0; i < count; i++) {
+			handle(batch[i]);
+			batch[i]->Release();
+		}
+		return count;
+	}
+
+	// When to poll again. Steam has no way to signal that a message
+	// arrived: after traffic the queue is polled again with an exponential
+	// backoff from min, and once that reaches max the receiver goes idle
+	// until something else polls.
+	class Backoff {
+		public:
+		Backoff(std::chrono::microseconds min, std::chrono::microseconds max): min(min), max(max), wait(min) {}
+
+		// after a poll that took count messages of at most batch: how long
+		// to wait, 0 if more are probably waiting, nothing to go idle
+		std::optional<std::chrono::microseconds> next(int count, int batch, bool idle) {
+			if (count > 0) {
+				wait = min;
+			} else if (idle) {
+				return std::nullopt;
+			} else {
+				wait = std::min(wait * 2, max);
+			}
+			if (count == batch) {
+				return std::chrono::microseconds(0);
+			}
+			if (count <= 0 && wait >= max) {
+				return std::nullopt;
+			}
+			return wait;
+		}
+
+		// something is on its way, start over from min
+		void reset() {
+			wait = min;
+		}
+
+		private:
+		std::chrono::microseconds min;
+		std::chrono::microseconds max;
+		std::chrono::microseconds wait;
+	};
+}
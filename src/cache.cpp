@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "cache.h"
+#include "file.h"
+#include "log.h"
+
+namespace lpvpn::cache {
+	static const char MAGIC[4] = {'L', 'P', 'P', 'C'};
+
+	struct Header {
+		char magic[4];
+		uint32_t version;
+		uint64_t localSteamID;
+		uint32_t count;
+		uint32_t recordSize;
+	};
+
+	struct Record {
+		uint64_t steamID;
+		uint32_t addr;
+		uint8_t online;
+		uint8_t nameLength;
+		char name[NAME_SIZE];
+	};
+
+	// read-only mapping of a whole file, empty if it can't be mapped
+	class Mapping {
+		public:
+		Mapping(const std::string &path) {
+#ifdef _WIN32
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE) {
+				return;
+			}
+			LARGE_INTEGER fileSize;
+			if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+				return;
+			}
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping == nullptr) {
+				return;
+			}
+			auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			if (view == nullptr) {
+				return;
+			}
+			data = static_cast<const uint8_t *>(view);
+			size = static_cast<size_t>(fileSize.QuadPart);
+#else
+			auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				return;
+			}
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0) {
+				auto view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (view != MAP_FAILED) {
+					data = static_cast<const uint8_t *>(view);
+					size = st.st_size;
+				}
+			}
+			close(fd);
+#endif
+		}
+
+		~Mapping() {
+#ifdef _WIN32
+			if (data != nullptr) {
+				UnmapViewOfFile(data);
+			}
+			if (mapping != nullptr) {
+				CloseHandle(mapping);
+			}
+			if (file != INVALID_HANDLE_VALUE) {
+				CloseHandle(file);
+			}
+#else
+			if (data != nullptr) {
+				munmap(const_cast<uint8_t *>(data), size);
+			}
+#endif
+		}
+
+		Mapping(const Mapping &) = delete;
+		Mapping &operator=(const Mapping &) = delete;
+
+		const uint8_t *data = nullptr;
+		size_t size = 0;
+
+		private:
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+	};
+
+	std::vector<Entry> load(const std::string &path, uint64_t localSteamID) {
+		Mapping mapping(path);
+		if (mapping.data == nullptr || mapping.size < sizeof(Header)) {
+			return {};
+		}
+		Header header;
+		memcpy(&header, mapping.data, sizeof(header));
+		if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.recordSize != sizeof(Record)) {
+			LOG("Ignoring " << path << ", unknown format");
+			return {};
+		}
+		if (header.localSteamID != localSteamID) {
+			LOG("Ignoring " << path << ", written for another user");
+			return {};
+		}
+		if (mapping.size < sizeof(Header) + static_cast<size_t>(header.count) * sizeof(Record)) {
+			LOG("Ignoring " << path << ", truncated");
+			return {};
+		}
+
+		std::vector<Entry> entries;
+		entries.reserve(header.count);
+		auto records = mapping.data + sizeof(Header);
+		for (uint32_t i = 0; i < header.count; i++) {
+			Record record;
+			memcpy(&record, records + i * sizeof(Record), sizeof(record));
+			auto nameLength = std::min<size_t>(record.nameLength, NAME_SIZE);
+			entries.push_back({record.steamID, Address4(record.addr), std::string(record.name, nameLength), record.online != 0});
+		}
+		return entries;
+	}
+
+	void save(const std::string &path, uint64_t localSteamID, const std::vector<Entry> &entries) {
+		Header header = {};
+		memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.version = VERSION;
+		header.localSteamID = localSteamID;
+		header.count = static_cast<uint32_t>(entries.size());
+		header.recordSize = sizeof(Record);
+
+		auto tmp = path + ".tmp";
+		{
+			std::ofstream file(tmp, std::ios_base::binary | std::ios_base::trunc);
+			if (!file) {
+				LOG("Failed to open " << tmp);
+				return;
+			}
+			file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			for (auto &entry : entries) {
+				Record record = {};
+				record.steamID = entry.steamID;
+				record.addr = entry.addr.toUint32();
+				record.online = entry.online ? 1 : 0;
+				record.nameLength = static_cast<uint8_t>(std::min(entry.name.size(), NAME_SIZE));
+				memcpy(record.name, entry.name.data(), record.nameLength);
+				file.write(reinterpret_cast<const char *>(&record), sizeof(record));
+			}
+			if (!file) {
+				LOG("Failed to write " << tmp);
+				return;
+			}
+		}
+		if (!file::replace(tmp, path)) {
+			LOG("Failed to write " << path);
+		}
+	}
+}
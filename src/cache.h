@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ip.h"
+
+namespace lpvpn::cache {
+	using namespace lpvpn::ip;
+
+	// The peer table as last seen, so a restart can route and show the menu
+	// before Steam has been asked about every friend. The file is a header
+	// followed by fixed size records in host byte order, it is only ever
+	// read back on the machine that wrote it.
+	const uint32_t VERSION = 1;
+	// Steam persona names are at most 128 bytes of UTF-8
+	const size_t NAME_SIZE = 128;
+
+	struct Entry {
+		uint64_t steamID;
+		Address4 addr;
+		std::string name;
+		bool online;
+	};
+
+	// Maps the file and copies out its entries, with the addresses they had
+	// so peers keep them across restarts. Returns nothing if the file is
+	// missing, from another version or was written for another user.
+	std::vector<Entry> load(const std::string &path, uint64_t localSteamID);
+	// Replaces the file through a temporary, so readers and crashes leave
+	// either the old file or the new one.
+	void save(const std::string &path, uint64_t localSteamID, const std::vector<Entry> &entries);
+}
@@ -0,0 +1,195 @@
+#include <cstring>
+
+#include "compress.h"
+#include "frame.h"
+
+// a new context is announced with its first few packets, then refreshed
+// every CONTEXT_REFRESH packets in case all announcements were lost
+#define CONTEXT_REPEAT 3
+#define CONTEXT_REFRESH 64
+
+#define IP_HEADER_SIZE 20
+#define UDP_HEADER_SIZE 8
+// type, context, IP ID, UDP checksum
+#define COMPRESSED_HEADER_SIZE 6
+
+namespace lpvpn::compress {
+	using frame::readU16;
+	using frame::writeU16;
+
+	static uint16_t fold(uint32_t sum) {
+		while (sum >> 16) {
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		}
+		return static_cast<uint16_t>(sum);
+	}
+
+	// the static part of a plain IPv4 / UDP packet, false for anything we
+	// don't compress (options, fragments, other protocols)
+	static bool describe(Packet4 &packet, Context &ctx) {
+		auto p = packet.packet.data();
+		if (packet.packet.size() < IP_HEADER_SIZE + UDP_HEADER_SIZE || p[0] != 0x45 || packet.protocol() != PROTOCOL_UDP) {
+			return false;
+		}
+		// MF set or non-zero offset
+		if ((readU16(p + 6) & 0x3FFF) != 0) {
+			return false;
+		}
+		if (packet.totalLength() != packet.packet.size() || readU16(p + 24) != packet.packet.size() - IP_HEADER_SIZE) {
+			return false;
+		}
+		ctx.tos = p[1];
+		ctx.flags = p[6] >> 5;
+		ctx.ttl = p[8];
+		ctx.checksum = readU16(p + 26) != 0;
+		ctx.srcPort = readU16(p + 20);
+		ctx.dstPort = readU16(p + 22);
+		return true;
+	}
+
+	static bool sameFlow(const Context &a, const Context &b) {
+		return a.srcPort == b.srcPort && a.dstPort == b.dstPort;
+	}
+
+	static bool sameStatic(const Context &a, const Context &b) {
+		return sameFlow(a, b) && a.tos == b.tos && a.ttl == b.ttl && a.flags == b.flags && a.checksum == b.checksum;
+	}
+
+	// Compressor
+	Compressor::Compressor() {}
+	Compressor::~Compressor() {}
+
+	bool Compressor::compress(uint64_t peer, Packet4 &packet, std::vector<uint8_t> &out) {
+		Context current;
+		if (!describe(packet, current)) {
+			return false;
+		}
+
+		uint8_t id;
+		bool announce;
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			auto &contexts = peers[peer];
+			size_t slot = CONTEXT_COUNT;
+			size_t oldest = 0;
+			for (size_t i = 0; i < CONTEXT_COUNT; i++) {
+				if (contexts[i].valid && sameFlow(contexts[i], current)) {
+					slot = i;
+					break;
+				}
+				if (!contexts[i].valid || contexts[i].lastUsed < contexts[oldest].lastUsed) {
+					oldest = i;
+				}
+			}
+			if (slot == CONTEXT_COUNT || !sameStatic(contexts[slot], current)) {
+				if (slot == CONTEXT_COUNT) {
+					slot = oldest;
+				}
+				// a slot's first context is generation 0, as older builds send
+				auto generation = contexts[slot].valid ? (contexts[slot].generation + 1) % GENERATIONS : 0;
+				contexts[slot] = current;
+				contexts[slot].valid = true;
+				contexts[slot].generation = static_cast<uint8_t>(generation);
+			}
+			auto &ctx = contexts[slot];
+			ctx.lastUsed = ++clock;
+			announce = ctx.sent < CONTEXT_REPEAT || ctx.sent % CONTEXT_REFRESH == 0;
+			ctx.sent++;
+			id = static_cast<uint8_t>(ctx.generation << 4 | slot);
+		}
+
+		auto p = packet.packet.data();
+		if (announce) {
+			out.resize(2 + packet.packet.size());
+			out[0] = frame::FRAME_CONTEXT;
+			out[1] = id;
+			memcpy(out.data() + 2, p, packet.packet.size());
+			return true;
+		}
+
+		auto payload = packet.packet.subspan(IP_HEADER_SIZE + UDP_HEADER_SIZE);
+		out.resize(COMPRESSED_HEADER_SIZE + payload.size());
+		out[0] = frame::FRAME_COMPRESSED;
+		out[1] = id;
+		memcpy(out.data() + 2, p + 4, 2);
+		uint16_t checksum = 0;
+		if (current.checksum) {
+			// strip the addresses out of the checksum, the receiver adds its
+			// own view of them back
+			uint32_t sum = static_cast<uint16_t>(~readU16(p + 26));
+			sum += static_cast<uint16_t>(~onesComplementSum(packet.packet.subspan(12, 8)));
+			checksum = fold(sum);
+		}
+		writeU16(out.data() + 4, checksum);
+		memcpy(out.data() + COMPRESSED_HEADER_SIZE, payload.data(), payload.size());
+		return true;
+	}
+
+	// Decompressor
+	Decompressor::Decompressor() {}
+	Decompressor::~Decompressor() {}
+
+	std::span<uint8_t> Decompressor::decompress(uint64_t peer, std::span<uint8_t> frame, Address4 src, Address4 dst) {
+		if (frame.size() < 2) {
+			return {};
+		}
+		auto slot = frame[1] & 0x0F;
+		auto generation = frame[1] >> 4;
+
+		std::lock_guard<std::mutex> lk(mutex);
+		auto &ctx = peers[peer][slot];
+
+		if (frame[0] == frame::FRAME_CONTEXT) {
+			auto data = frame.subspan(2);
+			auto packet = Packet4(data);
+			Context next;
+			if (!describe(packet, next)) {
+				return {};
+			}
+			ctx = next;
+			ctx.valid = true;
+			ctx.generation = static_cast<uint8_t>(generation);
+			return data;
+		}
+
+		// a packet of the slot's next flow whose announcements didn't make it
+		if (frame[0] != frame::FRAME_COMPRESSED || frame.size() < COMPRESSED_HEADER_SIZE || !ctx.valid || ctx.generation != generation) {
+			return {};
+		}
+		auto payload = frame.subspan(COMPRESSED_HEADER_SIZE);
+		size_t size = IP_HEADER_SIZE + UDP_HEADER_SIZE + payload.size();
+		if (size > UINT16_MAX) {
+			return {};
+		}
+		buffer.resize(size);
+		auto p = buffer.data();
+		p[0] = 0x45;
+		p[1] = ctx.tos;
+		writeU16(p + 2, static_cast<uint16_t>(size));
+		memcpy(p + 4, frame.data() + 2, 2);
+		p[6] = ctx.flags << 5;
+		p[7] = 0;
+		p[8] = ctx.ttl;
+		p[9] = PROTOCOL_UDP;
+		memcpy(p + 12, src.addr.data(), 4);
+		memcpy(p + 16, dst.addr.data(), 4);
+		writeU16(p + 20, ctx.srcPort);
+		writeU16(p + 22, ctx.dstPort);
+		writeU16(p + 24, static_cast<uint16_t>(size - IP_HEADER_SIZE));
+		uint16_t checksum = 0;
+		if (ctx.checksum) {
+			uint32_t sum = readU16(frame.data() + 4);
+			sum += onesComplementSum(std::span<const uint8_t>(p + 12, 8));
+			checksum = ~fold(sum);
+			if (checksum == 0) {
+				checksum = 0xFFFF;
+			}
+		}
+		writeU16(p + 26, checksum);
+		memcpy(p + IP_HEADER_SIZE + UDP_HEADER_SIZE, payload.data(), payload.size());
+
+		auto packet = Packet4(buffer);
+		packet.recalculateChecksum();
+		return buffer;
+	}
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include "ip.h"
+
+namespace lpvpn::compress {
+	using namespace lpvpn::ip;
+
+	// Per-flow IPv4 / UDP header compression, loosely modelled on ROHC's
+	// unidirectional mode. Addresses are never sent since both ends derive
+	// them from the peer mapping; the static fields of a flow (ports, TOS,
+	// TTL, flags) live in a per-peer context established by FRAME_CONTEXT
+	// and refreshed periodically in case that frame was lost. After that a
+	// packet costs FRAME_COMPRESSED's 6 bytes instead of 28.
+	// Frames name a context by slot in the low 4 bits of their second byte
+	// and its generation in the high 4. A slot taken over by another flow
+	// moves on a generation, so packets for it aren't rebuilt from what the
+	// slot held before while its announcements are lost.
+	const size_t CONTEXT_COUNT = 16;
+	const size_t GENERATIONS = 16;
+
+	struct Context {
+		bool valid = false;
+		uint8_t generation = 0;
+		uint8_t tos = 0;
+		uint8_t ttl = 0;
+		uint8_t flags = 0;
+		bool checksum = false;
+		uint16_t srcPort = 0;
+		uint16_t dstPort = 0;
+		// sender only
+		uint64_t lastUsed = 0;
+		uint32_t sent = 0;
+	};
+
+	class Compressor {
+		public:
+		Compressor();
+		~Compressor();
+
+		// fills out with the frame to send for packet, false if the packet
+		// can't be compressed and should be sent as is
+		bool compress(uint64_t peer, Packet4 &packet, std::vector<uint8_t> &out);
+
+		private:
+		std::mutex mutex;
+		std::map<uint64_t, std::array<Context, CONTEXT_COUNT>> peers;
+		uint64_t clock = 0;
+	};
+
+	class Decompressor {
+		public:
+		Decompressor();
+		~Decompressor();
+
+		// turns a FRAME_CONTEXT / FRAME_COMPRESSED frame from peer back into
+		// an IPv4 packet from src to dst. The result may point into frame or
+		// into an internal buffer valid until the next call; it is empty if
+		// the frame is malformed or refers to an unknown context.
+		std::span<uint8_t> decompress(uint64_t peer, std::span<uint8_t> frame, Address4 src, Address4 dst);
+
+		private:
+		std::mutex mutex;
+		std::map<uint64_t, std::array<Context, CONTEXT_COUNT>> peers;
+		std::vector<uint8_t> buffer;
+	};
+}
@@ -0,0 +1,111 @@
+#include <chrono>
+
+#include "dispatch.h"
+#include "frame.h"
+
+namespace lpvpn::dispatch {
+	Receiver::Receiver(route::PeerTable &peers, igmp::Snooper &snooper, Address4 local, uint16_t mss):
+		peers(peers), snooper(snooper), local(local), mss(mss) {}
+	Receiver::~Receiver() {}
+
+	void Receiver::onData(Handler cb) {
+		onDataCb = cb;
+	}
+
+	void Receiver::receive(uint64_t steamID, std::span<uint8_t> message) {
+		// the snapshot stays ours until the message is handled, so the
+		// peer and whatever hangs off it can't go away under onData
+		auto reader = peers.read();
+		auto peer = reader.find(steamID);
+		if (peer == nullptr) {
+			dropUnknownPeer.add();
+			return;
+		}
+		if (!message.empty() && message[0] == frame::FRAME_BATCH) {
+			frame::forEachInBatch(message, [&](std::span<uint8_t> entry) {
+				receiveFrame(*peer, entry);
+			});
+			return;
+		}
+		receiveFrame(*peer, message);
+	}
+
+	void Receiver::receiveFrame(const route::Peer &peer, std::span<uint8_t> data) {
+		if (frame::isPacket(data)) {
+			receivePacket(peer, data);
+			return;
+		}
+		if (data.empty()) {
+			dropMalformed.add();
+			return;
+		}
+		switch (data[0]) {
+			case frame::FRAME_FRAGMENT: {
+				auto whole = reassembler.add(peer.steamID, data);
+				if (whole.empty()) {
+					break;
+				}
+				if (whole[0] == frame::FRAME_FRAGMENT) {
+					dropMalformed.add();
+					break;
+				}
+				if (whole[0] == frame::FRAME_BATCH) {
+					// batches bigger than a transport's MTU are split.
+					// Fragments inside one would reassemble over the
+					// buffer being read.
+					frame::forEachInBatch(whole, [&](std::span<uint8_t> entry) {
+						if (entry[0] == frame::FRAME_FRAGMENT) {
+							dropMalformed.add();
+							return;
+						}
+						receiveFrame(peer, entry);
+					});
+					break;
+				}
+				receiveFrame(peer, whole);
+				break;
+			}
+			case frame::FRAME_FEC_DATA:
+			case frame::FRAME_FEC_PARITY:
+				for (auto inner : decoder.receive(peer.steamID, data)) {
+					if (inner[0] == frame::FRAME_FEC_DATA || inner[0] == frame::FRAME_FEC_PARITY) {
+						dropMalformed.add();
+						continue;
+					}
+					receiveFrame(peer, inner);
+				}
+				break;
+			case frame::FRAME_CONTEXT:
+			case frame::FRAME_COMPRESSED: {
+				auto packet = decompressor.decompress(peer.steamID, data, peer.addr, local);
+				if (packet.empty()) {
+					dropNoContext.add();
+					break;
+				}
+				receivePacket(peer, packet);
+				break;
+			}
+			default:
+				dropMalformed.add();
+				break;
+		}
+	}
+
+	void Receiver::receivePacket(const route::Peer &peer, std::span<uint8_t> data) {
+		auto packet = Packet(data);
+		if (packet.packet.size() < 20 || packet.version() != 4) {
+			dropMalformed.add();
+			return;
+		}
+		auto packet4 = packet.toPacket4();
+		packet4.setAddrs(peer.addr, local);
+		// the peer may not clamp, our SYN-ACKs alone don't cover both ways
+		if (mss != 0) {
+			packet4.clampMSS(mss);
+		}
+		if (packet4.protocol() == PROTOCOL_IGMP) {
+			snooper.observe(peer.steamID, packet4, std::chrono::steady_clock::now());
+		}
+		onDataCb(peer, packet);
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <span>
+
+#include "compress.h"
+#include "fec.h"
+#include "frag.h"
+#include "igmp.h"
+#include "ip.h"
+#include "metrics.h"
+#include "route.h"
+
+namespace lpvpn::dispatch {
+	using namespace lpvpn::ip;
+
+	// Takes apart what peers send on the data channel, whichever transport
+	// carried it: batches, fragments, FEC groups and compressed headers
+	// down to IP packets, which are rewritten to come from the peer's
+	// address to ours, MSS clamped and snooped for IGMP before they are
+	// handed to onData. Not thread safe, like the reassembly and decoding
+	// state it keeps; SteamNet runs it on the Steam event loop thread.
+	class Receiver {
+		public:
+		// called with the sending peer, valid for the duration of the call
+		using Handler = std::function<void(const route::Peer &peer, Packet &packet)>;
+
+		// mss 0 leaves TCP SYNs alone
+		Receiver(route::PeerTable &peers, igmp::Snooper &snooper, Address4 local, uint16_t mss);
+		~Receiver();
+
+		void onData(Handler cb);
+
+		// one message from peer. Packets are rewritten in place, the
+		// message has to stay ours until this returns.
+		void receive(uint64_t peer, std::span<uint8_t> message);
+
+		// one message as Steam hands it over: anything shaped like
+		// SteamNetworkingMessage_t, so the benchmarks can feed it a mock
+		template<typename Message>
+		void receive(Message *msg) {
+			receive(msg->m_identityPeer.GetSteamID().ConvertToUint64(), std::span<uint8_t>(static_cast<uint8_t *>(msg->m_pData), msg->GetSize()));
+		}
+
+		private:
+		void receiveFrame(const route::Peer &peer, std::span<uint8_t> frame);
+		void receivePacket(const route::Peer &peer, std::span<uint8_t> data);
+
+		route::PeerTable &peers;
+		igmp::Snooper &snooper;
+		Address4 local;
+		uint16_t mss;
+		frag::Reassembler reassembler;
+		fec::Decoder decoder;
+		compress::Decompressor decompressor;
+		Handler onDataCb;
+
+		metrics::Counter &dropUnknownPeer = metrics::drops("unknown_peer");
+		metrics::Counter &dropMalformed = metrics::drops("malformed");
+		metrics::Counter &dropNoContext = metrics::drops("no_context");
+	};
+}
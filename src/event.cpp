@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+#include "event.h"
+#include "metrics.h"
+
+#define MAX_EVENTS 16
+
+const auto TIMER_SLACK = std::chrono::milliseconds(1);
+
+namespace lpvpn::event {
+	using Clock = std::chrono::steady_clock;
+
+	class Loop::Impl {
+		public:
+		Impl() {
+#ifdef __linux__
+			epollFd = epoll_create1(EPOLL_CLOEXEC);
+			wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+			if (epollFd < 0 || wakeFd < 0 || timerFd < 0) {
+				auto err = errno;
+				closeAll();
+				throw std::system_error(err, std::generic_category(), "Failed to create event loop");
+			}
+			addFd(wakeFd);
+			addFd(timerFd);
+#endif
+		}
+
+		~Impl() {
+#ifdef __linux__
+			closeAll();
+#endif
+		}
+
+		void run() {
+			std::unique_lock<std::mutex> lk(mutex);
+			loopThread = std::this_thread::get_id();
+			while (running) {
+				std::vector<Callback> tasks;
+				tasks.swap(posted);
+				if (!tasks.empty()) {
+					lk.unlock();
+					for (auto &task : tasks) {
+						task();
+					}
+					lk.lock();
+				}
+				runTimers(lk);
+				if (!running || !posted.empty()) {
+					continue;
+				}
+				wait(lk, nextDeadline());
+			}
+			loopThread = std::thread::id();
+		}
+
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lk(mutex);
+				running = false;
+			}
+			wake();
+		}
+
+		void post(Callback cb) {
+			{
+				std::lock_guard<std::mutex> lk(mutex);
+				posted.push_back(std::move(cb));
+			}
+			wake();
+		}
+
+		TimerID addTimer(Callback cb) {
+			std::lock_guard<std::mutex> lk(mutex);
+			auto id = ++lastTimerID;
+			timers[id].cb = std::move(cb);
+			return id;
+		}
+
+		void arm(TimerID id, std::chrono::microseconds delay, std::chrono::microseconds interval) {
+			{
+				std::lock_guard<std::mutex> lk(mutex);
+				auto it = timers.find(id);
+				if (it == timers.end()) {
+					return;
+				}
+				it->second.armed = true;
+				it->second.deadline = Clock::now() + delay;
+				it->second.interval = interval;
+				if (onLoopThread()) {
+					return;
+				}
+			}
+			wake();
+		}
+
+		void disarm(TimerID id) {
+			std::lock_guard<std::mutex> lk(mutex);
+			auto it = timers.find(id);
+			if (it != timers.end()) {
+				it->second.armed = false;
+			}
+		}
+
+		void removeTimer(TimerID id) {
+			std::unique_lock<std::mutex> lk(mutex);
+			timers.erase(id);
+			if (!onLoopThread()) {
+				idle.wait(lk, [&]() {
+					return executing != id;
+				});
+			}
+		}
+
+#ifdef __linux__
+		void watch(int fd, Callback cb) {
+			{
+				std::lock_guard<std::mutex> lk(mutex);
+				watches[fd] = std::move(cb);
+			}
+			addFd(fd);
+		}
+
+		void unwatch(int fd) {
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+			std::unique_lock<std::mutex> lk(mutex);
+			watches.erase(fd);
+			if (!onLoopThread()) {
+				idle.wait(lk, [&]() {
+					return executingFd != fd;
+				});
+			}
+		}
+#endif
+
+		private:
+		struct Timer {
+			Callback cb;
+			bool armed = false;
+			Clock::time_point deadline;
+			std::chrono::microseconds interval;
+		};
+
+		bool onLoopThread() {
+			return loopThread == std::this_thread::get_id();
+		}
+
+		// must hold mutex, drops it while callbacks run
+		void runTimers(std::unique_lock<std::mutex> &lk) {
+			auto now = Clock::now();
+			std::vector<TimerID> due;
+			for (auto &[id, timer] : timers) {
+				auto slack = timer.interval.count() > 0 ? TIMER_SLACK : Clock::duration(0);
+				if (timer.armed && timer.deadline <= now + slack) {
+					due.push_back(id);
+				}
+			}
+			for (auto id : due) {
+				auto it = timers.find(id);
+				if (it == timers.end() || !it->second.armed) {
+					continue;
+				}
+				auto &timer = it->second;
+				if (timer.interval.count() > 0) {
+					// skip missed ticks rather than firing them back to back
+					timer.deadline = std::max(timer.deadline + timer.interval, now);
+				} else {
+					timer.armed = false;
+				}
+				executing = id;
+				// a copy, the callback may remove its own timer
+				auto cb = timer.cb;
+				lk.unlock();
+				cb();
+				lk.lock();
+				executing = 0;
+				idle.notify_all();
+			}
+		}
+
+		Clock::time_point nextDeadline() {
+			auto next = Clock::time_point::max();
+			for (auto &[id, timer] : timers) {
+				if (timer.armed) {
+					next = std::min(next, timer.deadline);
+				}
+			}
+			return next;
+		}
+
+#ifdef __linux__
+		void addFd(int fd) {
+			struct epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.fd = fd;
+			if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+				throw std::system_error(errno, std::generic_category(), "Failed to watch fd");
+			}
+		}
+
+		void wake() {
+			uint64_t one = 1;
+			::write(wakeFd, &one, sizeof(one));
+		}
+
+		// must hold mutex, drops it while waiting and running fd callbacks
+		void wait(std::unique_lock<std::mutex> &lk, Clock::time_point deadline) {
+			struct itimerspec spec = {};
+			if (deadline != Clock::time_point::max()) {
+				// steady_clock is CLOCK_MONOTONIC on Linux
+				auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+				spec.it_value.tv_sec = ns / 1000000000;
+				spec.it_value.tv_nsec = ns % 1000000000;
+				if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+					// all zeros would disarm
+					spec.it_value.tv_nsec = 1;
+				}
+			}
+			timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+			lk.unlock();
+
+			struct epoll_event events[MAX_EVENTS];
+			auto count = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+			wakeups.add();
+			for (int i = 0; i < count; i++) {
+				auto fd = events[i].data.fd;
+				if (fd == wakeFd || fd == timerFd) {
+					uint64_t value;
+					::read(fd, &value, sizeof(value));
+					continue;
+				}
+				Callback cb;
+				{
+					std::lock_guard<std::mutex> watchLk(mutex);
+					auto it = watches.find(fd);
+					if (it == watches.end()) {
+						continue;
+					}
+					cb = it->second;
+					executingFd = fd;
+				}
+				cb();
+				{
+					std::lock_guard<std::mutex> watchLk(mutex);
+					executingFd = -1;
+				}
+				idle.notify_all();
+			}
+			lk.lock();
+		}
+
+		void closeAll() {
+			for (auto fd : {epollFd, wakeFd, timerFd}) {
+				if (fd >= 0) {
+					close(fd);
+				}
+			}
+		}
+
+		int epollFd = -1;
+		int wakeFd = -1;
+		int timerFd = -1;
+		std::map<int, Callback> watches;
+		// fd whose callback is running, -1 if none
+		int executingFd = -1;
+#else
+		void wake() {
+			{
+				std::lock_guard<std::mutex> lk(mutex);
+				woken = true;
+			}
+			cv.notify_one();
+		}
+
+		// must hold mutex
+		void wait(std::unique_lock<std::mutex> &lk, Clock::time_point deadline) {
+			auto ready = [this]() {
+				return woken;
+			};
+			if (deadline == Clock::time_point::max()) {
+				cv.wait(lk, ready);
+			} else {
+				cv.wait_until(lk, deadline, ready);
+			}
+			woken = false;
+			wakeups.add();
+		}
+
+		std::condition_variable cv;
+		bool woken = false;
+#endif
+
+		std::mutex mutex;
+		std::condition_variable idle;
+		std::thread::id loopThread;
+		bool running = true;
+		std::vector<Callback> posted;
+		std::map<TimerID, Timer> timers;
+		TimerID lastTimerID = 0;
+		TimerID executing = 0;
+
+		metrics::Counter &wakeups = metrics::wakeups("event_loop");
+	};
+
+	Loop::Loop() : impl(std::make_unique<Impl>()) {}
+	Loop::~Loop() {}
+
+	void Loop::run() {
+		impl->run();
+	}
+
+	void Loop::stop() {
+		impl->stop();
+	}
+
+	void Loop::post(Callback cb) {
+		impl->post(std::move(cb));
+	}
+
+	Loop::TimerID Loop::addTimer(Callback cb) {
+		return impl->addTimer(std::move(cb));
+	}
+
+	void Loop::arm(TimerID id, std::chrono::microseconds delay, std::chrono::microseconds interval) {
+		impl->arm(id, delay, interval);
+	}
+
+	void Loop::disarm(TimerID id) {
+		impl->disarm(id);
+	}
+
+	void Loop::removeTimer(TimerID id) {
+		impl->removeTimer(id);
+	}
+
+#ifdef __linux__
+	void Loop::watch(int fd, Callback cb) {
+		impl->watch(fd, std::move(cb));
+	}
+
+	void Loop::unwatch(int fd) {
+		impl->unwatch(fd);
+	}
+#endif
+}
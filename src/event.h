@@ -0,0 +1,49 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace lpvpn::event {
+	// Single threaded reactor: whoever calls run() executes every posted
+	// task, timer and (on Linux) fd readiness callback. Built on epoll,
+	// eventfd and timerfd on Linux and on a condition variable elsewhere.
+	// Everything but run() may be called from any thread.
+	class Loop {
+		public:
+		using Callback = std::function<void()>;
+		using TimerID = uint64_t;
+
+		Loop();
+		~Loop();
+
+		// runs until stop() is called, a stopped loop can't be restarted
+		void run();
+		void stop();
+
+		void post(Callback cb);
+
+		// timers start disarmed; repeating timers that come due within a
+		// millisecond of each other share a wakeup
+		TimerID addTimer(Callback cb);
+		// (re)arms a timer to fire after delay, then every interval if it is
+		// non zero
+		void arm(TimerID id, std::chrono::microseconds delay, std::chrono::microseconds interval = std::chrono::microseconds(0));
+		void disarm(TimerID id);
+		// once this returns the callback is not running and never will,
+		// unless called from the callback itself
+		void removeTimer(TimerID id);
+
+#ifdef __linux__
+		// level triggered, cb runs while fd stays readable. Like
+		// removeTimer, once unwatch returns cb is not running and never
+		// will, unless called from cb itself.
+		void watch(int fd, Callback cb);
+		void unwatch(int fd);
+#endif
+
+		private:
+		class Impl;
+		std::unique_ptr<Impl> impl;
+	};
+}
@@ -0,0 +1,504 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+#include "fec.h"
+#include "frame.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FEC_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC allows any intrinsic anywhere, the CPU check guards them
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#else
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// x^8 + x^4 + x^3 + x^2 + 1, the usual Reed-Solomon field
+#define GF_POLYNOMIAL 0x11D
+// share of groups we are fine losing frames from
+#define RESIDUAL_LOSS 1e-3
+// groups this far behind the newest are stale, anything further is taken
+// to be a peer that restarted its numbering
+#define STALE_GROUPS 64
+
+namespace lpvpn::fec {
+	using frame::readU16;
+	using frame::writeU16;
+
+	// Field tables, plus for every constant c the products c * x split by
+	// nibble: c * x == low[c][x & 15] ^ high[c][x >> 4]. Those 16 entry
+	// tables are what the SIMD kernels look bytes up in with a shuffle.
+	struct Tables {
+		uint8_t exp[512];
+		uint8_t log[256];
+		alignas(16) uint8_t low[256][16];
+		alignas(16) uint8_t high[256][16];
+		uint8_t cauchy[MAX_PARITY][MAX_DATA];
+
+		Tables() {
+			unsigned x = 1;
+			for (int i = 0; i < 255; i++) {
+				exp[i] = static_cast<uint8_t>(x);
+				log[x] = static_cast<uint8_t>(i);
+				x <<= 1;
+				if (x & 0x100) {
+					x ^= GF_POLYNOMIAL;
+				}
+			}
+			for (int i = 255; i < 512; i++) {
+				exp[i] = exp[i - 255];
+			}
+			log[0] = 0;
+			for (int c = 0; c < 256; c++) {
+				for (int n = 0; n < 16; n++) {
+					low[c][n] = mul(c, n);
+					high[c][n] = mul(c, n << 4);
+				}
+			}
+			// rows and columns come from disjoint sets, so x ^ y is never
+			// 0 and every square submatrix is invertible
+			for (size_t row = 0; row < MAX_PARITY; row++) {
+				for (size_t index = 0; index < MAX_DATA; index++) {
+					cauchy[row][index] = inv(static_cast<uint8_t>((MAX_DATA + row) ^ index));
+				}
+			}
+		}
+
+		uint8_t mul(uint8_t a, uint8_t b) const {
+			if (a == 0 || b == 0) {
+				return 0;
+			}
+			return exp[log[a] + log[b]];
+		}
+
+		uint8_t inv(uint8_t a) const {
+			return exp[255 - log[a]];
+		}
+	};
+
+	static const Tables tables;
+
+	namespace gf {
+		uint8_t mul(uint8_t a, uint8_t b) {
+			return tables.mul(a, b);
+		}
+
+		uint8_t inv(uint8_t a) {
+			return tables.inv(a);
+		}
+
+		void mulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+			auto low = tables.low[c];
+			auto high = tables.high[c];
+			for (size_t i = 0; i < n; i++) {
+				dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+			}
+		}
+
+#ifdef FEC_X86
+		TARGET_SSSE3 static void mulAddSSSE3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+			auto low = _mm_load_si128(reinterpret_cast<const __m128i *>(tables.low[c]));
+			auto high = _mm_load_si128(reinterpret_cast<const __m128i *>(tables.high[c]));
+			auto mask = _mm_set1_epi8(0x0F);
+			size_t i = 0;
+			for (; i + 16 <= n; i += 16) {
+				auto s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+				auto l = _mm_shuffle_epi8(low, _mm_and_si128(s, mask));
+				auto h = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+				auto d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+			}
+			mulAddScalar(dst + i, src + i, c, n - i);
+		}
+
+		TARGET_AVX2 static void mulAddAVX2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+			auto low = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(tables.low[c])));
+			auto high = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(tables.high[c])));
+			auto mask = _mm256_set1_epi8(0x0F);
+			size_t i = 0;
+			for (; i + 32 <= n; i += 32) {
+				auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+				auto l = _mm256_shuffle_epi8(low, _mm256_and_si256(s, mask));
+				auto h = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+				auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+			}
+			mulAddSSSE3(dst + i, src + i, c, n - i);
+		}
+
+		static bool hasSSSE3() {
+#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 1);
+			return (info[2] & (1 << 9)) != 0;
+#else
+			return __builtin_cpu_supports("ssse3");
+#endif
+		}
+
+		static bool hasAVX2() {
+#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] < 7) {
+				return false;
+			}
+			// the OS has to save the YMM registers too
+			__cpuid(info, 1);
+			if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6) {
+				return false;
+			}
+			__cpuidex(info, 7, 0);
+			return (info[1] & (1 << 5)) != 0;
+#else
+			return __builtin_cpu_supports("avx2");
+#endif
+		}
+#endif
+
+		struct Kernel {
+			void (*fn)(uint8_t *, const uint8_t *, uint8_t, size_t);
+			const char *name;
+		};
+
+		static Kernel pick() {
+#ifdef FEC_X86
+			if (hasAVX2()) {
+				return {mulAddAVX2, "avx2"};
+			}
+			if (hasSSSE3()) {
+				return {mulAddSSSE3, "ssse3"};
+			}
+#endif
+			return {mulAddScalar, "scalar"};
+		}
+
+		static const Kernel best = pick();
+
+		void mulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+			if (c == 0) {
+				return;
+			}
+			best.fn(dst, src, c, n);
+		}
+
+		const char *kernel() {
+			return best.name;
+		}
+	}
+
+	uint8_t coefficient(size_t row, size_t index) {
+		return tables.cauchy[row][index];
+	}
+
+	size_t parityFor(double loss) {
+		if (loss <= 0) {
+			return 0;
+		}
+		loss = std::min(loss, 1.0);
+		for (size_t parity = 0; parity < MAX_PARITY; parity++) {
+			// chance of losing no more than parity of the group's frames
+			auto n = MAX_DATA + parity;
+			double recoverable = 0;
+			double choose = 1;
+			for (size_t lost = 0; lost <= parity; lost++) {
+				recoverable += choose * std::pow(loss, lost) * std::pow(1 - loss, n - lost);
+				choose = choose * (n - lost) / (lost + 1);
+			}
+			if (1 - recoverable <= RESIDUAL_LOSS) {
+				return parity;
+			}
+		}
+		return MAX_PARITY;
+	}
+
+	// Encoder
+	Encoder::Encoder():
+		parityFrames(metrics::registry().counter("lpvpn_fec_parity_frames_total", "Parity frames sent for forward error correction")) {}
+	Encoder::~Encoder() {}
+
+	bool Encoder::encode(uint64_t peer, std::span<const uint8_t> frame, std::vector<uint8_t> &data, std::vector<std::vector<uint8_t>> &parity) {
+		parity.clear();
+		if (frame.empty() || frame.size() > MAX_FRAME) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lk(mutex);
+		auto &group = peers[peer];
+		if (group.count == 0) {
+			if (group.level == 0) {
+				return false;
+			}
+			group.parity = group.level;
+			group.started = Clock::now();
+		}
+
+		uint8_t length[2];
+		writeU16(length, static_cast<uint16_t>(frame.size()));
+		for (size_t row = 0; row < group.parity; row++) {
+			auto &sum = group.sums[row];
+			if (sum.empty()) {
+				sum.resize(SHARD_SIZE);
+			}
+			auto c = coefficient(row, group.count);
+			gf::mulAdd(sum.data(), length, c, sizeof(length));
+			gf::mulAdd(sum.data() + sizeof(length), frame.data(), c, frame.size());
+		}
+		group.shardSize = std::max(group.shardSize, sizeof(length) + frame.size());
+
+		data.resize(frame::FEC_DATA_HEADER_SIZE + frame.size());
+		data[0] = frame::FRAME_FEC_DATA;
+		writeU16(data.data() + 1, group.id);
+		data[3] = static_cast<uint8_t>(group.count);
+		memcpy(data.data() + frame::FEC_DATA_HEADER_SIZE, frame.data(), frame.size());
+
+		group.count++;
+		if (group.count == MAX_DATA) {
+			close(group, parity);
+		}
+		return true;
+	}
+
+	void Encoder::flush(Clock::time_point now, std::vector<std::pair<uint64_t, std::vector<uint8_t>>> &parity) {
+		thread_local std::vector<std::vector<uint8_t>> frames;
+		std::lock_guard<std::mutex> lk(mutex);
+		for (auto &[peer, group] : peers) {
+			if (group.count == 0 || now - group.started < GROUP_LATENCY) {
+				continue;
+			}
+			close(group, frames);
+			for (auto &frame : frames) {
+				parity.emplace_back(peer, std::move(frame));
+			}
+		}
+	}
+
+	size_t Encoder::setLoss(uint64_t peer, double loss) {
+		std::lock_guard<std::mutex> lk(mutex);
+		// the open group keeps the parity it started with
+		return peers[peer].level = parityFor(loss);
+	}
+
+	void Encoder::close(Group &group, std::vector<std::vector<uint8_t>> &parity) {
+		// a short group never needs more parity than it has frames
+		auto rows = std::min(group.parity, group.count);
+		parity.resize(rows);
+		for (size_t row = 0; row < rows; row++) {
+			auto &frame = parity[row];
+			auto &sum = group.sums[row];
+			frame.resize(frame::FEC_PARITY_HEADER_SIZE + group.shardSize);
+			frame[0] = frame::FRAME_FEC_PARITY;
+			writeU16(frame.data() + 1, group.id);
+			frame[3] = static_cast<uint8_t>(row);
+			frame[4] = static_cast<uint8_t>(group.count);
+			frame[5] = static_cast<uint8_t>(rows);
+			memcpy(frame.data() + frame::FEC_PARITY_HEADER_SIZE, sum.data(), group.shardSize);
+		}
+		for (size_t row = 0; row < group.parity; row++) {
+			memset(group.sums[row].data(), 0, group.shardSize);
+		}
+		parityFrames.add(rows);
+		group.id++;
+		group.count = 0;
+		group.shardSize = 0;
+	}
+
+	// Decoder
+	Decoder::Decoder():
+		recovered(metrics::registry().counter("lpvpn_fec_recovered_frames_total", "Lost frames rebuilt from parity")),
+		dropMalformed(metrics::drops("fec_malformed")),
+		dropDuplicate(metrics::drops("fec_duplicate")) {}
+	Decoder::~Decoder() {}
+
+	std::span<const std::span<uint8_t>> Decoder::receive(uint64_t peer, std::span<uint8_t> frame) {
+		out.clear();
+		if (!frame.empty() && frame[0] == frame::FRAME_FEC_DATA) {
+			if (frame.size() <= frame::FEC_DATA_HEADER_SIZE || frame.size() - frame::FEC_DATA_HEADER_SIZE > MAX_FRAME || frame[3] >= MAX_DATA) {
+				dropMalformed.add();
+				return out;
+			}
+			auto payload = frame.subspan(frame::FEC_DATA_HEADER_SIZE);
+			size_t index = frame[3];
+			auto g = group(peer, readU16(frame.data() + 1));
+			if (g == nullptr) {
+				// too old to help rebuild anything, still worth delivering
+				out.push_back(payload);
+				return out;
+			}
+			auto bit = uint32_t(1) << index;
+			if ((g->received & bit) != 0) {
+				// also what a frame we already rebuilt looks like
+				dropDuplicate.add();
+				return out;
+			}
+			if (g->shardSize != 0 && payload.size() + 2 > g->shardSize) {
+				dropMalformed.add();
+				return out;
+			}
+			auto &shard = g->data[index];
+			shard.resize(2 + payload.size());
+			writeU16(shard.data(), static_cast<uint16_t>(payload.size()));
+			memcpy(shard.data() + 2, payload.data(), payload.size());
+			g->received |= bit;
+			out.push_back(payload);
+			recover(*g);
+			return out;
+		}
+
+		if (frame.size() <= frame::FEC_PARITY_HEADER_SIZE + 2 || frame.size() - frame::FEC_PARITY_HEADER_SIZE > SHARD_SIZE) {
+			dropMalformed.add();
+			return out;
+		}
+		size_t row = frame[3];
+		size_t count = frame[4];
+		size_t parity = frame[5];
+		auto sum = frame.subspan(frame::FEC_PARITY_HEADER_SIZE);
+		if (count == 0 || count > MAX_DATA || parity == 0 || parity > MAX_PARITY || row >= parity) {
+			dropMalformed.add();
+			return out;
+		}
+		auto g = group(peer, readU16(frame.data() + 1));
+		if (g == nullptr) {
+			return out;
+		}
+		if (g->count == 0) {
+			for (size_t index = 0; index < MAX_DATA; index++) {
+				if ((g->received & (uint32_t(1) << index)) != 0 && g->data[index].size() > sum.size()) {
+					dropMalformed.add();
+					return out;
+				}
+			}
+			g->count = count;
+			g->parity = parity;
+			g->shardSize = sum.size();
+		} else if (g->count != count || g->parity != parity || g->shardSize != sum.size()) {
+			dropMalformed.add();
+			return out;
+		}
+		auto bit = uint32_t(1) << row;
+		if ((g->parityReceived & bit) != 0) {
+			dropDuplicate.add();
+			return out;
+		}
+		g->sums[row].assign(sum.begin(), sum.end());
+		g->parityReceived |= bit;
+		recover(*g);
+		return out;
+	}
+
+	// the slot for group id of peer, nullptr if the group is older than
+	// the window
+	Decoder::Group *Decoder::group(uint64_t peer, uint16_t id) {
+		auto &g = peers[peer][id % WINDOW];
+		if (g.used && g.id == id) {
+			return &g;
+		}
+		if (g.used && static_cast<uint16_t>(g.id - id) < STALE_GROUPS) {
+			return nullptr;
+		}
+		g.used = true;
+		g.done = false;
+		g.id = id;
+		g.count = 0;
+		g.parity = 0;
+		g.shardSize = 0;
+		g.received = 0;
+		g.parityReceived = 0;
+		return &g;
+	}
+
+	// Rebuilds the group's missing frames once we hold as many frames as
+	// it had data frames. With E the missing indices and p the parity rows
+	// we hold, p - (the known frames' share of p) = C[p][E] * D[E], and
+	// the square Cauchy submatrix C[p][E] is always invertible.
+	void Decoder::recover(Group &g) {
+		if (g.done || g.count == 0) {
+			return;
+		}
+		size_t missing[MAX_PARITY];
+		size_t rows[MAX_PARITY];
+		size_t lost = 0;
+		for (size_t index = 0; index < g.count; index++) {
+			if ((g.received & (uint32_t(1) << index)) == 0) {
+				if (lost == MAX_PARITY) {
+					return;
+				}
+				missing[lost++] = index;
+			}
+		}
+		if (lost == 0) {
+			g.done = true;
+			return;
+		}
+		if (static_cast<size_t>(std::popcount(g.parityReceived)) < lost) {
+			return;
+		}
+		for (size_t row = 0, n = 0; n < lost; row++) {
+			if ((g.parityReceived & (uint32_t(1) << row)) != 0) {
+				rows[n++] = row;
+			}
+		}
+
+		// take the known frames out of the parity we use
+		for (size_t i = 0; i < lost; i++) {
+			auto &sum = g.sums[rows[i]];
+			for (size_t index = 0; index < g.count; index++) {
+				if ((g.received & (uint32_t(1) << index)) != 0) {
+					gf::mulAdd(sum.data(), g.data[index].data(), coefficient(rows[i], index), g.data[index].size());
+				}
+			}
+		}
+
+		// invert C[rows][missing] by Gauss-Jordan elimination
+		uint8_t m[MAX_PARITY][2 * MAX_PARITY] = {};
+		for (size_t i = 0; i < lost; i++) {
+			for (size_t j = 0; j < lost; j++) {
+				m[i][j] = coefficient(rows[i], missing[j]);
+			}
+			m[i][lost + i] = 1;
+		}
+		for (size_t col = 0; col < lost; col++) {
+			size_t pivot = col;
+			while (m[pivot][col] == 0) {
+				pivot++;
+			}
+			std::swap(m[pivot], m[col]);
+			auto scale = gf::inv(m[col][col]);
+			for (size_t j = 0; j < 2 * lost; j++) {
+				m[col][j] = gf::mul(m[col][j], scale);
+			}
+			for (size_t i = 0; i < lost; i++) {
+				auto factor = m[i][col];
+				if (i == col || factor == 0) {
+					continue;
+				}
+				for (size_t j = 0; j < 2 * lost; j++) {
+					m[i][j] ^= gf::mul(factor, m[col][j]);
+				}
+			}
+		}
+
+		g.done = true;
+		for (size_t i = 0; i < lost; i++) {
+			auto &shard = g.data[missing[i]];
+			shard.assign(g.shardSize, 0);
+			for (size_t j = 0; j < lost; j++) {
+				gf::mulAdd(shard.data(), g.sums[rows[j]].data(), m[i][lost + j], g.shardSize);
+			}
+			g.received |= uint32_t(1) << missing[i];
+			size_t size = readU16(shard.data());
+			if (size == 0 || size + 2 > g.shardSize) {
+				dropMalformed.add();
+				continue;
+			}
+			recovered.add();
+			out.push_back(std::span<uint8_t>(shard.data() + 2, size));
+		}
+	}
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "metrics.h"
+
+namespace lpvpn::fec {
+	// Forward error correction for unicast frames other than TCP, which
+	// recovers on its own. Frames bound for a peer are grouped MAX_DATA at a time and each group is followed by up to
+	// MAX_PARITY parity frames, a systematic Cauchy Reed-Solomon code over
+	// GF(2^8): any MAX_DATA of the group's frames rebuild the rest. Frames
+	// go out as soon as they are written, so the receiver only waits when
+	// something was lost. How much parity a peer gets follows the loss
+	// Steam reports for it, a clean connection gets none at all.
+	const size_t MAX_DATA = 8;
+	const size_t MAX_PARITY = 4;
+	// largest frame a group takes, anything bigger goes out as it is
+	const size_t MAX_FRAME = 1400;
+	// a frame in a group is (u16 length, frame) padded to the longest one
+	const size_t SHARD_SIZE = MAX_FRAME + 2;
+	// a group that hasn't filled up by then is closed as it is
+	const auto GROUP_LATENCY = std::chrono::milliseconds(20);
+
+	namespace gf {
+		uint8_t mul(uint8_t a, uint8_t b);
+		uint8_t inv(uint8_t a);
+		// dst[i] ^= c * src[i] for i < n, on the best kernel the CPU has
+		void mulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n);
+		void mulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n);
+		// name of the kernel mulAdd runs, for logs and benchmarks
+		const char *kernel();
+	}
+
+	// weight of data frame index in parity frame row
+	uint8_t coefficient(size_t row, size_t index);
+	// fewest parity frames that still rebuild a group at the given loss
+	// rate, assuming losses are independent
+	size_t parityFor(double loss);
+
+	class Encoder {
+		public:
+		using Clock = std::chrono::steady_clock;
+
+		Encoder();
+		~Encoder();
+
+		// Wraps frame for peer as FRAME_FEC_DATA into data. When that closes
+		// the peer's group its parity frames are put in parity, which is
+		// otherwise left empty. Returns false if the frame should be sent
+		// as it is: it's too big, or the peer doesn't need protection.
+		bool encode(uint64_t peer, std::span<const uint8_t> frame, std::vector<uint8_t> &data, std::vector<std::vector<uint8_t>> &parity);
+		// closes groups open for longer than GROUP_LATENCY, appending
+		// (peer, parity frame) pairs to parity
+		void flush(Clock::time_point now, std::vector<std::pair<uint64_t, std::vector<uint8_t>>> &parity);
+		// sets how much parity peer gets from its loss rate (0 to 1),
+		// returns the new number of parity frames per group
+		size_t setLoss(uint64_t peer, double loss);
+
+		private:
+		struct Group {
+			uint16_t id = 0;
+			size_t count = 0;
+			// parity frames per group, none until setLoss says otherwise,
+			// and for the open group
+			size_t level = 0;
+			size_t parity = 0;
+			size_t shardSize = 0;
+			Clock::time_point started;
+			std::array<std::vector<uint8_t>, MAX_PARITY> sums;
+		};
+
+		void close(Group &group, std::vector<std::vector<uint8_t>> &parity);
+
+		std::mutex mutex;
+		std::map<uint64_t, Group> peers;
+		metrics::Counter &parityFrames;
+	};
+
+	// Not thread safe, the receive path is single threaded.
+	class Decoder {
+		public:
+		Decoder();
+		~Decoder();
+
+		// Handles a FRAME_FEC_DATA or FRAME_FEC_PARITY frame from peer and
+		// returns the frames to hand on: a data frame's payload, pointing
+		// into frame, and whatever it let us rebuild. Valid until the next
+		// call.
+		std::span<const std::span<uint8_t>> receive(uint64_t peer, std::span<uint8_t> frame);
+
+		private:
+		// groups per peer that can still be rebuilt, older ones are dropped
+		static const size_t WINDOW = 4;
+
+		struct Group {
+			bool used = false;
+			bool done = false;
+			uint16_t id = 0;
+			// 0 until a parity frame has told us
+			size_t count = 0;
+			size_t parity = 0;
+			size_t shardSize = 0;
+			uint32_t received = 0;
+			uint32_t parityReceived = 0;
+			std::array<std::vector<uint8_t>, MAX_DATA> data;
+			std::array<std::vector<uint8_t>, MAX_PARITY> sums;
+		};
+
+		Group *group(uint64_t peer, uint16_t id);
+		void recover(Group &group);
+
+		std::map<uint64_t, std::array<Group, WINDOW>> peers;
+		std::vector<std::span<uint8_t>> out;
+		metrics::Counter &recovered;
+		metrics::Counter &dropMalformed;
+		metrics::Counter &dropDuplicate;
+	};
+}
@@ -0,0 +1,19 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <cstdio>
+#endif
+
+#include "file.h"
+
+namespace lpvpn::file {
+	bool replace(const std::string &from, const std::string &to) {
+#ifdef _WIN32
+		// std::rename refuses to replace an existing file here
+		return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+	}
+}
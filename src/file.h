@@ -0,0 +1,8 @@
+#pragma once
+#include <string>
+
+namespace lpvpn::file {
+	// Moves from over to in one step, so a reader or a crash sees either the
+	// old file or the new one, never neither. Both must be on one volume.
+	bool replace(const std::string &from, const std::string &to);
+}
@@ -0,0 +1,95 @@
+#include <bit>
+#include <cstring>
+
+#include "frag.h"
+
+namespace lpvpn::frag {
+	Reassembler::Reassembler():
+		reassembled(metrics::registry().counter("lpvpn_reassembled_frames_total", "Frames put back together from fragments")),
+		dropMalformed(metrics::drops("fragment_malformed")),
+		dropTimeout(metrics::drops("reassembly_timeout")),
+		dropEvicted(metrics::drops("reassembly_evicted")) {}
+
+	std::span<uint8_t> Reassembler::add(uint64_t peer, std::span<const uint8_t> fragment) {
+		if (fragment.size() <= frame::FRAGMENT_HEADER_SIZE) {
+			dropMalformed.add();
+			return {};
+		}
+		auto p = fragment.data();
+		auto id = frame::readU32(p + 1);
+		uint8_t index = p[5];
+		uint8_t count = p[6];
+		size_t offset = frame::readU16(p + 7);
+		uint16_t total = frame::readU16(p + 9);
+		auto data = fragment.subspan(frame::FRAGMENT_HEADER_SIZE);
+		if (count == 0 || count > MAX_FRAGMENTS || index >= count || offset + data.size() > total) {
+			dropMalformed.add();
+			return {};
+		}
+
+		auto now = Clock::now();
+		Slot *slot = nullptr;
+		for (auto &candidate : slots) {
+			if (candidate.used && candidate.peer == peer && candidate.id == id) {
+				slot = &candidate;
+				break;
+			}
+		}
+		if (slot != nullptr && slot->deadline < now) {
+			// the rest of it is long gone, start over
+			dropTimeout.add();
+			slot->used = false;
+			slot = nullptr;
+		}
+		if (slot == nullptr) {
+			slot = &claim(peer, id, now);
+			slot->count = count;
+			slot->total = total;
+			slot->buffer.resize(total);
+		} else if (slot->count != count || slot->total != total) {
+			dropMalformed.add();
+			slot->used = false;
+			return {};
+		}
+
+		auto bit = uint64_t(1) << index;
+		if ((slot->received & bit) != 0) {
+			return {};
+		}
+		memcpy(slot->buffer.data() + offset, data.data(), data.size());
+		slot->received |= bit;
+		if (std::popcount(slot->received) < count) {
+			return {};
+		}
+		slot->used = false;
+		reassembled.add();
+		return std::span<uint8_t>(slot->buffer.data(), total);
+	}
+
+	// a free slot, else one that timed out, else the one closest to it
+	Reassembler::Slot &Reassembler::claim(uint64_t peer, uint32_t id, Clock::time_point now) {
+		Slot *victim = nullptr;
+		for (auto &slot : slots) {
+			if (!slot.used) {
+				victim = &slot;
+				break;
+			}
+			if (victim == nullptr || slot.deadline < victim->deadline) {
+				victim = &slot;
+			}
+		}
+		if (victim->used) {
+			if (victim->deadline < now) {
+				dropTimeout.add();
+			} else {
+				dropEvicted.add();
+			}
+		}
+		victim->used = true;
+		victim->peer = peer;
+		victim->id = id;
+		victim->received = 0;
+		victim->deadline = now + TIMEOUT;
+		return *victim;
+	}
+}
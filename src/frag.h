@@ -0,0 +1,86 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "frame.h"
+#include "metrics.h"
+
+namespace lpvpn::frag {
+	// Splitting and reassembly of frames bigger than the tunnel MTU. Losing
+	// any fragment still loses the frame, but a frame now only ever spans
+	// the few messages it has to instead of whatever Steam cuts it into.
+	const size_t MAX_FRAGMENTS = 64;
+	// frames being reassembled at once, across all peers
+	const size_t SLOTS = 32;
+	const auto TIMEOUT = std::chrono::milliseconds(500);
+
+	// Cuts frame into FRAME_FRAGMENT frames of at most mtu bytes and hands
+	// each to cb. Returns false, without calling cb, if that would take
+	// more than MAX_FRAGMENTS.
+	template<typename F>
+	bool split(uint32_t id, std::span<const uint8_t> frame, size_t mtu, F cb) {
+		if (mtu <= frame::FRAGMENT_HEADER_SIZE || frame.size() > UINT16_MAX) {
+			return false;
+		}
+		auto chunk = mtu - frame::FRAGMENT_HEADER_SIZE;
+		auto count = (frame.size() + chunk - 1) / chunk;
+		if (count > MAX_FRAGMENTS) {
+			return false;
+		}
+		thread_local std::vector<uint8_t> piece;
+		for (size_t index = 0; index < count; index++) {
+			auto offset = index * chunk;
+			auto data = frame.subspan(offset, std::min(chunk, frame.size() - offset));
+			piece.resize(frame::FRAGMENT_HEADER_SIZE + data.size());
+			auto p = piece.data();
+			p[0] = frame::FRAME_FRAGMENT;
+			frame::writeU32(p + 1, id);
+			p[5] = static_cast<uint8_t>(index);
+			p[6] = static_cast<uint8_t>(count);
+			frame::writeU16(p + 7, static_cast<uint16_t>(offset));
+			frame::writeU16(p + 9, static_cast<uint16_t>(frame.size()));
+			std::copy(data.begin(), data.end(), p + frame::FRAGMENT_HEADER_SIZE);
+			cb(std::span<const uint8_t>(piece));
+		}
+		return true;
+	}
+
+	// Bounded reassembly table. Slots and their buffers are reused, so the
+	// table never grows; when it is full the frame closest to timing out
+	// gives way. Not thread safe, the receive path is single threaded.
+	class Reassembler {
+		public:
+		Reassembler();
+
+		// Feeds one FRAME_FRAGMENT frame. Returns the whole frame once its
+		// last piece is in, valid until the next call, otherwise empty.
+		std::span<uint8_t> add(uint64_t peer, std::span<const uint8_t> fragment);
+
+		private:
+		using Clock = std::chrono::steady_clock;
+
+		struct Slot {
+			bool used = false;
+			uint64_t peer = 0;
+			uint32_t id = 0;
+			uint8_t count = 0;
+			uint16_t total = 0;
+			uint64_t received = 0;
+			Clock::time_point deadline;
+			std::vector<uint8_t> buffer;
+		};
+
+		Slot &claim(uint64_t peer, uint32_t id, Clock::time_point now);
+
+		std::array<Slot, SLOTS> slots;
+
+		metrics::Counter &reassembled;
+		metrics::Counter &dropMalformed;
+		metrics::Counter &dropTimeout;
+		metrics::Counter &dropEvicted;
+	};
+}
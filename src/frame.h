@@ -0,0 +1,76 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace lpvpn::frame {
+	// Every message sent between peers carries one frame. A bare IP packet is
+	// its own frame and is recognised by its version nibble; every other
+	// frame starts with a type byte whose high nibble is 0.
+	enum Type {
+		FRAME_BATCH = 0x01,
+		FRAME_CONTEXT = 0x02,
+		FRAME_COMPRESSED = 0x03,
+		FRAME_FRAGMENT = 0x04,
+		FRAME_FEC_DATA = 0x05,
+		FRAME_FEC_PARITY = 0x06,
+	};
+
+	inline bool isPacket(std::span<const uint8_t> frame) {
+		return !frame.empty() && (frame[0] >> 4) != 0;
+	}
+
+	inline uint16_t readU16(const uint8_t *p) {
+		return (p[0] << 8) | p[1];
+	}
+
+	inline void writeU16(uint8_t *p, uint16_t value) {
+		p[0] = value >> 8;
+		p[1] = value & 0xFF;
+	}
+
+	inline uint32_t readU32(const uint8_t *p) {
+		return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+	}
+
+	inline void writeU32(uint8_t *p, uint32_t value) {
+		p[0] = value >> 24;
+		p[1] = (value >> 16) & 0xFF;
+		p[2] = (value >> 8) & 0xFF;
+		p[3] = value & 0xFF;
+	}
+
+	// FRAME_BATCH: type byte followed by (u16 length, frame) entries, all
+	// bound for the same peer; entries are never batches themselves
+	const size_t BATCH_HEADER_SIZE = 1;
+	const size_t BATCH_ENTRY_HEADER_SIZE = 2;
+
+	// calls cb for every entry in a batch frame, stops at the first
+	// truncated entry
+	template <typename F>
+	void forEachInBatch(std::span<uint8_t> frame, F cb) {
+		size_t offset = BATCH_HEADER_SIZE;
+		while (offset + BATCH_ENTRY_HEADER_SIZE <= frame.size()) {
+			size_t size = readU16(frame.data() + offset);
+			offset += BATCH_ENTRY_HEADER_SIZE;
+			if (size == 0 || offset + size > frame.size()) {
+				return;
+			}
+			cb(frame.subspan(offset, size));
+			offset += size;
+		}
+	}
+
+	// FRAME_FRAGMENT: type byte, u32 id, u8 index, u8 count, u16 offset and
+	// u16 total length, followed by that piece of a frame too big to send
+	// in one message. Fragments are never fragmented again.
+	const size_t FRAGMENT_HEADER_SIZE = 11;
+
+	// FRAME_FEC_DATA: type byte, u16 group and u8 index, followed by a frame
+	// covered by the group's parity
+	const size_t FEC_DATA_HEADER_SIZE = 4;
+	// FRAME_FEC_PARITY: type byte, u16 group, u8 row, u8 data frames in the
+	// group and u8 parity frames in the group, followed by the parity over
+	// the group's (u16 length, frame) entries padded to the longest one
+	const size_t FEC_PARITY_HEADER_SIZE = 6;
+}
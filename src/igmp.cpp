@@ -0,0 +1,158 @@
+#include <cstring>
+
+#include "igmp.h"
+#include "log.h"
+
+// IGMP message types
+#define IGMP_QUERY 0x11
+#define IGMP_V1_REPORT 0x12
+#define IGMP_V2_REPORT 0x16
+#define IGMP_V2_LEAVE 0x17
+#define IGMP_V3_REPORT 0x22
+
+// IGMPv3 group record types (RFC 3376 4.2.12)
+#define MODE_IS_INCLUDE 1
+#define MODE_IS_EXCLUDE 2
+#define CHANGE_TO_INCLUDE_MODE 3
+#define CHANGE_TO_EXCLUDE_MODE 4
+#define ALLOW_NEW_SOURCES 5
+
+// IPv4 header with the Router Alert option, then an IGMPv3 query
+#define QUERY_IP_HEADER_SIZE 24
+#define QUERY_SIZE 12
+// 10 s for hosts to answer, in tenths of a second
+#define MAX_RESPONSE_CODE 100
+#define ROBUSTNESS 2
+
+namespace lpvpn::igmp {
+	std::vector<uint8_t> makeQuery(Address4 src) {
+		std::vector<uint8_t> buffer(QUERY_IP_HEADER_SIZE + QUERY_SIZE);
+		auto p = buffer.data();
+		p[0] = 0x46;
+		p[3] = QUERY_IP_HEADER_SIZE + QUERY_SIZE;
+		p[8] = 1;
+		p[9] = PROTOCOL_IGMP;
+		memcpy(p + 12, src.addr.data(), 4);
+		Address4 allHosts({224, 0, 0, 1});
+		memcpy(p + 16, allHosts.addr.data(), 4);
+		// Router Alert (RFC 2113), hosts may ignore IGMP without it
+		p[20] = 0x94;
+		p[21] = 0x04;
+		auto checksum = static_cast<uint16_t>(~onesComplementSum(std::span<const uint8_t>(p, QUERY_IP_HEADER_SIZE)));
+		p[10] = static_cast<uint8_t>(checksum >> 8);
+		p[11] = static_cast<uint8_t>(checksum);
+
+		// general query: no group, no sources
+		auto q = p + QUERY_IP_HEADER_SIZE;
+		q[0] = IGMP_QUERY;
+		q[1] = MAX_RESPONSE_CODE;
+		q[8] = ROBUSTNESS;
+		q[9] = static_cast<uint8_t>(QUERY_INTERVAL.count());
+		checksum = static_cast<uint16_t>(~onesComplementSum(std::span<const uint8_t>(q, QUERY_SIZE)));
+		q[2] = static_cast<uint8_t>(checksum >> 8);
+		q[3] = static_cast<uint8_t>(checksum);
+		return buffer;
+	}
+
+	Snooper::Snooper() {}
+	Snooper::~Snooper() {}
+
+	bool Snooper::isSnoopable(Address4 group) {
+		return group.isMulticast() && (group.toUint32() & 0xFFFFFF00) != 0xE0000000;
+	}
+
+	void Snooper::observe(uint64_t peer, Packet4 &packet, Clock::time_point now) {
+		if (packet.protocol() != PROTOCOL_IGMP || packet.isFragment()) {
+			return;
+		}
+		auto msg = packet.payload();
+		if (msg.size() < 8) {
+			return;
+		}
+		switch (msg[0]) {
+			case IGMP_V1_REPORT:
+			case IGMP_V2_REPORT:
+				join(peer, Address4(std::span<uint8_t, 4>(msg.data() + 4, 4)), now);
+				break;
+			case IGMP_V2_LEAVE:
+				leave(peer, Address4(std::span<uint8_t, 4>(msg.data() + 4, 4)));
+				break;
+			case IGMP_V3_REPORT: {
+				size_t records = (msg[6] << 8) | msg[7];
+				size_t offset = 8;
+				for (size_t i = 0; i < records && offset + 8 <= msg.size(); i++) {
+					auto type = msg[offset];
+					size_t auxLen = msg[offset + 1] * 4;
+					size_t sources = (msg[offset + 2] << 8) | msg[offset + 3];
+					auto group = Address4(std::span<uint8_t, 4>(msg.data() + offset + 4, 4));
+					switch (type) {
+						case MODE_IS_EXCLUDE:
+						case CHANGE_TO_EXCLUDE_MODE:
+							join(peer, group, now);
+							break;
+						case MODE_IS_INCLUDE:
+						case ALLOW_NEW_SOURCES:
+							if (sources > 0) {
+								join(peer, group, now);
+							}
+							break;
+						case CHANGE_TO_INCLUDE_MODE:
+							// INCLUDE with no sources is how v3 says leave
+							if (sources == 0) {
+								leave(peer, group);
+							}
+							break;
+					}
+					offset += 8 + sources * 4 + auxLen;
+				}
+				break;
+			}
+		}
+	}
+
+	bool Snooper::members(Address4 group, std::vector<uint64_t> &out, Clock::time_point now) {
+		out.clear();
+		std::lock_guard<std::mutex> lk(mutex);
+		auto it = groups.find(group.toUint32());
+		if (it == groups.end() || now - it->second.firstReport < QUERY_INTERVAL) {
+			return false;
+		}
+		auto &members = it->second.members;
+		for (auto member = members.begin(); member != members.end();) {
+			if (now - member->second > MEMBERSHIP_INTERVAL) {
+				LOG("Peer " << member->first << " stopped reporting on " << group.toString());
+				member = members.erase(member);
+				continue;
+			}
+			out.push_back(member->first);
+			member++;
+		}
+		return true;
+	}
+
+	void Snooper::join(uint64_t peer, Address4 group, Clock::time_point now) {
+		if (!isSnoopable(group)) {
+			return;
+		}
+		std::lock_guard<std::mutex> lk(mutex);
+		auto [it, added] = groups.try_emplace(group.toUint32());
+		if (added) {
+			it->second.firstReport = now;
+		}
+		if (it->second.members.insert_or_assign(peer, now).second) {
+			LOG("Peer " << peer << " joined " << group.toString());
+		}
+	}
+
+	void Snooper::leave(uint64_t peer, Address4 group) {
+		if (!isSnoopable(group)) {
+			return;
+		}
+		std::lock_guard<std::mutex> lk(mutex);
+		// an emptied group stays, nobody left in it wants its traffic
+		auto it = groups.find(group.toUint32());
+		if (it != groups.end() && it->second.members.erase(peer) > 0) {
+			LOG("Peer " << peer << " left " << group.toString());
+		}
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "ip.h"
+
+namespace lpvpn::igmp {
+	using namespace lpvpn::ip;
+
+	// RFC 3376's defaults: we query every QUERY_INTERVAL, and a member
+	// that hasn't reported for MEMBERSHIP_INTERVAL (two queries missed,
+	// plus the time hosts get to answer) is dropped
+	const auto QUERY_INTERVAL = std::chrono::seconds(125);
+	const auto MEMBERSHIP_INTERVAL = std::chrono::seconds(260);
+
+	// an IGMPv3 general query from src to all hosts, which v1 and v2 hosts
+	// answer as well
+	std::vector<uint8_t> makeQuery(Address4 src);
+
+	// Tracks which peers joined which multicast group by watching the IGMP
+	// reports they send through the tunnel (RFC 4541 style snooping).
+	// Memberships expire unless refreshed, so SteamNet acts as the querier
+	// and asks every peer's host about its groups every QUERY_INTERVAL.
+	class Snooper {
+		public:
+		using Clock = std::chrono::steady_clock;
+
+		Snooper();
+		~Snooper();
+
+		// record joins / leaves carried by an IGMP packet sent by peer
+		void observe(uint64_t peer, Packet4 &packet, Clock::time_point now);
+		// false if group should be flooded: nobody reported on it, or the
+		// first report came less than a QUERY_INTERVAL ago and members that
+		// joined before we listened haven't been asked yet. Otherwise out
+		// is filled with the current members.
+		bool members(Address4 group, std::vector<uint64_t> &out, Clock::time_point now);
+
+		// groups in 224.0.0.0/24 are link-local control traffic and are
+		// always flooded
+		static bool isSnoopable(Address4 group);
+
+		private:
+		struct Group {
+			// when each member last reported
+			std::map<uint64_t, Clock::time_point> members;
+			Clock::time_point firstReport;
+		};
+
+		void join(uint64_t peer, Address4 group, Clock::time_point now);
+		void leave(uint64_t peer, Address4 group);
+
+		std::mutex mutex;
+		std::map<uint32_t, Group> groups;
+	};
+}
@@ -1,8 +1,81 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
 #include <stdexcept>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LPVPN_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "ip.h"
 
 namespace lpvpn::ip {
+	static uint16_t fold(uint64_t sum) {
+		while (sum >> 16) {
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		}
+		return static_cast<uint16_t>(sum);
+	}
+
+	static uint16_t readU16(const uint8_t *p) {
+		return (p[0] << 8) | p[1];
+	}
+
+	static void writeU16(uint8_t *p, uint16_t value) {
+		p[0] = value >> 8;
+		p[1] = value & 0xFF;
+	}
+
+	// one's complement addition is byte order independent (RFC 1071 2.B), so
+	// words are summed in native order and swapped once at the end
+	static uint64_t nativeSum(const uint8_t *data, size_t size) {
+		uint64_t sum = 0;
+		size_t i = 0;
+#ifdef LPVPN_SSE2
+		const auto zero = _mm_setzero_si128();
+		while (size - i >= 16) {
+			// each 32 bit lane takes two words per iteration, flush well
+			// before it can overflow
+			auto acc = _mm_setzero_si128();
+			auto end = i + std::min<size_t>((size - i) & ~size_t(15), 16 * 16384);
+			for (; i < end; i += 16) {
+				auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+				acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+				acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+			}
+			uint32_t lanes[4];
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+			sum += uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+		}
+#endif
+		for (; size - i >= 4; i += 4) {
+			uint32_t word;
+			memcpy(&word, data + i, 4);
+			sum += word;
+		}
+		for (; size - i >= 2; i += 2) {
+			uint16_t word;
+			memcpy(&word, data + i, 2);
+			sum += word;
+		}
+		if (i < size) {
+			uint8_t last[2] = { data[i], 0 };
+			uint16_t word;
+			memcpy(&word, last, 2);
+			sum += word;
+		}
+		return sum;
+	}
+
+	uint16_t onesComplementSum(std::span<const uint8_t> data, uint32_t initial) {
+		auto sum = fold(nativeSum(data.data(), data.size()));
+		if constexpr (std::endian::native == std::endian::little) {
+			sum = static_cast<uint16_t>((sum >> 8) | (sum << 8));
+		}
+		return fold(uint64_t(sum) + initial);
+	}
+
 	// Packet
 	Packet::Packet(std::span<uint8_t> packet) : packet(packet) {}
 	Packet::~Packet() {}
@@ -72,6 +145,33 @@ namespace lpvpn::ip {
 		return ret;
 	}
 
+	Address4 Address4::fromString(const std::string &str) {
+		std::array<uint8_t, 4> addr;
+		size_t pos = 0;
+		for (size_t i = 0; i < 4; i++) {
+			if (i != 0) {
+				if (pos >= str.size() || str[pos] != '.') {
+					throw std::invalid_argument("Not an IPv4 address: " + str);
+				}
+				pos++;
+			}
+			unsigned value = 0;
+			size_t digits = 0;
+			while (pos < str.size() && str[pos] >= '0' && str[pos] <= '9' && digits < 3) {
+				value = value * 10 + (str[pos++] - '0');
+				digits++;
+			}
+			if (digits == 0 || value > 255) {
+				throw std::invalid_argument("Not an IPv4 address: " + str);
+			}
+			addr[i] = static_cast<uint8_t>(value);
+		}
+		if (pos != str.size()) {
+			throw std::invalid_argument("Not an IPv4 address: " + str);
+		}
+		return Address4(addr);
+	}
+
 	// Subnet4
 	Subnet4::Subnet4(Address4 addr, uint8_t prefix): prefix(prefix) {
 		this->addr = addr.addr;
@@ -122,9 +222,26 @@ namespace lpvpn::ip {
 		return Address4(std::span<uint8_t, 4>(packet.data() + 16, 4));
 	}
 
+	uint8_t Packet4::headerLength() {
+		return (packet[0] & 0x0F) * 4;
+	}
+
+	uint16_t Packet4::totalLength() {
+		return readU16(packet.data() + 2);
+	}
+
+	uint8_t Packet4::protocol() {
+		return packet[9];
+	}
+
+	bool Packet4::isFragment() {
+		// any fragment but the first one, which carries no L4 header
+		return (readU16(packet.data() + 6) & 0x1FFF) != 0;
+	}
+
 	std::span<uint8_t> Packet4::payload() {
 		if (version() == 4) {
-			return packet.subspan(20);
+			return packet.subspan(std::min<size_t>(headerLength(), packet.size()));
 		} else if (version() == 6) {
 			return packet.subspan(40);
 		} else {
@@ -133,26 +250,159 @@ namespace lpvpn::ip {
 	}
 
 	void Packet4::recalculateChecksum() {
-		uint16_t checksum = 0;
-		for (size_t i = 0; i < this->packet.size(); i++) {
-			if (i == 10 || i == 11) {
+		auto header = packet.data();
+		writeU16(header + 10, 0);
+		writeU16(header + 10, ~onesComplementSum(packet.subspan(0, headerLength())));
+	}
+
+	// offset of the TCP / UDP checksum inside the packet, 0 if there is none
+	static size_t l4ChecksumOffset(Packet4 &packet) {
+		if (packet.isFragment()) {
+			return 0;
+		}
+		size_t offset = packet.headerLength();
+		switch (packet.protocol()) {
+			case PROTOCOL_TCP:
+				offset += 16;
+				break;
+			case PROTOCOL_UDP:
+				offset += 6;
+				break;
+			default:
+				return 0;
+		}
+		if (offset + 2 > packet.packet.size()) {
+			return 0;
+		}
+		return offset;
+	}
+
+	void Packet4::recalculateL4Checksum() {
+		auto offset = l4ChecksumOffset(*this);
+		if (offset == 0) {
+			return;
+		}
+		size_t end = std::min<size_t>(totalLength(), packet.size());
+		auto segment = packet.subspan(headerLength(), end - headerLength());
+		// pseudo header: addresses, protocol and L4 length
+		uint32_t pseudo = onesComplementSum(packet.subspan(12, 8));
+		pseudo += protocol();
+		pseudo += static_cast<uint32_t>(segment.size());
+		writeU16(packet.data() + offset, 0);
+		uint16_t checksum = ~onesComplementSum(segment, pseudo);
+		if (checksum == 0 && protocol() == PROTOCOL_UDP) {
+			// 0 means no checksum for UDP
+			checksum = 0xFFFF;
+		}
+		writeU16(packet.data() + offset, checksum);
+	}
+
+	bool Packet4::clampMSS(uint16_t mss) {
+		const uint8_t TCP_SYN = 0x02;
+		const uint8_t OPTION_END = 0;
+		const uint8_t OPTION_NOP = 1;
+		const uint8_t OPTION_MSS = 2;
+
+		if (packet.size() < 20 || protocol() != PROTOCOL_TCP || isFragment()) {
+			return false;
+		}
+		auto p = packet.data();
+		size_t ihl = headerLength();
+		if (packet.size() < ihl + 20 || (p[ihl + 13] & TCP_SYN) == 0) {
+			return false;
+		}
+		size_t end = ihl + (p[ihl + 12] >> 4) * 4;
+		if (end > packet.size()) {
+			return false;
+		}
+		for (size_t i = ihl + 20; i < end;) {
+			auto kind = p[i];
+			if (kind == OPTION_END) {
+				break;
+			}
+			if (kind == OPTION_NOP) {
+				i++;
+				continue;
+			}
+			if (i + 1 >= end || p[i + 1] < 2 || i + p[i + 1] > end) {
+				return false;
+			}
+			if (kind != OPTION_MSS || p[i + 1] != 4) {
+				i += p[i + 1];
 				continue;
 			}
-			uint16_t prev = checksum;
-			checksum += this->packet[i];
-			if (checksum < prev) {
-				checksum++;
+			if (readU16(p + i + 2) <= mss) {
+				return false;
+			}
+			// options aren't word aligned, the value may straddle two of
+			// the words the checksum is made of
+			size_t first = (i + 2) & ~size_t(1);
+			size_t last = (i + 3) & ~size_t(1);
+			uint32_t delta = 0;
+			for (size_t w = first; w <= last; w += 2) {
+				delta += static_cast<uint16_t>(~readU16(p + w));
 			}
+			writeU16(p + i + 2, mss);
+			for (size_t w = first; w <= last; w += 2) {
+				delta += readU16(p + w);
+			}
+			uint16_t checksum = ~readU16(p + ihl + 16);
+			writeU16(p + ihl + 16, ~fold(uint32_t(checksum) + fold(delta)));
+			return true;
 		}
+		return false;
 	}
 
 	void Packet4::setSrcAddr(Address4 addr) {
-		memcpy(packet.data() + 12, addr.addr.data(), 4);
-		recalculateChecksum();
+		setAddrs(addr, dstAddr());
 	}
 
 	void Packet4::setDstAddr(Address4 addr) {
-		memcpy(packet.data() + 16, addr.addr.data(), 4);
-		recalculateChecksum();
+		setAddrs(srcAddr(), addr);
+	}
+
+	void Packet4::setAddrs(Address4 src, Address4 dst) {
+		auto header = packet.data();
+		if (memcmp(header + 12, src.addr.data(), 4) == 0 && memcmp(header + 16, dst.addr.data(), 4) == 0) {
+			return;
+		}
+
+		// RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'), summed over the four
+		// address words that change
+		uint32_t delta = 0;
+		for (size_t i = 12; i < 20; i += 2) {
+			delta += static_cast<uint16_t>(~readU16(header + i));
+		}
+		memcpy(header + 12, src.addr.data(), 4);
+		memcpy(header + 16, dst.addr.data(), 4);
+		for (size_t i = 12; i < 20; i += 2) {
+			delta += readU16(header + i);
+		}
+		delta = fold(delta);
+
+		auto patch = [&](size_t offset) {
+			uint16_t checksum = ~readU16(header + offset);
+			writeU16(header + offset, ~fold(uint32_t(checksum) + delta));
+		};
+
+		patch(10);
+
+		// the pseudo header covers the same addresses
+		auto offset = l4ChecksumOffset(*this);
+		if (offset == 0) {
+			return;
+		}
+		if (protocol() == PROTOCOL_UDP) {
+			if (readU16(header + offset) == 0) {
+				// checksum disabled by the sender
+				return;
+			}
+			patch(offset);
+			if (readU16(header + offset) == 0) {
+				writeU16(header + offset, 0xFFFF);
+			}
+			return;
+		}
+		patch(offset);
 	}
 }
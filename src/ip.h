@@ -8,6 +8,17 @@
 namespace lpvpn::ip {
 	class Packet4;
 
+	enum Protocol {
+		PROTOCOL_ICMP = 1,
+		PROTOCOL_IGMP = 2,
+		PROTOCOL_TCP = 6,
+		PROTOCOL_UDP = 17,
+	};
+
+	// one's complement sum of data as big endian 16 bit words (RFC 1071),
+	// folded to 16 bits but not inverted
+	uint16_t onesComplementSum(std::span<const uint8_t> data, uint32_t initial = 0);
+
 	class Packet {
 		public:
 		Packet(std::span<uint8_t> packet);
@@ -35,6 +46,8 @@ namespace lpvpn::ip {
 		bool operator<(const Address4& other) const;
 		bool operator>(const Address4& other) const;
 		std::string toString() const;
+		// dotted quad, throws std::invalid_argument on anything else
+		static Address4 fromString(const std::string &str);
 
 		std::array<uint8_t, 4> addr;
 	};
@@ -63,10 +76,21 @@ namespace lpvpn::ip {
 
 		Address4 srcAddr();
 		Address4 dstAddr();
+		uint8_t headerLength();
+		uint16_t totalLength();
+		uint8_t protocol();
+		bool isFragment();
 		std::span<uint8_t> payload();
 
 		void recalculateChecksum();
+		void recalculateL4Checksum();
 		void setSrcAddr(Address4 addr);
 		void setDstAddr(Address4 addr);
+		// rewrites both addresses, patching the IP and TCP / UDP checksums
+		// incrementally (RFC 1624)
+		void setAddrs(Address4 src, Address4 dst);
+		// lowers the MSS option of a TCP SYN to at most mss, patching the
+		// checksum incrementally; returns whether anything changed
+		bool clampMSS(uint16_t mss);
 	};
 }
@@ -0,0 +1,804 @@
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/if_tun.h>
+
+#include "tun.h"
+#include "event.h"
+#include "log.h"
+#include "metrics.h"
+#include "uring.h"
+
+// the kernel allows up to 256 queues per device, but there is no point in
+// running more readers than we have cores to spread flows across
+#define MAX_QUEUES 16
+#define MAX_PACKET_SIZE 65536
+// packets read per readiness event before going back to the loop
+#define READ_BATCH 64
+
+// io_uring engine: reads kept outstanding per queue, provided buffers
+// backing them (power of two), and writes queued before a submit
+#define URING_READ_DEPTH 32
+#define URING_BUFFERS 64
+#define URING_WRITE_BATCH 32
+// fixed write slots, frames that don't fit go through writev
+#define URING_WRITE_SLOTS 256
+#define URING_WRITE_SLOT_SIZE 2048
+#define URING_OFFLOAD_WRITE_SLOTS 32
+
+#define URING_READ 0
+#define URING_STOP 1
+
+// VirtioNetHdr, <linux/virtio_net.h> doesn't compile as C++
+struct VirtioNetHdr {
+	uint8_t flags;
+	uint8_t gsoType;
+	uint16_t hdrLen;
+	uint16_t gsoSize;
+	uint16_t csumStart;
+	uint16_t csumOffset;
+};
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_GSO_NONE 0
+#define VIRTIO_NET_HDR_GSO_TCPV4 1
+#define VIRTIO_NET_HDR_GSO_ECN 0x80
+
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_CWR 0x80
+
+const char *LPVPN_ADAPTER_NAME = "partylan";
+
+namespace lpvpn::tun {
+	class Tun::Impl {
+		public:
+		Impl(const Options &options): options(options) {
+			auto queueCount = options.queues;
+			if (queueCount == 0) {
+				queueCount = std::thread::hardware_concurrency();
+			}
+			queueCount = std::clamp<size_t>(queueCount, 1, MAX_QUEUES);
+			try {
+				for (size_t i = 0; i < queueCount; i++) {
+					queues.push_back(openQueue(true));
+				}
+			} catch (std::system_error &e) {
+				// kernels without IFF_MULTI_QUEUE reject the flag with EINVAL
+				if (!queues.empty() || e.code().value() != EINVAL) {
+					closeAll();
+					throw;
+				}
+				LOG("IFF_MULTI_QUEUE not supported, falling back to a single queue");
+				queues.push_back(openQueue(false));
+			}
+			for (size_t i = 0; i < queues.size(); i++) {
+				callbackMutexes.push_back(std::make_unique<std::mutex>());
+			}
+			if (this->options.uring) {
+				try {
+					startUring();
+				} catch (std::system_error &e) {
+					LOG("io_uring unavailable (" << e.what() << "), falling back to read / write");
+					stopUring();
+					this->options.uring = false;
+				}
+			}
+			LOG("Opened " << ifName << " with " << queues.size() << " queue(s)" << (this->options.offload ? ", offload enabled" : "") << (this->options.uring ? ", io_uring" : ""));
+			if (this->options.uring) {
+				return;
+			}
+
+			// one loop per queue, so each queue is read on its own core
+			for (size_t i = 0; i < queues.size(); i++) {
+				auto loop = std::make_unique<event::Loop>();
+				loop->watch(queues[i], [this, i]() {
+					read(queues[i], *callbackMutexes[i]);
+				});
+				threads.emplace_back([loop = loop.get()]() {
+					loop->run();
+				});
+				loops.push_back(std::move(loop));
+			}
+		};
+
+		~Impl() {
+			flush();
+			for (auto &loop : loops) {
+				loop->stop();
+			}
+			if (stopFd >= 0) {
+				uint64_t value = readers.size();
+				::write(stopFd, &value, sizeof(value));
+			}
+			for (auto &thread : threads) {
+				if (thread.joinable()) {
+					thread.join();
+				}
+			}
+			stopUring();
+			closeAll();
+
+			LOG("Tun::Impl destroyed");
+		};
+
+		void write(Packet &packet) {
+			if (!options.offload) {
+				writeFrame(nullptr, packet.packet);
+				return;
+			}
+			auto &p = pending;
+			if (p.owner != this) {
+				// another device's super-packet, only when there are several
+				if (p.owner != nullptr) {
+					p.owner->flush();
+				}
+				p.owner = this;
+			}
+			if (p.coalesce.append(packet)) {
+				return;
+			}
+			flushCoalesced(p.coalesce);
+			if (!p.coalesce.start(packet)) {
+				VirtioNetHdr hdr = {};
+				writeFrame(&hdr, packet.packet);
+			}
+		};
+
+		// only writes out the calling thread's super-packet, every writer
+		// flushes after its own bursts
+		void flush() {
+			if (options.offload && pending.owner == this) {
+				flushCoalesced(pending.coalesce);
+				pending.owner = nullptr;
+			}
+			if (writeRing != nullptr) {
+				std::lock_guard<std::mutex> lk(writeMutex);
+				writeRing->submit();
+				writesQueued = 0;
+				reapWrites();
+			}
+		}
+
+		void onData(std::function<void(Packet &packet)> cb) {
+			setCallback([&]() {
+				this->dataCb = cb;
+			});
+		};
+
+		void onFlush(std::function<void()> cb) {
+			setCallback([&]() {
+				this->flushCb = cb;
+			});
+		};
+
+		void setIP4(const Subnet4 &subnet) {
+			if (currentSubnet != nullptr && subnet == *currentSubnet) {
+				return;
+			}
+
+			auto sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+			if (sock < 0) {
+				throw std::system_error(errno, std::generic_category(), "Failed to create socket");
+			}
+
+			auto ioctlOrThrow = [&](unsigned long op, struct ifreq &ifr, const char *what) {
+				if (ioctl(sock, op, &ifr) < 0) {
+					auto err = errno;
+					close(sock);
+					throw std::system_error(err, std::generic_category(), what);
+				}
+			};
+
+			auto ifr = ifRequest();
+			auto sin = reinterpret_cast<struct sockaddr_in *>(&ifr.ifr_addr);
+			sin->sin_family = AF_INET;
+			memcpy(&sin->sin_addr, subnet.addr.data(), 4);
+			ioctlOrThrow(SIOCSIFADDR, ifr, "Failed to set address");
+
+			auto mask = subnet.mask();
+			ifr = ifRequest();
+			sin = reinterpret_cast<struct sockaddr_in *>(&ifr.ifr_netmask);
+			sin->sin_family = AF_INET;
+			memcpy(&sin->sin_addr, mask.addr.data(), 4);
+			ioctlOrThrow(SIOCSIFNETMASK, ifr, "Failed to set netmask");
+
+			ifr = ifRequest();
+			ioctlOrThrow(SIOCGIFFLAGS, ifr, "Failed to get interface flags");
+			ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+			ioctlOrThrow(SIOCSIFFLAGS, ifr, "Failed to bring interface up");
+
+			close(sock);
+
+			currentSubnet = std::make_unique<Subnet4>(subnet);
+		};
+
+		private:
+		// Linux GRO in miniature: merges in-order, full-sized segments of one
+		// TCP flow so they reach the kernel in a single write. Every writing
+		// thread has its own, the inbound workers are sharded by peer so a
+		// flow's segments arrive on one thread without others in between.
+		struct Coalescer {
+			std::vector<uint8_t> buffer;
+			size_t segments = 0;
+			size_t headerLen = 0;
+			uint16_t mss = 0;
+			uint32_t nextSeq = 0;
+			// a short or PSH segment ends the super-packet
+			bool closed = false;
+
+			static size_t tcpHeaderLen(Packet4 &packet) {
+				if (packet.packet.size() < 20 || packet.version() != 4 || packet.protocol() != PROTOCOL_TCP || packet.isFragment()) {
+					return 0;
+				}
+				size_t ihl = packet.headerLength();
+				if (ihl < 20 || packet.packet.size() < ihl + 20 || packet.totalLength() != packet.packet.size()) {
+					return 0;
+				}
+				if ((packet.packet[6] & 0x20) != 0) {
+					// more fragments
+					return 0;
+				}
+				size_t thl = (packet.packet[ihl + 12] >> 4) * 4;
+				if (thl < 20 || packet.packet.size() <= ihl + thl) {
+					// too short or no payload
+					return 0;
+				}
+				auto flags = packet.packet[ihl + 13];
+				if (flags != TCP_ACK && flags != (TCP_ACK | TCP_PSH)) {
+					return 0;
+				}
+				return ihl + thl;
+			}
+
+			static uint32_t readU32(const uint8_t *p) {
+				return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+			}
+
+			bool start(Packet &packet) {
+				auto packet4 = Packet4(packet.packet);
+				auto len = tcpHeaderLen(packet4);
+				if (len == 0) {
+					return false;
+				}
+				auto p = packet.packet.data();
+				buffer.assign(packet.packet.begin(), packet.packet.end());
+				segments = 1;
+				headerLen = len;
+				mss = static_cast<uint16_t>(packet.packet.size() - len);
+				nextSeq = readU32(p + packet4.headerLength() + 4) + mss;
+				closed = (p[packet4.headerLength() + 13] & TCP_PSH) != 0;
+				return true;
+			}
+
+			bool append(Packet &packet) {
+				if (segments == 0 || closed) {
+					return false;
+				}
+				auto packet4 = Packet4(packet.packet);
+				if (tcpHeaderLen(packet4) != headerLen) {
+					return false;
+				}
+				auto p = packet.packet.data();
+				auto q = buffer.data();
+				size_t ihl = packet4.headerLength();
+				size_t payload = packet.packet.size() - headerLen;
+				if (payload > mss || buffer.size() + payload > UINT16_MAX) {
+					return false;
+				}
+				// everything but length, ID and checksums must match: TOS,
+				// flags, TTL, protocol, addresses and IP options...
+				if (p[1] != q[1] || memcmp(p + 6, q + 6, 4) != 0 || memcmp(p + 12, q + 12, ihl - 12) != 0) {
+					return false;
+				}
+				// ...ports, ack, header length, window and TCP options
+				if (memcmp(p + ihl, q + ihl, 4) != 0 || memcmp(p + ihl + 8, q + ihl + 8, 5) != 0 ||
+					memcmp(p + ihl + 14, q + ihl + 14, 2) != 0 || memcmp(p + ihl + 20, q + ihl + 20, headerLen - ihl - 20) != 0) {
+					return false;
+				}
+				if (readU32(p + ihl + 4) != nextSeq) {
+					return false;
+				}
+				auto flags = p[ihl + 13];
+				buffer.insert(buffer.end(), p + headerLen, p + packet.packet.size());
+				segments++;
+				nextSeq += static_cast<uint32_t>(payload);
+				if (payload < mss || (flags & TCP_PSH) != 0) {
+					q = buffer.data();
+					q[ihl + 13] |= flags & TCP_PSH;
+					closed = true;
+				}
+				return true;
+			}
+		};
+
+		// a writing thread's super-packet and the device it's for. An empty
+		// one lets go of its device, so only a burst still in flight on a
+		// thread points at one.
+		struct Pending {
+			Impl *owner = nullptr;
+			Coalescer coalesce;
+		};
+
+		static thread_local Pending pending;
+
+		// io_uring state for one queue's reader thread, buffers must go
+		// before the ring they are registered with
+		struct UringReader {
+			std::unique_ptr<uring::Ring> ring;
+			std::unique_ptr<uring::BufferRing> buffers;
+			uint64_t stopValue = 0;
+		};
+
+		Options options;
+		std::vector<int> queues;
+		std::vector<std::unique_ptr<event::Loop>> loops;
+		std::vector<std::thread> threads;
+		std::string ifName = LPVPN_ADAPTER_NAME;
+		std::unique_ptr<Subnet4> currentSubnet;
+
+		// the readers run from the constructor on, each holds its queue's
+		// mutex while it delivers a batch so the callbacks can be set under
+		// it. Only setCallback takes more than one.
+		std::vector<std::unique_ptr<std::mutex>> callbackMutexes;
+		std::function<void(Packet &packet)> dataCb;
+		std::function<void()> flushCb;
+
+
+		std::vector<std::unique_ptr<UringReader>> readers;
+		// semaphore eventfd, every reader keeps a read on it to be told to stop
+		int stopFd = -1;
+
+		std::mutex writeMutex;
+		std::unique_ptr<uring::Ring> writeRing;
+		std::vector<uint8_t> writeSlab;
+		std::vector<uint16_t> freeSlots;
+		size_t writeSlots = 0;
+		size_t writeSlotSize = 0;
+		size_t writesQueued = 0;
+
+		metrics::Counter &wakeups = metrics::wakeups("tun_reader");
+		metrics::Counter &dropWrite = metrics::drops("tun_write");
+		metrics::Histogram &rxSegments = metrics::registry().histogram("lpvpn_tun_gso_segments", "Segments per offloaded frame, by direction", {{"direction", "rx"}});
+		metrics::Histogram &txSegments = metrics::registry().histogram("lpvpn_tun_gso_segments", "Segments per offloaded frame, by direction", {{"direction", "tx"}});
+
+		struct ifreq ifRequest() {
+			struct ifreq ifr = {};
+			strncpy(ifr.ifr_name, ifName.c_str(), IFNAMSIZ - 1);
+			return ifr;
+		}
+
+		int openQueue(bool multiQueue) {
+			auto fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+			if (fd < 0) {
+				throw std::system_error(errno, std::generic_category(), "Failed to open /dev/net/tun");
+			}
+			auto ifr = ifRequest();
+			ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+			if (multiQueue) {
+				ifr.ifr_flags |= IFF_MULTI_QUEUE;
+			}
+			if (options.offload) {
+				ifr.ifr_flags |= IFF_VNET_HDR;
+			}
+			if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+				auto err = errno;
+				close(fd);
+				throw std::system_error(err, std::generic_category(), "Failed to create adapter");
+			}
+			if (options.offload) {
+				int hdrSize = sizeof(VirtioNetHdr);
+				unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO_ECN;
+				if (ioctl(fd, TUNSETVNETHDRSZ, &hdrSize) < 0 || ioctl(fd, TUNSETOFFLOAD, offloads) < 0) {
+					auto err = errno;
+					close(fd);
+					throw std::system_error(err, std::generic_category(), "Failed to enable offloads");
+				}
+			}
+			// the kernel may have picked a different name, later queues must attach to it
+			ifName = ifr.ifr_name;
+			return fd;
+		}
+
+		// runs assign with every reader between batches
+		template<typename F>
+		void setCallback(F assign) {
+			std::vector<std::unique_lock<std::mutex>> locks;
+			for (auto &mutex : callbackMutexes) {
+				locks.emplace_back(*mutex);
+			}
+			assign();
+		}
+
+		// called by the queue's loop when fd is readable, drains a batch
+		void read(int fd, std::mutex &callbackMutex) {
+			thread_local std::vector<uint8_t> buf(sizeof(VirtioNetHdr) + MAX_PACKET_SIZE);
+			thread_local std::vector<uint8_t> segment;
+			wakeups.add();
+			std::lock_guard<std::mutex> lk(callbackMutex);
+			for (size_t i = 0; i < READ_BATCH; i++) {
+				auto size = ::read(fd, buf.data(), buf.size());
+				if (size < 0) {
+					if (errno != EAGAIN && errno != EINTR) {
+						LOG("Failed to read packet: " << strerror(errno));
+					}
+					break;
+				}
+				receiveFrame(buf.data(), size, segment);
+			}
+			if (flushCb != nullptr) {
+				flushCb();
+			}
+		}
+
+		// hands one frame read from the device to dataCb
+		void receiveFrame(uint8_t *buf, size_t size, std::vector<uint8_t> &segment) {
+			if (size == 0 || this->dataCb == nullptr) {
+				return;
+			}
+			if (!options.offload) {
+				auto packet = Packet(std::span<uint8_t>(buf, size));
+				this->dataCb(packet);
+				return;
+			}
+			if (size < sizeof(VirtioNetHdr)) {
+				return;
+			}
+			VirtioNetHdr hdr;
+			memcpy(&hdr, buf, sizeof(hdr));
+			auto data = std::span<uint8_t>(buf + sizeof(hdr), size - sizeof(hdr));
+			receive(hdr, data, segment);
+		}
+
+		void startUring() {
+			stopFd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
+			if (stopFd < 0) {
+				throw std::system_error(errno, std::generic_category(), "Failed to create eventfd");
+			}
+
+			writeSlots = options.offload ? URING_OFFLOAD_WRITE_SLOTS : URING_WRITE_SLOTS;
+			writeSlotSize = options.offload ? sizeof(VirtioNetHdr) + MAX_PACKET_SIZE : URING_WRITE_SLOT_SIZE;
+			writeRing = std::make_unique<uring::Ring>(writeSlots);
+			writeSlab.resize(writeSlots * writeSlotSize);
+			for (size_t i = writeSlots; i > 0; i--) {
+				freeSlots.push_back(static_cast<uint16_t>(i - 1));
+			}
+			struct iovec iov = { writeSlab.data(), writeSlab.size() };
+			writeRing->registerBuffers(&iov, 1);
+
+			for (size_t i = 0; i < queues.size(); i++) {
+				auto reader = std::make_unique<UringReader>();
+				reader->ring = std::make_unique<uring::Ring>(URING_READ_DEPTH * 2);
+				reader->buffers = std::make_unique<uring::BufferRing>(*reader->ring, 0, URING_BUFFERS, sizeof(VirtioNetHdr) + MAX_PACKET_SIZE);
+				readers.push_back(std::move(reader));
+			}
+
+			// a read on a non-blocking fd fails with EAGAIN instead of waiting
+			for (auto fd : queues) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+			}
+			for (size_t i = 0; i < queues.size(); i++) {
+				threads.emplace_back([this, fd = queues[i], reader = readers[i].get(), callbackMutex = callbackMutexes[i].get()]() {
+					readUring(fd, *reader, *callbackMutex);
+				});
+			}
+		}
+
+		void stopUring() {
+			if (writeRing != nullptr) {
+				// wait for writes still in flight, their slots are about to go
+				while (freeSlots.size() < writeSlots && writeRing->submit(1) >= 0) {
+					reapWrites();
+				}
+			}
+			readers.clear();
+			writeRing.reset();
+			if (stopFd >= 0) {
+				close(stopFd);
+				stopFd = -1;
+			}
+		}
+
+		// io_uring read loop for one queue. Doesn't go through event::Loop:
+		// io_uring_enter submits the re-armed reads and waits for the next
+		// completions in one call, so a burst costs a single syscall.
+		void readUring(int fd, UringReader &reader, std::mutex &callbackMutex) {
+			thread_local std::vector<uint8_t> segment;
+			auto &ring = *reader.ring;
+			auto &buffers = *reader.buffers;
+
+			auto prepRead = [&]() {
+				auto sqe = ring.sqe();
+				sqe->opcode = IORING_OP_READ;
+				sqe->flags = IOSQE_BUFFER_SELECT;
+				sqe->fd = fd;
+				sqe->len = sizeof(VirtioNetHdr) + MAX_PACKET_SIZE;
+				sqe->buf_group = 0;
+				sqe->user_data = URING_READ;
+			};
+			auto sqe = ring.sqe();
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = stopFd;
+			sqe->addr = reinterpret_cast<uint64_t>(&reader.stopValue);
+			sqe->len = sizeof(reader.stopValue);
+			sqe->user_data = URING_STOP;
+			for (size_t i = 0; i < URING_READ_DEPTH; i++) {
+				prepRead();
+			}
+
+			bool stopping = false;
+			while (!stopping) {
+				auto ret = ring.submit(1);
+				if (ret < 0) {
+					LOG("io_uring_enter failed: " << strerror(-ret));
+					return;
+				}
+				wakeups.add();
+				std::lock_guard<std::mutex> lk(callbackMutex);
+				ring.reap([&](const struct io_uring_cqe &cqe) {
+					if (cqe.user_data == URING_STOP) {
+						stopping = true;
+						return;
+					}
+					if ((cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+						auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+						if (cqe.res > 0) {
+							receiveFrame(buffers.buffer(id), cqe.res, segment);
+						}
+						buffers.recycle(id);
+					} else if (cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ENOBUFS) {
+						LOG("Failed to read packet: " << strerror(-cqe.res));
+					}
+					prepRead();
+				});
+				buffers.commit();
+				if (flushCb != nullptr) {
+					flushCb();
+				}
+			}
+		}
+
+		// copies the frame into a fixed slot and queues it on the write ring,
+		// submitted by flush() or once URING_WRITE_BATCH frames are queued.
+		// false if it doesn't fit a slot.
+		bool writeUring(VirtioNetHdr *hdr, std::span<const uint8_t> data) {
+			size_t hdrSize = hdr != nullptr ? sizeof(*hdr) : 0;
+			if (hdrSize + data.size() > writeSlotSize) {
+				return false;
+			}
+			std::lock_guard<std::mutex> lk(writeMutex);
+			reapWrites();
+			if (freeSlots.empty()) {
+				writeRing->submit(1);
+				writesQueued = 0;
+				reapWrites();
+				if (freeSlots.empty()) {
+					dropWrite.add();
+					return true;
+				}
+			}
+			auto slot = freeSlots.back();
+			freeSlots.pop_back();
+			auto p = writeSlab.data() + slot * writeSlotSize;
+			if (hdr != nullptr) {
+				memcpy(p, hdr, hdrSize);
+			}
+			memcpy(p + hdrSize, data.data(), data.size());
+
+			// the ring has an entry per slot, so this can't come back empty
+			auto sqe = writeRing->sqe();
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->fd = queues[0];
+			sqe->addr = reinterpret_cast<uint64_t>(p);
+			sqe->len = static_cast<uint32_t>(hdrSize + data.size());
+			sqe->buf_index = 0;
+			sqe->user_data = slot;
+			if (++writesQueued >= URING_WRITE_BATCH) {
+				writeRing->submit();
+				writesQueued = 0;
+			}
+			return true;
+		}
+
+		// returns the slots of completed writes, must hold writeMutex
+		void reapWrites() {
+			writeRing->reap([&](const struct io_uring_cqe &cqe) {
+				freeSlots.push_back(static_cast<uint16_t>(cqe.user_data));
+				if (cqe.res < 0) {
+					dropWrite.add();
+					if (cqe.res != -EAGAIN && cqe.res != -EIO) {
+						LOG("Failed to write packet: " << strerror(-cqe.res));
+					}
+				}
+			});
+		}
+
+		// undoes the offloads for one frame read from the device and hands
+		// the resulting packets to dataCb
+		void receive(const VirtioNetHdr &hdr, std::span<uint8_t> data, std::vector<uint8_t> &segment) {
+			auto gsoType = hdr.gsoType & ~VIRTIO_NET_HDR_GSO_ECN;
+			if (gsoType == VIRTIO_NET_HDR_GSO_NONE) {
+				if ((hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0) {
+					// the kernel seeded the checksum field with the pseudo
+					// header sum, finish it over the rest of the packet
+					size_t start = hdr.csumStart;
+					size_t offset = start + hdr.csumOffset;
+					if (offset + 2 > data.size()) {
+						return;
+					}
+					uint16_t checksum = ~onesComplementSum(data.subspan(start));
+					if (checksum == 0 && offset == start + 6) {
+						// UDP reserves 0 for "no checksum"
+						checksum = 0xFFFF;
+					}
+					data[offset] = checksum >> 8;
+					data[offset + 1] = checksum & 0xFF;
+				}
+				auto packet = Packet(data);
+				this->dataCb(packet);
+				return;
+			}
+			if (gsoType != VIRTIO_NET_HDR_GSO_TCPV4 || hdr.gsoSize == 0) {
+				return;
+			}
+
+			// segment the super-packet back into MSS sized packets. This
+			// happens here rather than at the transport: routing, the
+			// workers' pool buffers, compression and FEC all work on single
+			// IP packets no bigger than the tunnel carries
+			auto packet4 = Packet4(data);
+			if (data.size() < 20 || packet4.version() != 4) {
+				return;
+			}
+			size_t ihl = packet4.headerLength();
+			if (data.size() < ihl + 20) {
+				return;
+			}
+			size_t headerLen = ihl + (data[ihl + 12] >> 4) * 4;
+			if (headerLen > data.size()) {
+				return;
+			}
+			size_t mss = hdr.gsoSize;
+			auto payload = data.subspan(headerLen);
+			rxSegments.observe((payload.size() + mss - 1) / mss);
+			uint16_t id = (data[4] << 8) | data[5];
+			uint32_t seq = Coalescer::readU32(data.data() + ihl + 4);
+			uint8_t flags = data[ihl + 13];
+			for (size_t offset = 0; offset < payload.size(); offset += mss) {
+				auto chunk = payload.subspan(offset, std::min(mss, payload.size() - offset));
+				bool first = offset == 0;
+				bool last = offset + chunk.size() == payload.size();
+				auto size = headerLen + chunk.size();
+				segment.resize(size);
+				memcpy(segment.data(), data.data(), headerLen);
+				memcpy(segment.data() + headerLen, chunk.data(), chunk.size());
+				auto p = segment.data();
+				p[2] = size >> 8;
+				p[3] = size & 0xFF;
+				uint16_t segmentID = id + static_cast<uint16_t>(offset / mss);
+				p[4] = segmentID >> 8;
+				p[5] = segmentID & 0xFF;
+				uint32_t segmentSeq = seq + static_cast<uint32_t>(offset);
+				for (size_t i = 0; i < 4; i++) {
+					p[ihl + 4 + i] = (segmentSeq >> (8 * (3 - i))) & 0xFF;
+				}
+				p[ihl + 13] = flags;
+				if (!last) {
+					p[ihl + 13] &= ~(TCP_FIN | TCP_PSH);
+				}
+				if (!first) {
+					p[ihl + 13] &= ~TCP_CWR;
+				}
+				auto packet = Packet(segment);
+				auto segment4 = packet.toPacket4();
+				segment4.recalculateChecksum();
+				segment4.recalculateL4Checksum();
+				this->dataCb(packet);
+			}
+		}
+
+		void writeFrame(VirtioNetHdr *hdr, std::span<const uint8_t> data) {
+			// any queue can take writes, the kernel injects the packet on the
+			// writing thread's CPU regardless of which queue it came through
+			if (writeRing != nullptr && writeUring(hdr, data)) {
+				return;
+			}
+			struct iovec iov[2];
+			int count = 0;
+			if (hdr != nullptr) {
+				iov[count++] = { hdr, sizeof(*hdr) };
+			}
+			iov[count++] = { const_cast<uint8_t *>(data.data()), data.size() };
+			auto ret = ::writev(queues[0], iov, count);
+			if (ret < 0) {
+				dropWrite.add();
+				if (errno != EAGAIN && errno != EIO) {
+					LOG("Failed to write packet: " << strerror(errno));
+				}
+			}
+		}
+
+		// writes out coalesce's super-packet, if it has one
+		void flushCoalesced(Coalescer &coalesce) {
+			if (coalesce.segments == 0) {
+				return;
+			}
+			VirtioNetHdr hdr = {};
+			auto packet4 = Packet4(coalesce.buffer);
+			txSegments.observe(coalesce.segments);
+			if (coalesce.segments > 1) {
+				auto p = coalesce.buffer.data();
+				size_t ihl = packet4.headerLength();
+				auto size = coalesce.buffer.size();
+				p[2] = size >> 8;
+				p[3] = size & 0xFF;
+				packet4.recalculateChecksum();
+				// CHECKSUM_PARTIAL: the field holds the pseudo header sum and
+				// the kernel completes it per segment
+				uint32_t pseudo = onesComplementSum(packet4.packet.subspan(12, 8));
+				pseudo += PROTOCOL_TCP;
+				pseudo += static_cast<uint32_t>(size - ihl);
+				uint16_t sum = onesComplementSum({}, pseudo);
+				p[ihl + 16] = sum >> 8;
+				p[ihl + 17] = sum & 0xFF;
+				hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+				hdr.gsoType = VIRTIO_NET_HDR_GSO_TCPV4;
+				hdr.hdrLen = static_cast<uint16_t>(coalesce.headerLen);
+				hdr.gsoSize = coalesce.mss;
+				hdr.csumStart = static_cast<uint16_t>(ihl);
+				hdr.csumOffset = 16;
+			}
+			writeFrame(&hdr, coalesce.buffer);
+			coalesce.segments = 0;
+		}
+
+		void closeAll() {
+			for (auto fd : queues) {
+				close(fd);
+			}
+			queues.clear();
+		}
+	};
+
+	thread_local Tun::Impl::Pending Tun::Impl::pending;
+
+	Tun::Tun() : impl(std::make_unique<Impl>(Options())) {};
+	Tun::Tun(const Options &options) : impl(std::make_unique<Impl>(options)) {};
+	Tun::~Tun() {};
+	void Tun::write(Packet &packet) {
+		this->impl->write(packet);
+	};
+	void Tun::flush() {
+		this->impl->flush();
+	};
+	void Tun::onData(std::function<void(Packet &packet)> cb) {
+		this->impl->onData(cb);
+	};
+	void Tun::onFlush(std::function<void()> cb) {
+		this->impl->onFlush(cb);
+	};
+	void Tun::setIP4(const Subnet4 &subnet) {
+		this->impl->setIP4(subnet);
+	};
+}
+
+#endif
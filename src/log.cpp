@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "log.h"
+
+// must be a power of two
+#define QUEUE_SIZE 1024
+#define MAX_MESSAGE 256
+
+const auto WRITER_INTERVAL = std::chrono::milliseconds(100);
+const auto SUMMARY_INTERVAL = std::chrono::seconds(1);
+const auto FLUSH_TIMEOUT = std::chrono::seconds(1);
+
+namespace lpvpn::log {
+	static std::atomic<Site *> sites = nullptr;
+
+	Site::Site(const char *file, int line): file(file), line(line) {
+		next = sites.load();
+		while (!sites.compare_exchange_weak(next, this)) {}
+	}
+
+	bool Site::allow() {
+		auto now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		auto current = window.load(std::memory_order_relaxed);
+		if (current != now && window.compare_exchange_strong(current, now, std::memory_order_relaxed)) {
+			count.store(0, std::memory_order_relaxed);
+		}
+		if (count.fetch_add(1, std::memory_order_relaxed) < SITE_RATE) {
+			return true;
+		}
+		suppressed.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	// Bounded multi-producer queue (Vyukov) drained by one writer thread.
+	// Producers only ever CAS a counter and copy into their slot, so a
+	// packet thread that logs pays for formatting but never for I/O.
+	class Logger {
+		public:
+		Logger(): slots(std::make_unique<Slot[]>(QUEUE_SIZE)) {
+			for (size_t i = 0; i < QUEUE_SIZE; i++) {
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+			}
+			thread = std::thread([this]() {
+				run();
+			});
+		}
+
+		~Logger() {
+			{
+				std::lock_guard<std::mutex> lk(mutex);
+				running = false;
+			}
+			wakeup.notify_all();
+			thread.join();
+		}
+
+		void push(const Site &site, std::string_view message) {
+			auto pos = enqueuePos.load(std::memory_order_relaxed);
+			Slot *slot;
+			while (true) {
+				slot = &slots[pos & (QUEUE_SIZE - 1)];
+				auto sequence = slot->sequence.load(std::memory_order_acquire);
+				auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+				if (diff == 0) {
+					if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						break;
+					}
+				} else if (diff < 0) {
+					dropped.fetch_add(1, std::memory_order_relaxed);
+					return;
+				} else {
+					pos = enqueuePos.load(std::memory_order_relaxed);
+				}
+			}
+			slot->time = std::chrono::system_clock::now();
+			slot->site = &site;
+			slot->length = std::min(message.size(), sizeof(slot->text));
+			memcpy(slot->text, message.data(), slot->length);
+			slot->sequence.store(pos + 1, std::memory_order_release);
+			if (writerIdle.load(std::memory_order_relaxed)) {
+				wakeup.notify_one();
+			}
+		}
+
+		void flush() {
+			auto target = enqueuePos.load();
+			std::unique_lock<std::mutex> lk(mutex);
+			flushRequested = true;
+			wakeup.notify_one();
+			drained.wait_for(lk, FLUSH_TIMEOUT, [&]() {
+				return dequeuePos.load() >= target || !running;
+			});
+		}
+
+		private:
+		struct Slot {
+			std::atomic<size_t> sequence;
+			std::chrono::system_clock::time_point time;
+			const Site *site;
+			size_t length;
+			char text[MAX_MESSAGE];
+		};
+
+		void run() {
+			auto nextSummary = std::chrono::steady_clock::now() + SUMMARY_INTERVAL;
+			std::unique_lock<std::mutex> lk(mutex);
+			while (true) {
+				auto stopping = !running;
+				flushRequested = false;
+				lk.unlock();
+				drain();
+				if (stopping || std::chrono::steady_clock::now() >= nextSummary) {
+					summarize();
+					nextSummary = std::chrono::steady_clock::now() + SUMMARY_INTERVAL;
+				}
+				std::clog.flush();
+				lk.lock();
+				drained.notify_all();
+				if (stopping) {
+					return;
+				}
+				writerIdle = true;
+				wakeup.wait_for(lk, WRITER_INTERVAL, [this]() {
+					return !running || flushRequested;
+				});
+				writerIdle = false;
+			}
+		}
+
+		void drain() {
+			while (true) {
+				auto pos = dequeuePos.load(std::memory_order_relaxed);
+				auto &slot = slots[pos & (QUEUE_SIZE - 1)];
+				if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+					return;
+				}
+				prefix(slot.time, slot.site->file, slot.site->line) << std::string_view(slot.text, slot.length) << '\n';
+				slot.sequence.store(pos + QUEUE_SIZE, std::memory_order_release);
+				dequeuePos.store(pos + 1, std::memory_order_release);
+			}
+		}
+
+		void summarize() {
+			auto now = std::chrono::system_clock::now();
+			for (auto site = sites.load(); site != nullptr; site = site->next) {
+				auto count = site->suppressed.exchange(0, std::memory_order_relaxed);
+				if (count > 0) {
+					prefix(now, site->file, site->line) << "(suppressed " << count << " similar messages)\n";
+				}
+			}
+			auto count = dropped.exchange(0, std::memory_order_relaxed);
+			if (count > 0) {
+				prefix(now, file_name(__FILE__), __LINE__) << "Log buffer full, dropped " << count << " messages\n";
+			}
+		}
+
+		// starts a line, formatting the timestamp only when the second changes
+		std::ostream &prefix(std::chrono::system_clock::time_point time, const char *file, int line) {
+			auto seconds = std::chrono::system_clock::to_time_t(time);
+			if (seconds != cachedSeconds) {
+				auto utc = std::gmtime(&seconds);
+				strftime(cachedTimestamp, sizeof(cachedTimestamp), "[%Y-%m-%dT%H:%M:%S]", utc);
+				cachedSeconds = seconds;
+			}
+			return std::clog << cachedTimestamp << " v" LPVPN_VERSION "(" LPVPN_GIT_VERSION ") " << file << ":" << line << " ";
+		}
+
+		std::unique_ptr<Slot[]> slots;
+		alignas(64) std::atomic<size_t> enqueuePos = 0;
+		alignas(64) std::atomic<size_t> dequeuePos = 0;
+		std::atomic<uint64_t> dropped = 0;
+
+		std::mutex mutex;
+		std::condition_variable wakeup;
+		std::condition_variable drained;
+		std::atomic<bool> writerIdle = false;
+		bool flushRequested = false;
+		bool running = true;
+		std::thread thread;
+
+		// writer thread only
+		time_t cachedSeconds = -1;
+		char cachedTimestamp[32] = {0};
+	};
+
+	static Logger &logger() {
+		static Logger instance;
+		return instance;
+	}
+
+	std::ostringstream &stream() {
+		thread_local std::ostringstream instance;
+		instance.str({});
+		instance.clear();
+		return instance;
+	}
+
+	void write(const Site &site, std::string_view message) {
+		logger().push(site, message);
+	}
+
+	void flush() {
+		logger().flush();
+	}
+}
@@ -1,8 +1,9 @@
 #pragma once
 
-#include <iostream>
-#include <chrono>
-#include <ctime>
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string_view>
 
 #ifndef LPVPN_VERSION
 #define LPVPN_VERSION "unknown_version"
@@ -22,11 +23,47 @@ constexpr const char* file_name(const char* path) {
 	return file;
 }
 
+namespace lpvpn::log {
+	// at most this many lines per second from one LOG call site, the rest
+	// are counted and summarized
+	const uint32_t SITE_RATE = 10;
+
+	// One per LOG call site. Sites link themselves into a global list so the
+	// writer can report what each of them suppressed.
+	class Site {
+		public:
+		Site(const char *file, int line);
+
+		// false once this site used up its lines for the current second
+		bool allow();
+
+		const char *file;
+		const int line;
+
+		private:
+		friend class Logger;
+
+		std::atomic<int64_t> window = -1;
+		std::atomic<uint32_t> count = 0;
+		std::atomic<uint64_t> suppressed = 0;
+		Site *next;
+	};
+
+	// a reset, per thread stream to format into
+	std::ostringstream &stream();
+	// queues a line for the writer thread, never blocks; drops the line if
+	// the buffer is full
+	void write(const Site &site, std::string_view message);
+	// waits (briefly) until everything queued so far has been written
+	void flush();
+}
+
 #define LOG(msg) \
 	do { \
-		auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()); \
-		auto utcnow = std::gmtime(&now); \
-		char buf[100] = {0}; \
-		strftime(buf, sizeof(buf), "[%Y-%m-%dT%H:%M:%S]", utcnow); \
-		std::clog << buf << " v" LPVPN_VERSION "(" LPVPN_GIT_VERSION ") " << file_name(__FILE__) << ":" << __LINE__ << " " << msg << std::endl; \
+		static lpvpn::log::Site lpvpnLogSite(file_name(__FILE__), __LINE__); \
+		if (lpvpnLogSite.allow()) { \
+			auto &lpvpnLogStream = lpvpn::log::stream(); \
+			lpvpnLogStream << msg; \
+			lpvpn::log::write(lpvpnLogSite, lpvpnLogStream.view()); \
+		} \
 	} while (0);
@@ -0,0 +1,209 @@
+#include <bit>
+#include <fstream>
+#include <sstream>
+
+#include "metrics.h"
+#include "file.h"
+#include "log.h"
+
+namespace lpvpn::metrics {
+	size_t threadSlot() {
+		static std::atomic<size_t> next = 0;
+		thread_local size_t slot = next++ % SLOTS;
+		return slot;
+	}
+
+	uint64_t Counter::value() const {
+		uint64_t total = 0;
+		for (auto &slot : slots) {
+			total += slot.value.load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+
+	void Histogram::observe(uint64_t v) {
+		size_t bucket = v <= 1 ? 0 : std::bit_width(v - 1);
+		if (bucket > BUCKETS) {
+			bucket = BUCKETS;
+		}
+		auto &slot = slots[threadSlot()];
+		slot.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+		slot.sum.fetch_add(v, std::memory_order_relaxed);
+	}
+
+	std::array<uint64_t, Histogram::BUCKETS + 1> Histogram::buckets() const {
+		std::array<uint64_t, BUCKETS + 1> total = {};
+		for (auto &slot : slots) {
+			for (size_t i = 0; i <= BUCKETS; i++) {
+				total[i] += slot.counts[i].load(std::memory_order_relaxed);
+			}
+		}
+		return total;
+	}
+
+	uint64_t Histogram::sum() const {
+		uint64_t total = 0;
+		for (auto &slot : slots) {
+			total += slot.sum.load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+
+	static std::string renderLabels(const Labels &labels) {
+		std::string ret;
+		for (auto &[key, value] : labels) {
+			if (!ret.empty()) {
+				ret += ",";
+			}
+			ret += key + "=\"";
+			for (auto c : value) {
+				if (c == '"' || c == '\\') {
+					ret += '\\';
+				} else if (c == '\n') {
+					ret += "\\n";
+					continue;
+				}
+				ret += c;
+			}
+			ret += "\"";
+		}
+		return ret;
+	}
+
+	Registry::Family &Registry::family(const std::string &name, const std::string &help, Type type) {
+		auto &family = families[name];
+		if (family.help.empty()) {
+			family.type = type;
+			family.help = help;
+		}
+		return family;
+	}
+
+	Counter &Registry::counter(const std::string &name, const std::string &help, const Labels &labels) {
+		std::lock_guard<std::mutex> lk(mutex);
+		auto &metric = family(name, help, TYPE_COUNTER).counters[renderLabels(labels)];
+		if (metric == nullptr) {
+			metric = std::make_unique<Counter>();
+		}
+		return *metric;
+	}
+
+	Gauge &Registry::gauge(const std::string &name, const std::string &help, const Labels &labels) {
+		std::lock_guard<std::mutex> lk(mutex);
+		auto &metric = family(name, help, TYPE_GAUGE).gauges[renderLabels(labels)];
+		if (metric == nullptr) {
+			metric = std::make_unique<Gauge>();
+		}
+		return *metric;
+	}
+
+	Histogram &Registry::histogram(const std::string &name, const std::string &help, const Labels &labels) {
+		std::lock_guard<std::mutex> lk(mutex);
+		auto &metric = family(name, help, TYPE_HISTOGRAM).histograms[renderLabels(labels)];
+		if (metric == nullptr) {
+			metric = std::make_unique<Histogram>();
+		}
+		return *metric;
+	}
+
+	std::string Registry::render() {
+		std::ostringstream out;
+		auto series = [&](const std::string &name, const std::string &labels) {
+			out << name;
+			if (!labels.empty()) {
+				out << "{" << labels << "}";
+			}
+			out << " ";
+		};
+
+		std::lock_guard<std::mutex> lk(mutex);
+		for (auto &[name, family] : families) {
+			out << "# HELP " << name << " " << family.help << "\n";
+			switch (family.type) {
+				case TYPE_COUNTER:
+					out << "# TYPE " << name << " counter\n";
+					for (auto &[labels, metric] : family.counters) {
+						series(name, labels);
+						out << metric->value() << "\n";
+					}
+					break;
+				case TYPE_GAUGE:
+					out << "# TYPE " << name << " gauge\n";
+					for (auto &[labels, metric] : family.gauges) {
+						series(name, labels);
+						out << metric->value() << "\n";
+					}
+					break;
+				case TYPE_HISTOGRAM:
+					out << "# TYPE " << name << " histogram\n";
+					for (auto &[labels, metric] : family.histograms) {
+						auto buckets = metric->buckets();
+						auto prefix = labels.empty() ? std::string() : labels + ",";
+						uint64_t count = 0;
+						for (size_t i = 0; i < Histogram::BUCKETS; i++) {
+							count += buckets[i];
+							series(name + "_bucket", prefix + "le=\"" + std::to_string(uint64_t(1) << i) + "\"");
+							out << count << "\n";
+						}
+						count += buckets[Histogram::BUCKETS];
+						series(name + "_bucket", prefix + "le=\"+Inf\"");
+						out << count << "\n";
+						series(name + "_sum", labels);
+						out << metric->sum() << "\n";
+						series(name + "_count", labels);
+						out << count << "\n";
+					}
+					break;
+			}
+		}
+		return out.str();
+	}
+
+	Registry &registry() {
+		static Registry instance;
+		return instance;
+	}
+
+	Counter &drops(const std::string &reason) {
+		return registry().counter("lpvpn_drops_total", "Packets dropped, by reason", {{"reason", reason}});
+	}
+
+	Counter &wakeups(const std::string &thread) {
+		return registry().counter("lpvpn_wakeups_total", "Times a worker thread woke up, by thread", {{"thread", thread}});
+	}
+
+	// Exporter
+	Exporter::Exporter(const std::string &path, std::chrono::seconds interval): path(path), interval(interval) {
+		thread = std::thread([this]() {
+			std::unique_lock<std::mutex> lk(mutex);
+			while (running) {
+				cv.wait_for(lk, this->interval);
+				write();
+			}
+		});
+	}
+
+	Exporter::~Exporter() {
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			running = false;
+		}
+		cv.notify_all();
+		thread.join();
+	}
+
+	void Exporter::write() {
+		auto tmp = path + ".tmp";
+		{
+			std::ofstream file(tmp, std::ios_base::trunc);
+			if (!file) {
+				LOG("Failed to open " << tmp);
+				return;
+			}
+			file << registry().render();
+		}
+		if (!file::replace(tmp, path)) {
+			LOG("Failed to write " << path);
+		}
+	}
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace lpvpn::metrics {
+	// Hot counters are sharded into cache line sized slots, each thread adds
+	// to its own slot and readers sum them up, so updates never contend.
+	const size_t SLOTS = 16;
+	size_t threadSlot();
+
+	class Counter {
+		public:
+		void add(uint64_t n = 1) {
+			slots[threadSlot()].value.fetch_add(n, std::memory_order_relaxed);
+		}
+		uint64_t value() const;
+
+		private:
+		struct alignas(64) Slot {
+			std::atomic<uint64_t> value = 0;
+		};
+		std::array<Slot, SLOTS> slots;
+	};
+
+	class Gauge {
+		public:
+		void set(int64_t v) {
+			value_.store(v, std::memory_order_relaxed);
+		}
+		void add(int64_t n) {
+			value_.fetch_add(n, std::memory_order_relaxed);
+		}
+		int64_t value() const {
+			return value_.load(std::memory_order_relaxed);
+		}
+
+		private:
+		std::atomic<int64_t> value_ = 0;
+	};
+
+	// Power of two buckets: bucket i counts observations <= 2^i.
+	class Histogram {
+		public:
+		static const size_t BUCKETS = 24;
+
+		void observe(uint64_t v);
+		std::array<uint64_t, BUCKETS + 1> buckets() const;
+		uint64_t sum() const;
+
+		private:
+		struct alignas(64) Slot {
+			std::array<std::atomic<uint64_t>, BUCKETS + 1> counts = {};
+			std::atomic<uint64_t> sum = 0;
+		};
+		std::array<Slot, SLOTS> slots;
+	};
+
+	using Labels = std::vector<std::pair<std::string, std::string>>;
+
+	// Owns every metric. Lookups lock and are meant for setup or slow paths;
+	// the returned references stay valid for the life of the registry, so the
+	// packet path keeps them around.
+	class Registry {
+		public:
+		Counter &counter(const std::string &name, const std::string &help, const Labels &labels = {});
+		Gauge &gauge(const std::string &name, const std::string &help, const Labels &labels = {});
+		Histogram &histogram(const std::string &name, const std::string &help, const Labels &labels = {});
+
+		// Prometheus text exposition format
+		std::string render();
+
+		private:
+		enum Type {
+			TYPE_COUNTER,
+			TYPE_GAUGE,
+			TYPE_HISTOGRAM,
+		};
+
+		struct Family {
+			Type type;
+			std::string help;
+			std::map<std::string, std::unique_ptr<Counter>> counters;
+			std::map<std::string, std::unique_ptr<Gauge>> gauges;
+			std::map<std::string, std::unique_ptr<Histogram>> histograms;
+		};
+
+		Family &family(const std::string &name, const std::string &help, Type type);
+
+		std::mutex mutex;
+		std::map<std::string, Family> families;
+	};
+
+	Registry &registry();
+
+	// families shared between modules
+	Counter &drops(const std::string &reason);
+	Counter &wakeups(const std::string &thread);
+
+	// Periodically writes the registry to a file, in the layout node_exporter's
+	// textfile collector picks up. The file is replaced atomically.
+	class Exporter {
+		public:
+		Exporter(const std::string &path, std::chrono::seconds interval);
+		~Exporter();
+
+		private:
+		void write();
+
+		std::string path;
+		std::chrono::seconds interval;
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool running = true;
+		std::thread thread;
+	};
+}
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "pool.h"
+#include "metrics.h"
+
+namespace lpvpn::pool {
+	const size_t BLOCK_SIZE = sizeof(Block) + BUFFER_SIZE;
+
+	class Shared {
+		public:
+		// moves up to count free blocks into out, carving a new slab when
+		// the free list runs dry
+		void take(std::vector<Block *> &out, size_t count) {
+			std::lock_guard<std::mutex> lk(mutex);
+			for (size_t i = 0; i < count; i++) {
+				if (free == nullptr) {
+					grow();
+				}
+				auto block = free;
+				free = block->next;
+				out.push_back(block);
+			}
+			outstanding += count;
+			highWater = std::max(highWater, outstanding);
+			outstandingGauge.set(outstanding);
+			highWaterGauge.set(highWater);
+		}
+
+		void give(std::vector<Block *> &blocks, size_t count) {
+			std::lock_guard<std::mutex> lk(mutex);
+			for (size_t i = 0; i < count; i++) {
+				auto block = blocks.back();
+				blocks.pop_back();
+				block->next = free;
+				free = block;
+			}
+			outstanding -= count;
+			outstandingGauge.set(outstanding);
+		}
+
+		Stats stats() {
+			std::lock_guard<std::mutex> lk(mutex);
+			return {slabs.size() * SLAB_BUFFERS, outstanding, highWater};
+		}
+
+		private:
+		void grow() {
+			auto slab = std::make_unique<uint8_t[]>(SLAB_BUFFERS * BLOCK_SIZE);
+			for (size_t i = 0; i < SLAB_BUFFERS; i++) {
+				auto block = new (slab.get() + i * BLOCK_SIZE) Block();
+				block->capacity = BUFFER_SIZE;
+				block->pooled = true;
+				block->next = free;
+				free = block;
+			}
+			slabs.push_back(std::move(slab));
+			allocatedGauge.set(slabs.size() * SLAB_BUFFERS);
+		}
+
+		std::mutex mutex;
+		std::vector<std::unique_ptr<uint8_t[]>> slabs;
+		Block *free = nullptr;
+		size_t outstanding = 0;
+		size_t highWater = 0;
+
+		metrics::Gauge &allocatedGauge = metrics::registry().gauge("lpvpn_pool_buffers", "Packet buffers, by state", {{"state", "allocated"}});
+		metrics::Gauge &outstandingGauge = metrics::registry().gauge("lpvpn_pool_buffers", "Packet buffers, by state", {{"state", "outstanding"}});
+		metrics::Gauge &highWaterGauge = metrics::registry().gauge("lpvpn_pool_buffers_high_water", "Most packet buffers outstanding at once");
+	};
+
+	// never destroyed, buffers may still be let go of during exit
+	static Shared &shared() {
+		static auto instance = new Shared();
+		return *instance;
+	}
+
+	struct Cache {
+		std::vector<Block *> blocks;
+
+		Cache() {
+			// make sure the pool outlives the cache
+			shared();
+			blocks.reserve(CACHE_SIZE + 1);
+		}
+
+		~Cache() {
+			shared().give(blocks, blocks.size());
+		}
+
+		Block *take() {
+			if (blocks.empty()) {
+				shared().take(blocks, CACHE_SIZE / 2);
+			}
+			auto block = blocks.back();
+			blocks.pop_back();
+			return block;
+		}
+
+		void give(Block *block) {
+			blocks.push_back(block);
+			if (blocks.size() > CACHE_SIZE) {
+				shared().give(blocks, CACHE_SIZE / 2);
+			}
+		}
+	};
+
+	static Cache &cache() {
+		thread_local Cache instance;
+		return instance;
+	}
+
+	// Buffer
+	Buffer::Buffer(Block *block): block(block) {}
+
+	Buffer::Buffer(const Buffer &other): block(other.block) {
+		if (block != nullptr) {
+			block->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	Buffer::Buffer(Buffer &&other) noexcept: block(other.block) {
+		other.block = nullptr;
+	}
+
+	Buffer &Buffer::operator=(Buffer other) noexcept {
+		std::swap(block, other.block);
+		return *this;
+	}
+
+	Buffer::~Buffer() {
+		if (block == nullptr || block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+			return;
+		}
+		if (block->pooled) {
+			cache().give(block);
+		} else {
+			block->~Block();
+			::operator delete(block);
+		}
+	}
+
+	Buffer Buffer::copy(std::span<const uint8_t> data) {
+		Block *block;
+		if (data.size() <= BUFFER_SIZE) {
+			block = cache().take();
+		} else {
+			// jumbo packets are rare, don't make every buffer pay for them
+			auto capacity = data.size();
+			block = new (::operator new(sizeof(Block) + capacity)) Block();
+			block->capacity = static_cast<uint32_t>(capacity);
+			block->pooled = false;
+		}
+		block->refs.store(1, std::memory_order_relaxed);
+		block->size = static_cast<uint32_t>(data.size());
+		std::copy(data.begin(), data.end(), block->bytes());
+		return Buffer(block);
+	}
+
+	Stats stats() {
+		return shared().stats();
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace lpvpn::pool {
+	// Packet buffers are carved out of slabs of SLAB_BUFFERS and recycled
+	// through per-thread caches, so taking or returning one only touches the
+	// shared free list once every CACHE_SIZE / 2 operations. Slabs are never
+	// given back, the pool keeps its high-water mark.
+	const size_t BUFFER_SIZE = 2048;
+	const size_t SLAB_BUFFERS = 64;
+	const size_t CACHE_SIZE = 64;
+
+	struct Block {
+		std::atomic<uint32_t> refs;
+		uint32_t capacity;
+		uint32_t size;
+		// false for one-off blocks too big for the pool
+		bool pooled;
+		Block *next;
+
+		uint8_t *bytes() {
+			return reinterpret_cast<uint8_t *>(this + 1);
+		}
+	};
+
+	// Refcounted handle to a pooled buffer. Copies share the buffer and the
+	// last handle to go returns it, so one packet can sit in many queues.
+	// Only change the contents while the handle is unique.
+	class Buffer {
+		public:
+		Buffer() = default;
+		Buffer(const Buffer &other);
+		Buffer(Buffer &&other) noexcept;
+		Buffer &operator=(Buffer other) noexcept;
+		~Buffer();
+
+		// a buffer holding a copy of data
+		static Buffer copy(std::span<const uint8_t> data);
+
+		explicit operator bool() const {
+			return block != nullptr;
+		}
+		uint8_t *data() const {
+			return block->bytes();
+		}
+		size_t size() const {
+			return block->size;
+		}
+		std::span<uint8_t> span() const {
+			return std::span<uint8_t>(data(), size());
+		}
+		bool unique() const {
+			return block->refs.load(std::memory_order_acquire) == 1;
+		}
+		private:
+		Buffer(Block *block);
+
+		Block *block = nullptr;
+	};
+
+	struct Stats {
+		// buffers carved out of slabs so far
+		size_t allocated;
+		// buffers taken from the shared free list, in use or sitting in a
+		// thread cache
+		size_t outstanding;
+		size_t highWater;
+	};
+
+	Stats stats();
+}
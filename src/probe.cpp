@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+#include "probe.h"
+#include "frame.h"
+
+// weights of a new sample in the moving averages
+#define RTT_GAIN 8
+#define JITTER_GAIN 16
+#define LOSS_GAIN 16
+
+namespace lpvpn::probe {
+	using frame::readU32;
+	using frame::writeU32;
+
+	static size_t bucketOf(uint64_t value) {
+		// below 2 * SUB_BUCKETS every value has its own bucket
+		auto width = static_cast<size_t>(std::bit_width(value));
+		if (width <= 5) {
+			return static_cast<size_t>(value);
+		}
+		auto exponent = width - 5;
+		if (exponent >= Histogram::MAX_EXPONENT) {
+			return Histogram::BUCKETS - 1;
+		}
+		return (exponent + 1) * Histogram::SUB_BUCKETS + static_cast<size_t>((value >> exponent) - Histogram::SUB_BUCKETS);
+	}
+
+	// largest value that lands in bucket
+	static uint64_t valueOf(size_t bucket) {
+		if (bucket < 2 * Histogram::SUB_BUCKETS) {
+			return bucket;
+		}
+		auto exponent = bucket / Histogram::SUB_BUCKETS - 1;
+		auto mantissa = bucket % Histogram::SUB_BUCKETS + Histogram::SUB_BUCKETS;
+		return ((mantissa + 1) << exponent) - 1;
+	}
+
+	void Histogram::record(uint64_t value) {
+		counts[bucketOf(value)]++;
+		if (++total < HISTORY) {
+			return;
+		}
+		total = 0;
+		for (auto &count : counts) {
+			count /= 2;
+			total += count;
+		}
+	}
+
+	uint64_t Histogram::percentile(double q) const {
+		if (total == 0) {
+			return 0;
+		}
+		auto target = static_cast<uint64_t>(q * total + 0.5);
+		uint64_t seen = 0;
+		for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+			seen += counts[bucket];
+			if (seen >= std::max<uint64_t>(target, 1)) {
+				return valueOf(bucket);
+			}
+		}
+		return valueOf(BUCKETS - 1);
+	}
+
+	bool isRequest(std::span<const uint8_t> message) {
+		return message.size() == MESSAGE_SIZE && message[0] == PROBE_REQUEST;
+	}
+
+	void makeReply(std::span<uint8_t> message) {
+		message[0] = PROBE_REPLY;
+	}
+
+	Prober::Prober() {}
+	Prober::~Prober() {}
+
+	bool Prober::active(uint64_t peer, uint64_t packets) {
+		std::lock_guard<std::mutex> lk(mutex);
+		auto &p = peers[peer];
+		return std::exchange(p.packets, packets) != packets;
+	}
+
+	void Prober::request(uint64_t peer, Clock::time_point now, std::vector<uint8_t> &out) {
+		std::lock_guard<std::mutex> lk(mutex);
+		auto &p = peers[peer];
+		for (auto &o : p.outstanding) {
+			if (o.pending && now - o.sent >= TIMEOUT) {
+				lost(p);
+				o.pending = false;
+			}
+		}
+		auto seq = p.seq++;
+		auto &o = p.outstanding[seq % OUTSTANDING];
+		if (o.pending) {
+			lost(p);
+		}
+		o = {true, seq, now};
+
+		auto micros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count());
+		out.resize(MESSAGE_SIZE);
+		out[0] = PROBE_REQUEST;
+		writeU32(out.data() + 1, seq);
+		writeU32(out.data() + 5, static_cast<uint32_t>(micros >> 32));
+		writeU32(out.data() + 9, static_cast<uint32_t>(micros));
+	}
+
+	std::optional<std::chrono::microseconds> Prober::reply(uint64_t peer, std::span<const uint8_t> message, Clock::time_point now) {
+		if (message.size() != MESSAGE_SIZE || message[0] != PROBE_REPLY) {
+			return std::nullopt;
+		}
+		auto seq = readU32(message.data() + 1);
+		auto sent = (uint64_t(readU32(message.data() + 5)) << 32) | readU32(message.data() + 9);
+
+		std::lock_guard<std::mutex> lk(mutex);
+		auto it = peers.find(peer);
+		if (it == peers.end()) {
+			return std::nullopt;
+		}
+		auto &p = it->second;
+		// late, duplicated or not ours
+		auto &o = p.outstanding[seq % OUTSTANDING];
+		auto micros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(o.sent.time_since_epoch()).count());
+		if (!o.pending || o.seq != seq || micros != sent) {
+			return std::nullopt;
+		}
+		o.pending = false;
+
+		auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(now - o.sent);
+		auto &s = p.stats;
+		if (s.samples == 0) {
+			s.rtt = rtt;
+		} else {
+			s.rtt += (rtt - s.rtt) / RTT_GAIN;
+			auto delta = rtt > p.last ? rtt - p.last : p.last - rtt;
+			s.jitter += (delta - s.jitter) / JITTER_GAIN;
+		}
+		p.last = rtt;
+		s.samples++;
+		s.loss -= s.loss / LOSS_GAIN;
+		p.histogram.record(static_cast<uint64_t>(rtt.count()));
+		s.p50 = std::chrono::microseconds(p.histogram.percentile(0.5));
+		s.p99 = std::chrono::microseconds(p.histogram.percentile(0.99));
+		return rtt;
+	}
+
+	Stats Prober::stats(uint64_t peer) {
+		std::lock_guard<std::mutex> lk(mutex);
+		auto it = peers.find(peer);
+		return it == peers.end() ? Stats{} : it->second.stats;
+	}
+
+	void Prober::lost(Peer &peer) {
+		peer.stats.loss += (1 - peer.stats.loss) / LOSS_GAIN;
+	}
+}
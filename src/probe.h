@@ -0,0 +1,107 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace lpvpn::probe {
+	// Round trip probes on their own Steam channel. A probe is a type byte,
+	// u32 sequence number and u64 send time in microseconds; the peer sends
+	// it straight back as a reply, so it keeps no state and needs no clock
+	// in common with us. Only peers that exchanged packets since the last
+	// round are probed, idle ones cost nothing.
+	const int CHANNEL = 1;
+	const auto INTERVAL = std::chrono::seconds(1);
+	// a probe not answered by then counts as lost
+	const auto TIMEOUT = std::chrono::seconds(2);
+	const size_t MESSAGE_SIZE = 13;
+
+	enum Type {
+		PROBE_REQUEST = 0x01,
+		PROBE_REPLY = 0x02,
+	};
+
+	// Log-linear histogram in the style of HdrHistogram: every power of two
+	// is split into SUB_BUCKETS, so values keep about 6% precision from a
+	// microsecond to several minutes in a few hundred counters. Counts are
+	// halved once there are HISTORY of them, so percentiles follow recent
+	// samples.
+	class Histogram {
+		public:
+		static const size_t SUB_BUCKETS = 16;
+		static const size_t MAX_EXPONENT = 26;
+		static const size_t BUCKETS = (MAX_EXPONENT + 1) * SUB_BUCKETS;
+		static const uint32_t HISTORY = 1024;
+
+		void record(uint64_t value);
+		// smallest value at least q of the samples are below, 0 if empty
+		uint64_t percentile(double q) const;
+
+		private:
+		std::array<uint32_t, BUCKETS> counts = {};
+		uint32_t total = 0;
+	};
+
+	struct Stats {
+		// smoothed as in TCP, 0 until the first reply
+		std::chrono::microseconds rtt = std::chrono::microseconds(0);
+		// mean difference between consecutive samples, as in RFC 3550
+		std::chrono::microseconds jitter = std::chrono::microseconds(0);
+		std::chrono::microseconds p50 = std::chrono::microseconds(0);
+		std::chrono::microseconds p99 = std::chrono::microseconds(0);
+		// moving share of probes that went unanswered
+		double loss = 0;
+		uint64_t samples = 0;
+
+		bool operator==(const Stats &) const = default;
+	};
+
+	bool isRequest(std::span<const uint8_t> message);
+	// the reply to a request, in place
+	void makeReply(std::span<uint8_t> message);
+
+	class Prober {
+		public:
+		using Clock = std::chrono::steady_clock;
+
+		Prober();
+		~Prober();
+
+		// true if peer has exchanged packets since the last call, given
+		// the number of packets exchanged with it so far
+		bool active(uint64_t peer, uint64_t packets);
+		// fills out with a probe for peer, expiring unanswered ones
+		void request(uint64_t peer, Clock::time_point now, std::vector<uint8_t> &out);
+		// takes a reply from peer, returns the round trip it measured
+		std::optional<std::chrono::microseconds> reply(uint64_t peer, std::span<const uint8_t> message, Clock::time_point now);
+		Stats stats(uint64_t peer);
+
+		private:
+		// enough for TIMEOUT worth of probes
+		static const size_t OUTSTANDING = 4;
+
+		struct Outstanding {
+			bool pending = false;
+			uint32_t seq = 0;
+			Clock::time_point sent;
+		};
+
+		struct Peer {
+			uint64_t packets = 0;
+			uint32_t seq = 0;
+			std::array<Outstanding, OUTSTANDING> outstanding;
+			Stats stats;
+			std::chrono::microseconds last = std::chrono::microseconds(0);
+			Histogram histogram;
+		};
+
+		void lost(Peer &peer);
+
+		std::mutex mutex;
+		std::map<uint64_t, Peer> peers;
+	};
+}
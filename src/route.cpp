@@ -0,0 +1,241 @@
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "route.h"
+
+namespace lpvpn::route {
+	static size_t hashAddr(Address4 addr) {
+		return static_cast<size_t>(addr.toUint32() * 0x9E3779B97F4A7C15ull >> 32);
+	}
+
+	static size_t hashSteamID(uint64_t steamID) {
+		steamID ^= steamID >> 33;
+		steamID *= 0xFF51AFD7ED558CCDull;
+		steamID ^= steamID >> 33;
+		return static_cast<size_t>(steamID);
+	}
+
+	// Two open addressing indices (linear probing) into a flat peer list.
+	// Capacity is kept at least twice the peer count so probes stay short.
+	struct PeerTable::Snapshot {
+		static constexpr uint32_t EMPTY = UINT32_MAX;
+
+		std::vector<Peer> peers;
+		std::vector<uint32_t> byAddr;
+		std::vector<uint32_t> bySteamID;
+		size_t mask = 0;
+
+		Snapshot(std::vector<Peer> list): peers(std::move(list)) {
+			size_t capacity = 8;
+			while (capacity < peers.size() * 2) {
+				capacity *= 2;
+			}
+			mask = capacity - 1;
+			byAddr.assign(capacity, EMPTY);
+			bySteamID.assign(capacity, EMPTY);
+			for (uint32_t i = 0; i < peers.size(); i++) {
+				insert(byAddr, hashAddr(peers[i].addr), i);
+				insert(bySteamID, hashSteamID(peers[i].steamID), i);
+			}
+		}
+
+		void insert(std::vector<uint32_t> &index, size_t hash, uint32_t value) {
+			auto pos = hash & mask;
+			while (index[pos] != EMPTY) {
+				pos = (pos + 1) & mask;
+			}
+			index[pos] = value;
+		}
+
+		const Peer *find(Address4 addr) const {
+			for (auto pos = hashAddr(addr) & mask; byAddr[pos] != EMPTY; pos = (pos + 1) & mask) {
+				auto &peer = peers[byAddr[pos]];
+				if (peer.addr == addr) {
+					return &peer;
+				}
+			}
+			return nullptr;
+		}
+
+		const Peer *find(uint64_t steamID) const {
+			for (auto pos = hashSteamID(steamID) & mask; bySteamID[pos] != EMPTY; pos = (pos + 1) & mask) {
+				auto &peer = peers[bySteamID[pos]];
+				if (peer.steamID == steamID) {
+					return &peer;
+				}
+			}
+			return nullptr;
+		}
+	};
+
+	// use IP in the CGNAT range
+	// https://en.wikipedia.org/wiki/Carrier-grade_NAT
+	static const Subnet4 ADDRESS_RANGE = Subnet4({100, 64, 0, 0}, 10);
+	// network and broadcast addresses are left out
+	static const uint32_t USABLE_ADDRESSES = ADDRESS_RANGE.size() - 2;
+
+	// AddressAllocator
+	Address4 AddressAllocator::compute(uint64_t steamID, uint32_t offset) {
+		auto range = ADDRESS_RANGE;
+		auto size = range.size();
+		auto mod = (steamID + offset) % size;
+		if (mod == 0) {
+			mod = 1;
+		} else if (mod == size - 1) {
+			mod = size - 2;
+		}
+		auto canonicalAddr = range.start().toUint32() + mod;
+		return Address4(canonicalAddr);
+	}
+
+	uint32_t AddressAllocator::home(uint64_t steamID) {
+		return compute(steamID).toUint32() - ADDRESS_RANGE.start().toUint32() - 1;
+	}
+
+	void AddressAllocator::place(uint32_t index, uint64_t steamID) {
+		slots[index] = {steamID, false};
+		steamIDToAddr[steamID] = Address4(ADDRESS_RANGE.start().toUint32() + 1 + index);
+	}
+
+	Address4 AddressAllocator::assign(uint64_t steamID) {
+		assignAll({steamID});
+		return steamIDToAddr[steamID];
+	}
+
+	void AddressAllocator::assignAll(const std::vector<uint64_t> &steamIDs) {
+		std::vector<uint32_t> placed;
+		for (auto steamID : steamIDs) {
+			if (steamIDToAddr.contains(steamID)) {
+				continue;
+			}
+			if (slots.size() >= USABLE_ADDRESSES) {
+				throw std::runtime_error("no available address");
+			}
+			auto index = home(steamID);
+			auto current = steamID;
+			uint32_t distance = 0;
+			while (true) {
+				auto occupant = slots.find(index);
+				if (occupant == slots.end()) {
+					place(index, current);
+					placed.push_back(index);
+					break;
+				}
+				// only this batch's own placements can be swapped
+				auto other = occupant->second;
+				uint32_t otherDistance = (index + USABLE_ADDRESSES - home(other.steamID)) % USABLE_ADDRESSES;
+				if (!other.fixed && (otherDistance < distance || (otherDistance == distance && current < other.steamID))) {
+					place(index, current);
+					current = other.steamID;
+					distance = otherDistance;
+				}
+				index = (index + 1) % USABLE_ADDRESSES;
+				distance++;
+			}
+		}
+		// swapped IDs keep their first slot's index in placed, the set of
+		// indices is the same
+		for (auto index : placed) {
+			slots[index].fixed = true;
+		}
+	}
+
+	bool AddressAllocator::restore(uint64_t steamID, Address4 addr) {
+		if (steamIDToAddr.contains(steamID)) {
+			return false;
+		}
+		// wraps around for addresses below the range
+		auto offset = addr.toUint32() - ADDRESS_RANGE.start().toUint32();
+		if (offset == 0 || offset > USABLE_ADDRESSES) {
+			return false;
+		}
+		auto index = offset - 1;
+		if (slots.contains(index)) {
+			return false;
+		}
+		place(index, steamID);
+		slots[index].fixed = true;
+		return true;
+	}
+
+	std::optional<Address4> AddressAllocator::find(uint64_t steamID) const {
+		auto it = steamIDToAddr.find(steamID);
+		if (it == steamIDToAddr.end()) {
+			return std::nullopt;
+		}
+		return it->second;
+	}
+
+	const std::unordered_map<uint64_t, Address4> &AddressAllocator::assignments() const {
+		return steamIDToAddr;
+	}
+
+	size_t AddressAllocator::displaced() const {
+		size_t total = 0;
+		for (auto &[index, slot] : slots) {
+			total += (index + USABLE_ADDRESSES - home(slot.steamID)) % USABLE_ADDRESSES;
+		}
+		return total;
+	}
+
+	size_t AddressAllocator::memoryUsage() const {
+		// node based maps: one allocation per entry plus the bucket arrays
+		const size_t NODE_OVERHEAD = 2 * sizeof(void *);
+		return slots.bucket_count() * sizeof(void *) + slots.size() * (sizeof(std::pair<uint32_t, Slot>) + NODE_OVERHEAD) +
+			steamIDToAddr.bucket_count() * sizeof(void *) + steamIDToAddr.size() * (sizeof(std::pair<uint64_t, Address4>) + NODE_OVERHEAD);
+	}
+
+	// Reader
+	PeerTable::Reader::Reader(PeerTable &table): table(table) {
+		// register on the current epoch's counter before loading the pointer,
+		// so publish() either sees us or we see its new snapshot
+		slot = table.epoch.load() & 1;
+		table.readers[slot].count.fetch_add(1);
+		snapshot = table.current.load();
+	}
+
+	PeerTable::Reader::~Reader() {
+		table.readers[slot].count.fetch_sub(1);
+	}
+
+	const Peer *PeerTable::Reader::find(Address4 addr) const {
+		return snapshot->find(addr);
+	}
+
+	const Peer *PeerTable::Reader::find(uint64_t steamID) const {
+		return snapshot->find(steamID);
+	}
+
+	const std::vector<Peer> &PeerTable::Reader::peers() const {
+		return snapshot->peers;
+	}
+
+	// PeerTable
+	PeerTable::PeerTable(): current(new Snapshot({})) {}
+
+	PeerTable::~PeerTable() {
+		delete current.load();
+	}
+
+	PeerTable::Reader PeerTable::read() {
+		return Reader(*this);
+	}
+
+	void PeerTable::publish(std::vector<Peer> peers) {
+		auto next = new Snapshot(std::move(peers));
+
+		std::lock_guard<std::mutex> lk(publishMutex);
+		auto prev = current.exchange(next);
+		// flip the epoch twice so both counters are drained once with new
+		// readers steered to the other one; after that nobody can still
+		// hold prev
+		for (size_t i = 0; i < 2; i++) {
+			auto drained = epoch.fetch_add(1) & 1;
+			while (readers[drained].count.load() != 0) {
+				std::this_thread::yield();
+			}
+		}
+		delete prev;
+	}
+}
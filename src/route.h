@@ -0,0 +1,110 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "ip.h"
+
+namespace lpvpn::route {
+	using namespace lpvpn::ip;
+
+	struct Peer {
+		uint64_t steamID;
+		Address4 addr;
+		std::shared_ptr<void> userData = nullptr;
+	};
+
+	// Hands out addresses in the CGNAT range derived from Steam IDs, so a
+	// peer usually keeps its address across sessions. Every ID has a home
+	// address (compute() at offset 0) and collisions probe forward. Once
+	// handed out an address never changes, sessions to it would break:
+	// a batch given to assignAll() is laid out with Robin Hood probing
+	// (whoever is further from home keeps the address, ties go to the
+	// smaller Steam ID) among itself only, stepping around everyone
+	// placed before. Addresses are this node's view, packets are rewritten
+	// on the way in, so nodes don't have to agree. Only fails once the
+	// range is full. Not thread safe.
+	class AddressAllocator {
+		public:
+		static Address4 compute(uint64_t steamID, uint32_t offset = 0);
+
+		Address4 assign(uint64_t steamID);
+		// places every ID not assigned yet, see above
+		void assignAll(const std::vector<uint64_t> &steamIDs);
+		// puts steamID back on an address it had before, false if that is
+		// taken or steamID already has one
+		bool restore(uint64_t steamID, Address4 addr);
+		std::optional<Address4> find(uint64_t steamID) const;
+		const std::unordered_map<uint64_t, Address4> &assignments() const;
+		// how far IDs ended up from home, 0 when nothing collided
+		size_t displaced() const;
+		size_t memoryUsage() const;
+
+		private:
+		struct Slot {
+			uint64_t steamID;
+			// handed out by an earlier call, never moves again
+			bool fixed;
+		};
+
+		static uint32_t home(uint64_t steamID);
+		void place(uint32_t index, uint64_t steamID);
+
+		// occupied addresses by index into the usable part of the range,
+		// the range is far too big to keep as a flat table
+		std::unordered_map<uint32_t, Slot> slots;
+		std::unordered_map<uint64_t, Address4> steamIDToAddr;
+	};
+
+	// Read-mostly peer table for the packet path. Lookups never lock or
+	// allocate: writers build a new immutable snapshot, publish it with an
+	// atomic pointer swap and free the old one once its readers have left
+	// (RCU style). Publishing may wait for readers, reading never waits.
+	class PeerTable {
+		struct Snapshot;
+
+		public:
+		// Keeps the snapshot it was created on alive, pointers returned by
+		// find() are valid until the Reader is destroyed.
+		class Reader {
+			public:
+			Reader(const Reader &) = delete;
+			Reader &operator=(const Reader &) = delete;
+			~Reader();
+
+			const Peer *find(Address4 addr) const;
+			const Peer *find(uint64_t steamID) const;
+			const std::vector<Peer> &peers() const;
+
+			private:
+			friend class PeerTable;
+			Reader(PeerTable &table);
+
+			PeerTable &table;
+			size_t slot;
+			const Snapshot *snapshot;
+		};
+
+		PeerTable();
+		~PeerTable();
+
+		Reader read();
+		void publish(std::vector<Peer> peers);
+
+		private:
+		struct alignas(64) ReaderCount {
+			std::atomic<uint32_t> count = 0;
+		};
+
+		std::atomic<const Snapshot *> current;
+		std::atomic<size_t> epoch = 0;
+		ReaderCount readers[2];
+		std::mutex publishMutex;
+	};
+}
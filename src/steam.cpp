@@ -3,103 +3,253 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <set>
+#include <array>
 
 #include "steam.h"
+#include "route.h"
+#include "igmp.h"
+#include "frame.h"
+#include "batch.h"
+#include "burst.h"
+#include "compress.h"
+#include "dispatch.h"
+#include "metrics.h"
+#include "pool.h"
+#include "cache.h"
+#include "frag.h"
+#include "fec.h"
+#include "probe.h"
+#include "storm.h"
+#include "transport.h"
 #include "log.h"
+#ifdef __linux__
+#include "udp.h"
+#endif
 
 #define MAX_BROADCAST 16
 #define FREE_EVERY 1000
+#define RECEIVE_BATCH 64
+#define PROBE_BATCH 16
+// transport offers, always over Steam: it is what vouches for the sender
+#define SIGNAL_CHANNEL 2
+#define SIGNAL_BATCH 16
+// EResults below this get their send failure counter cached
+#define SEND_RESULTS 128
 
 const auto LOOP_INTERVAL = std::chrono::milliseconds(10);
+const auto MIN_IDLE_WAIT = std::chrono::microseconds(100);
 const auto FRIEND_REFRESH_INTERVAL = std::chrono::seconds(10);
+// persona changes arrive in storms (a friend launching a game fires
+// several), wait this long to handle them in one go
+const auto PERSONA_DEBOUNCE = std::chrono::milliseconds(250);
+// IPv4 allows hosts to assume 576 byte datagrams get through
+const size_t MIN_TUNNEL_MTU = 576;
+// IPv4 and TCP headers without options, taken off the tunnel MTU for the MSS
+const size_t TCP_IP_HEADERS = 40;
+// a peer without a direct path gets our offers at most this often
+const auto OFFER_INTERVAL = std::chrono::seconds(5);
 
 namespace lpvpn::steam {
+	// set while write() runs, transports may then hold sends back until
+	// the thread's burst ends with flush()
+	static thread_local bool deferring = false;
+
 	Steam::Steam() {
 		if (!SteamAPI_Init()) {
 			throw std::runtime_error("SteamAPI_Init failed, is Steam running?");
 		}
-		running = true;
+		// Steam has no handle to wait on for callbacks, so they are pumped
+		auto callbacks = _loop.addTimer([]() {
+			SteamAPI_RunCallbacks();
+		});
+		_loop.arm(callbacks, LOOP_INTERVAL, LOOP_INTERVAL);
 		thread = std::thread([this]() {
-			LOG("Steam callback thread started");
-			while (this->running) {
-				SteamAPI_RunCallbacks();
-				std::this_thread::sleep_for(LOOP_INTERVAL);
-			}
+			LOG("Steam event loop started");
+			_loop.run();
 		});
 	}
 
 	Steam::~Steam() {
-		running = false;
+		_loop.stop();
 		thread.join();
 		SteamAPI_Shutdown();
 	}
 
+	event::Loop &Steam::loop() {
+		return _loop;
+	}
+
+	// packet path counters for one peer, hung off route::Peer::userData.
+	// The counters themselves belong to the registry, so a copy stays valid
+	// after the snapshot it came from is gone.
+	struct PeerMetrics {
+		metrics::Counter &rxPackets;
+		metrics::Counter &rxBytes;
+		metrics::Counter &txPackets;
+		metrics::Counter &txBytes;
+		metrics::Gauge &pendingBytes;
+		metrics::Gauge &fecParity;
+		metrics::Histogram &rtt;
+		metrics::Gauge &smoothedRTT;
+		metrics::Gauge &jitter;
+		metrics::Counter &probesSent;
+		metrics::Counter &probesAnswered;
+
+		PeerMetrics(uint64_t steamID):
+			rxPackets(packets(steamID, "rx")), rxBytes(bytes(steamID, "rx")),
+			txPackets(packets(steamID, "tx")), txBytes(bytes(steamID, "tx")),
+			pendingBytes(metrics::registry().gauge("lpvpn_peer_pending_bytes", "Unreliable bytes queued in Steam, by peer", {{"peer", std::to_string(steamID)}})),
+			fecParity(metrics::registry().gauge("lpvpn_peer_fec_parity", "Parity frames per FEC group, by peer", {{"peer", std::to_string(steamID)}})),
+			rtt(metrics::registry().histogram("lpvpn_peer_rtt_microseconds", "Probe round trips, by peer", {{"peer", std::to_string(steamID)}})),
+			smoothedRTT(metrics::registry().gauge("lpvpn_peer_srtt_microseconds", "Smoothed probe round trip, by peer", {{"peer", std::to_string(steamID)}})),
+			jitter(metrics::registry().gauge("lpvpn_peer_jitter_microseconds", "Probe round trip jitter, by peer", {{"peer", std::to_string(steamID)}})),
+			probesSent(probes(steamID, "sent")), probesAnswered(probes(steamID, "answered")) {}
+
+		static PeerMetrics &of(const route::Peer &peer) {
+			return *static_cast<PeerMetrics *>(peer.userData.get());
+		}
+
+		void rx(size_t size) {
+			rxPackets.add();
+			rxBytes.add(size);
+		}
+
+		void tx(size_t size) {
+			txPackets.add();
+			txBytes.add(size);
+		}
+
+		private:
+		static metrics::Counter &packets(uint64_t steamID, const char *direction) {
+			return metrics::registry().counter("lpvpn_peer_packets_total", "Packets exchanged, by peer and direction", {{"peer", std::to_string(steamID)}, {"direction", direction}});
+		}
+
+		static metrics::Counter &probes(uint64_t steamID, const char *result) {
+			return metrics::registry().counter("lpvpn_peer_probes_total", "Round trip probes, by peer and result", {{"peer", std::to_string(steamID)}, {"result", result}});
+		}
+
+		static metrics::Counter &bytes(uint64_t steamID, const char *direction) {
+			return metrics::registry().counter("lpvpn_peer_bytes_total", "IP bytes exchanged, by peer and direction", {{"peer", std::to_string(steamID)}, {"direction", direction}});
+		}
+	};
+
 	class SteamNet::Impl {
 		public:
-		Impl(std::shared_ptr<Steam> steam): steam(steam) {
+		Impl(std::shared_ptr<Steam> steam, const Options &options): steam(steam), options(options),
+			limiter({options.broadcastRate, options.broadcastBurst, options.broadcastDedup}) {
+			if (options.tunnelMTU != 0 && options.tunnelMTU < MIN_TUNNEL_MTU) {
+				throw std::runtime_error("Tunnel MTU must be at least " + std::to_string(MIN_TUNNEL_MTU));
+			}
+			if (options.fec) {
+				LOG("Forward error correction on, using the " << fec::gf::kernel() << " kernel");
+			}
+			if (options.batchLatency.count() > 0) {
+				auto mtu = options.tunnelMTU != 0 ? std::min(options.mtu, options.tunnelMTU) : options.mtu;
+				batcher = std::make_unique<batch::Batcher>(options.batchLatency, mtu, [this](uint64_t steamID, std::span<const uint8_t> message) {
+					send(steamID, message);
+				});
+			}
+
 			appID = SteamUtils()->GetAppID();
 
 			localSteamID = SteamUser()->GetSteamID();
-			_localAddr = assignAddr(localSteamID);
+			// our own address is on the TUN device, friends can't bump it
+			_localAddr = addrs.assign(localSteamID.ConvertToUint64());
+			receiver = std::make_unique<dispatch::Receiver>(peers, snooper, _localAddr, options.tunnelMTU != 0 ? mss() : 0);
+			receiver->onData([this](const route::Peer &peer, Packet &packet) {
+				PeerMetrics::of(peer).rx(packet.packet.size());
+				onDataCb(packet);
+			});
 
-			refreshEndpoints();
+			auto &loop = steam->loop();
+			updateTimer = loop.addTimer([this]() {
+				bool sweep;
+				{
+					std::lock_guard<std::mutex> lk(refreshMutex);
+					sweep = std::exchange(sweepPending, false);
+				}
+				updateEndpoints(sweep);
+			});
+			if (!loadCache()) {
+				updateEndpoints(true);
+			}
 			SteamNetworkingUtils()->InitRelayNetworkAccess();
 
-			thread = std::thread([this]() {
-				while (this->running) {
-					SteamNetworkingMessage_t *msg = nullptr;
-					auto count = SteamNetworkingMessages()->ReceiveMessagesOnChannel(0, &msg, 1);
-					if (count != 1) {
-						std::this_thread::sleep_for(LOOP_INTERVAL);
-						continue;
-					}
-					auto steamID = msg->m_identityPeer.GetSteamID();
-					auto size = msg->GetSize();
-					std::vector<uint8_t> data(size);
-					memcpy(data.data(), msg->m_pData, size);
-					msg->Release();
-
-					readPacketCount++;
-					if (readPacketCount % FREE_EVERY == 0) {
-						SteamAPI_ReleaseCurrentThreadMemory();
-					}
-
-					if (!steamIDToAddr.contains(steamID)) {
-						continue;
-					}
-					Address4 addr;
-					{
-						std::lock_guard<std::mutex> lk(refreshMutex);
-						addr = steamIDToAddr[steamID];
-					}
-					auto packet = Packet(data);
-					if (packet.version() != 4) {
-						continue;
-					}
-					packet.toPacket4().setSrcAddr(addr);
-					packet.toPacket4().setDstAddr(_localAddr);
-					onDataCb(packet);
+			pollTimer = loop.addTimer([this]() {
+				poll();
+			});
+			kickTimer = loop.addTimer([this]() {
+				backoff.reset();
+				poll();
+			});
+			tickTimer = loop.addTimer([this]() {
+				if (receiverIdle) {
+					poll();
+				}
+				if (this->options.fec) {
+					flushParity();
 				}
 			});
+			loop.arm(tickTimer, LOOP_INTERVAL, LOOP_INTERVAL);
+			probeTimer = loop.addTimer([this]() {
+				probe();
+			});
+			loop.arm(probeTimer, probe::INTERVAL, probe::INTERVAL);
+			refreshTimer = loop.addTimer([this]() {
+				SteamAPI_ReleaseCurrentThreadMemory();
+				// persona events don't cover friends being added or removed
+				updateEndpoints(true);
+				sampleQueues();
+				saveCache();
+			});
+			loop.arm(refreshTimer, FRIEND_REFRESH_INTERVAL, FRIEND_REFRESH_INTERVAL);
+			queryTimer = loop.addTimer([this]() {
+				query();
+			});
+			// the first query comes early, as RFC 3376's startup queries do
+			loop.arm(queryTimer, igmp::QUERY_INTERVAL / 4, igmp::QUERY_INTERVAL);
 
-			refreshThread = std::thread([this]() {
-				auto elapsed = std::chrono::milliseconds(0);
-				while (this->running) {
-					if (elapsed >= FRIEND_REFRESH_INTERVAL) {
-						SteamAPI_ReleaseCurrentThreadMemory();
-						refreshEndpoints();
-						elapsed = std::chrono::milliseconds(0);
-					}
-					std::this_thread::sleep_for(LOOP_INTERVAL);
-					elapsed += LOOP_INTERVAL;
+			if (options.udp) {
+#ifdef __linux__
+				udp::Transport::Options udpOptions;
+				udpOptions.port = options.udpPort;
+				udpOptions.advertise = options.udpAdvertise;
+				udpOptions.exclude.push_back(localAddr());
+				try {
+					auto direct = std::make_unique<udp::Transport>(loop, udpOptions);
+					LOG("Direct UDP on port " << direct->port());
+					transports.push_back(std::move(direct));
+				} catch (const std::system_error &e) {
+					LOG("Direct UDP unavailable, using Steam only: " << e.what());
 				}
-			});
+#else
+				LOG("Direct UDP isn't supported on this platform, using Steam only");
+#endif
+			}
+			for (auto &transport : transports) {
+				transport->onReceive([this](uint64_t steamID, int channel, std::span<uint8_t> message) {
+					receiveDirect(steamID, channel, message);
+				});
+				transport->onFlush([this]() {
+					if (onFlushCb != nullptr) {
+						onFlushCb();
+					}
+				});
+			}
 		}
 
 		~Impl() {
-			running = false;
-			thread.join();
-			refreshThread.join();
+			auto &loop = steam->loop();
+			for (auto timer : {pollTimer, kickTimer, tickTimer, probeTimer, refreshTimer, queryTimer, updateTimer}) {
+				loop.removeTimer(timer);
+			}
+			// the batcher sends through the transports
+			batcher.reset();
+			transports.clear();
+			saveCache();
 
 			LOG("SteamNet::Impl destroyed");
 		}
@@ -109,54 +259,93 @@ namespace lpvpn::steam {
 		}
 
 		void write(Packet &packet) {
+			struct Deferral {
+				Deferral() { deferring = true; }
+				~Deferral() { deferring = false; }
+			} deferral;
 			if (packet.version() != 4) {
+				dropNotIPv4.add();
 				return;
 			}
-			auto addr = packet.toPacket4().dstAddr();
+			// most traffic is request / response, so an outgoing packet is a good
+			// hint that the receiver should start polling quickly again
+			if (receiverIdle.load(std::memory_order_relaxed) && receiverIdle.exchange(false)) {
+				steam->loop().arm(kickTimer, std::chrono::microseconds(0));
+			}
+			auto packet4 = packet.toPacket4();
+			if (options.tunnelMTU != 0) {
+				packet4.clampMSS(mss());
+			}
+			auto addr = packet4.dstAddr();
 			if (addr.isBroadcast() || addr.isMulticast()) {
-				std::vector<SteamNetworkingIdentity> identities;
-				{
-					std::lock_guard<std::mutex> lk(refreshMutex);
-					for (auto [steamID, addr] : steamIDToAddr) {
-						SteamNetworkingIdentity identity;
-						identity.SetSteamID(steamID);
-						identities.push_back(identity);
-						if (identities.size() >= MAX_BROADCAST) {
+				// IGMP is rare and every peer has to see it
+				if (packet4.protocol() != PROTOCOL_IGMP && !limiter.admit(packet4, std::chrono::steady_clock::now())) {
+					return;
+				}
+				auto reader = peers.read();
+				thread_local std::vector<uint64_t> targets;
+				targets.clear();
+				// IGMP itself always floods so every peer learns about joins
+				thread_local std::vector<uint64_t> members;
+				if (addr.isMulticast() && packet4.protocol() != PROTOCOL_IGMP && snooper.members(addr, members, std::chrono::steady_clock::now())) {
+					size_t sent = 0;
+					for (auto steamID : members) {
+						if (sent >= MAX_BROADCAST) {
+							dropFanout.add();
 							break;
 						}
+						auto peer = reader.find(steamID);
+						if (peer == nullptr) {
+							continue;
+						}
+						sent++;
+						PeerMetrics::of(*peer).tx(packet.packet.size());
+						targets.push_back(steamID);
 					}
+					forward(targets, packet.packet);
+					return;
 				}
-				for (auto identity : identities) {
-					auto result = SteamNetworkingMessages()->SendMessageToUser(
-						identity,
-						packet.packet.data(), packet.packet.size(),
-						k_nSteamNetworkingSend_Unreliable | k_nSteamNetworkingSend_AutoRestartBrokenSession,
-						0
-					);
-					if (result != k_EResultOK) {
-						LOG("Failed to send multicast packet to " << identity.GetSteamID().ConvertToUint64());
-						LOG("Error: " << result);
+				size_t sent = 0;
+				for (auto &peer : reader.peers()) {
+					if (sent++ >= MAX_BROADCAST) {
+						dropFanout.add();
+						break;
 					}
+					PeerMetrics::of(peer).tx(packet.packet.size());
+					targets.push_back(peer.steamID);
 				}
+				forward(targets, packet.packet);
 				return;
 			}
-			if (!addrToSteamID.contains(addr)) {
-				return;
+			uint64_t steamID;
+			{
+				auto reader = peers.read();
+				auto peer = reader.find(addr);
+				if (peer == nullptr) {
+					dropNoRoute.add();
+					return;
+				}
+				steamID = peer->steamID;
+				PeerMetrics::of(*peer).tx(packet.packet.size());
 			}
-			auto steamID = addrToSteamID[addr];
-			// send packet to steamID
-			SteamNetworkingIdentity identity;
-			identity.SetSteamID(steamID);
-			auto result = SteamNetworkingMessages()->SendMessageToUser(
-				identity,
-				packet.packet.data(), packet.packet.size(),
-				k_nSteamNetworkingSend_Unreliable | k_nSteamNetworkingSend_AutoRestartBrokenSession,
-				0
-			);
-
-			if (result != k_EResultOK) {
-				LOG("Failed to send packet to " << steamID.ConvertToUint64());
-				LOG("Error: " << result);
+			// only unicast can be compressed, the receiver rebuilds the
+			// addresses from the peer mapping
+			thread_local std::vector<uint8_t> compressed;
+			std::span<const uint8_t> frame = packet.packet;
+			if (options.compressHeaders && compressor.compress(steamID, packet4, compressed)) {
+				frame = compressed;
+			}
+			thread_local std::vector<uint8_t> data;
+			thread_local std::vector<std::vector<uint8_t>> parity;
+			// TCP retransmits what's lost, parity would only add to a bulk
+			// transfer's load
+			if (options.fec && packet4.protocol() != PROTOCOL_TCP && encoder.encode(steamID, frame, data, parity)) {
+				sendFEC(steamID, data);
+				for (auto &p : parity) {
+					sendFEC(steamID, p);
+				}
+			} else {
+				forward(steamID, frame);
 			}
 
 			writtenPacketCount++;
@@ -165,89 +354,634 @@ namespace lpvpn::steam {
 			}
 		}
 
+		void flush() {
+			for (auto &transport : transports) {
+				transport->flush();
+			}
+		}
+
 		void onData(std::function<void(Packet&)> cb) {
 			onDataCb = cb;
 		}
 
-		void onEndpoints(std::function<void(std::vector<Endpoint>&)> cb) {
+		void onFlush(std::function<void()> cb) {
+			onFlushCb = cb;
+		}
+
+		void onEndpoints(std::function<void(const EndpointDiff&)> cb) {
+			std::lock_guard<std::mutex> deliverLk(deliverMutex);
+			EndpointDiff diff;
+			{
+				std::lock_guard<std::mutex> lk(refreshMutex);
+				for (auto &[steamID, endpoint] : _endpoints) {
+					diff.added.push_back(endpoint);
+				}
+				onEndpointsCb = cb;
+			}
 			if (cb != nullptr) {
-				cb(_endpoints);
+				cb(diff);
 			}
-			onEndpointsCb = cb;
 		}
 
 		private:
 		std::shared_ptr<Steam> steam;
-		std::thread thread;
-		std::thread refreshThread;
-		std::atomic<bool> running = true;
-		std::uint32_t writtenPacketCount = 0;
+		Options options;
+		// broadcasts are sent once per peer, this keeps chatty games in check
+		storm::Limiter limiter;
+		std::unique_ptr<batch::Batcher> batcher;
+		std::atomic<uint32_t> nextFragmentID = 0;
+		probe::Prober prober;
+		// tried in order before Steam, fixed after construction
+		std::vector<std::unique_ptr<transport::Transport>> transports;
+		// when each peer last got our offers, only used on the Steam event
+		// loop thread
+		std::map<uint64_t, std::chrono::steady_clock::time_point> offered;
+		fec::Encoder encoder;
+		// write() is called concurrently by every TUN reader thread
+		std::atomic<std::uint32_t> writtenPacketCount = 0;
 		std::uint32_t readPacketCount = 0;
 
+		// timers on the Steam event loop, see poll()
+		event::Loop::TimerID pollTimer;
+		event::Loop::TimerID kickTimer;
+		event::Loop::TimerID tickTimer;
+		event::Loop::TimerID probeTimer;
+		event::Loop::TimerID refreshTimer;
+		event::Loop::TimerID queryTimer;
+		// 0 until created, arming an unknown timer is a no-op
+		event::Loop::TimerID updateTimer = 0;
+		// the next update walks the whole friend list, under refreshMutex
+		bool sweepPending = false;
+		// _endpoints changed since the cache was written, under refreshMutex
+		bool cacheDirty = false;
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		std::atomic<bool> forwarded = false;
+		// true while no fast poll is scheduled and only the tick polls
+		std::atomic<bool> receiverIdle = true;
+		burst::Backoff backoff{MIN_IDLE_WAIT, std::chrono::duration_cast<std::chrono::microseconds>(LOOP_INTERVAL)};
+		SteamNetworkingMessage_t *msgs[RECEIVE_BATCH];
+		ISteamNetworkingMessages *messages = SteamNetworkingMessages();
+
 		std::uint32_t appID = 0;
 		CSteamID localSteamID;
 		Address4 _localAddr;
-		std::vector<Endpoint> _endpoints;
-		std::map<CSteamID, Address4> steamIDToAddr;
-		std::map<Address4, CSteamID> addrToSteamID;
+		// friends by Steam ID, only touched under refreshMutex
+		std::map<uint64_t, Endpoint> _endpoints;
+		// friends with persona changes waiting for updateTimer
+		std::set<uint64_t> dirty;
+		// address assignments, only touched under refreshMutex
+		route::AddressAllocator addrs;
 		std::mutex refreshMutex;
+		// taken before refreshMutex and held while a diff is delivered,
+		// so diffs arrive in order without blocking the data path
+		std::mutex deliverMutex;
+		// lock-free view of the assignments for the packet path
+		route::PeerTable peers;
+		igmp::Snooper snooper;
+		compress::Compressor compressor;
+		// only used on the Steam event loop thread, like everything
+		// Steam and the transports deliver
+		std::unique_ptr<dispatch::Receiver> receiver;
+
+		metrics::Counter &dropNotIPv4 = metrics::drops("not_ipv4");
+		metrics::Counter &dropNoRoute = metrics::drops("no_route");
+		metrics::Counter &dropFanout = metrics::drops("fanout_limit");
+		metrics::Counter &dropUnknownPeer = metrics::drops("unknown_peer");
+		metrics::Counter &dropMalformed = metrics::drops("malformed");
+		metrics::Histogram &receiveBurst = metrics::registry().histogram("lpvpn_receive_burst_messages", "Messages taken per receive call");
+		metrics::Counter &receiveWakeups = metrics::wakeups("steam_receive");
+		// by EResult, filled in as codes first show up, see sendFailures()
+		std::array<std::atomic<metrics::Counter *>, SEND_RESULTS> sendFailureCounters = {};
 
 		std::function<void(Packet&)> onDataCb;
-		std::function<void(std::vector<Endpoint>&)> onEndpointsCb;
+		std::function<void()> onFlushCb;
+		std::function<void(const EndpointDiff&)> onEndpointsCb;
 
 		STEAM_CALLBACK(Impl, onSteamNetworkingMessagesSessionRequest, SteamNetworkingMessagesSessionRequest_t);
 		STEAM_CALLBACK(Impl, onSteamNetworkingMessagesSessionFailed, SteamNetworkingMessagesSessionFailed_t);
 		STEAM_CALLBACK(Impl, onPersonaStateChange, PersonaStateChange_t);
 
-		Address4 computeAddr(CSteamID steamID, uint32_t offset = 0) {
-			// use IP in the CGNAT range
-			// https://en.wikipedia.org/wiki/Carrier-grade_NAT
-			auto range = Subnet4({100, 64, 0, 0}, 10);
-			auto size = range.size();
-			auto mod = (steamID.ConvertToUint64() + offset) % size;
-			if (mod == 0) {
-				mod = 1;
-			} else if (mod == size - 1) {
-				mod = size - 2;
-			}
-			auto canonicalAddr = range.start().toUint32() + mod;
-			return Address4(canonicalAddr);
-		}
-
-		Address4 assignAddr(CSteamID steamID) {
-			if (steamIDToAddr.contains(steamID)) {
-				return steamIDToAddr[steamID];
-			}
-			for (uint32_t offset = 0; offset < 4; offset++) {
-				auto addr = computeAddr(steamID, offset);
-				if (!addrToSteamID.contains(addr)) {
-					steamIDToAddr[steamID] = addr;
-					addrToSteamID[addr] = steamID;
-					return addr;
+		// polls with a backoff from MIN_IDLE_WAIT to LOOP_INTERVAL, then goes
+		// idle and only the tick (sharing its wakeup with the callback pump)
+		// or write() polls
+		void poll() {
+			receiveWakeups.add();
+			receiveProbes();
+			// the packet handed to onData points into the message, which
+			// is released once the callback returns
+			auto count = burst::receive(*messages, 0, std::span<SteamNetworkingMessage_t *>(msgs), [this](SteamNetworkingMessage_t *msg) {
+				receiver->receive(msg);
+			});
+			if (count > 0) {
+				receiveBurst.observe(count);
+				if (onFlushCb != nullptr) {
+					onFlushCb();
+				}
+
+				readPacketCount += count;
+				if (readPacketCount >= FREE_EVERY) {
+					SteamAPI_ReleaseCurrentThreadMemory();
+					readPacketCount = 0;
 				}
 			}
-			throw std::runtime_error("no available address");
+
+			// a full batch polls again right away, but lets other events in first
+			if (auto wait = backoff.next(count, RECEIVE_BATCH, receiverIdle)) {
+				receiverIdle = false;
+				steam->loop().arm(pollTimer, *wait);
+			} else {
+				receiverIdle = true;
+			}
 		}
 
-		void refreshEndpoints() {
-			std::lock_guard<std::mutex> lk(refreshMutex);
-			_endpoints.clear();
-			for (auto i = 0; i < SteamFriends()->GetFriendCount(k_EFriendFlagImmediate); i++) {
-				auto steamID = SteamFriends()->GetFriendByIndex(i, k_EFriendFlagImmediate);
-				auto canonicalAddr = computeAddr(steamID);
-				auto addr = assignAddr(steamID);
-				bool online = SteamFriends()->GetFriendPersonaState(steamID) != k_EPersonaStateOffline;
-				if (online) {
-					FriendGameInfo_t gameInfo;
-					auto inGame = SteamFriends()->GetFriendGamePlayed(steamID, &gameInfo);
-					if (!inGame || gameInfo.m_gameID.AppID() != appID) {
-						online = false;
+		// sends a probe to every peer packets went to or came from since the
+		// last round
+		void probe() {
+			auto now = std::chrono::steady_clock::now();
+			thread_local std::vector<uint8_t> request;
+			std::vector<uint64_t> active;
+			{
+				auto reader = peers.read();
+				for (auto &peer : reader.peers()) {
+					auto &stats = PeerMetrics::of(peer);
+					if (prober.active(peer.steamID, stats.txPackets.value() + stats.rxPackets.value())) {
+						stats.probesSent.add();
+						active.push_back(peer.steamID);
 					}
 				}
-				_endpoints.push_back({SteamFriends()->GetFriendPersonaName(steamID), addr, canonicalAddr, online});
 			}
-			if (onEndpointsCb != nullptr) {
-				onEndpointsCb(_endpoints);
+			receiveSignals();
+			for (auto &transport : transports) {
+				transport->tick();
+			}
+			for (auto steamID : active) {
+				prober.request(steamID, now, request);
+				send(steamID, request, probe::CHANNEL);
+				offer(steamID, now);
+			}
+			if (!active.empty() && receiverIdle.load(std::memory_order_relaxed) && receiverIdle.exchange(false)) {
+				// the reply should be picked up as soon as it lands
+				steam->loop().arm(kickTimer, std::chrono::microseconds(0));
+			}
+		}
+
+		// answers probes and takes in replies, on the probe channel
+		void receiveProbes() {
+			SteamNetworkingMessage_t *probes[PROBE_BATCH];
+			auto count = messages->ReceiveMessagesOnChannel(probe::CHANNEL, probes, PROBE_BATCH);
+			auto now = std::chrono::steady_clock::now();
+			for (int i = 0; i < count; i++) {
+				auto msg = probes[i];
+				auto steamID = msg->m_identityPeer.GetSteamID().ConvertToUint64();
+				receiveProbe(steamID, std::span<uint8_t>(static_cast<uint8_t *>(msg->m_pData), msg->GetSize()), now);
+				msg->Release();
+			}
+		}
+
+		void receiveProbe(uint64_t steamID, std::span<uint8_t> data, std::chrono::steady_clock::time_point now) {
+			auto reader = peers.read();
+			auto peer = reader.find(steamID);
+			if (peer == nullptr) {
+				dropUnknownPeer.add();
+			} else if (probe::isRequest(data)) {
+				probe::makeReply(data);
+				send(steamID, data, probe::CHANNEL);
+			} else if (auto rtt = prober.reply(steamID, data, now)) {
+				auto &stats = PeerMetrics::of(*peer);
+				auto latency = prober.stats(steamID);
+				stats.probesAnswered.add();
+				stats.rtt.observe(static_cast<uint64_t>(rtt->count()));
+				stats.smoothedRTT.set(latency.rtt.count());
+				stats.jitter.set(latency.jitter.count());
+			}
+		}
+
+		// asks every peer's host which groups it is in. The reports come back
+		// flooded like all IGMP and keep the snooper's memberships alive.
+		void query() {
+			auto packet = igmp::makeQuery(_localAddr);
+			std::vector<uint64_t> targets;
+			{
+				auto reader = peers.read();
+				for (auto &peer : reader.peers()) {
+					targets.push_back(peer.steamID);
+				}
+			}
+			forward(targets, packet);
+		}
+
+		// sends our offers to a peer no transport has a path to yet, unless
+		// it got them recently. An answer goes out even with a path, the
+		// peer may have restarted and lost our keys.
+		void offer(uint64_t steamID, std::chrono::steady_clock::time_point now, bool answer = false) {
+			if (transports.empty()) {
+				return;
+			}
+			auto it = offered.find(steamID);
+			if (it != offered.end() && now - it->second < OFFER_INTERVAL) {
+				return;
+			}
+			bool needed = answer;
+			for (auto &transport : transports) {
+				needed = needed || !transport->connected(steamID);
+			}
+			if (!needed) {
+				return;
+			}
+			offered[steamID] = now;
+			// a peer on an older build drops these as an unknown channel
+			for (auto &transport : transports) {
+				std::vector<uint8_t> signal;
+				signal.push_back(transport->kind());
+				auto blob = transport->offer(steamID);
+				signal.insert(signal.end(), blob.begin(), blob.end());
+				send(steamID, signal, SIGNAL_CHANNEL);
+			}
+		}
+
+		// hands peers' offers to the matching transport and answers with
+		// ours, so both ends start checking paths at about the same time
+		void receiveSignals() {
+			SteamNetworkingMessage_t *signals[SIGNAL_BATCH];
+			int count;
+			while ((count = messages->ReceiveMessagesOnChannel(SIGNAL_CHANNEL, signals, SIGNAL_BATCH)) > 0) {
+				auto now = std::chrono::steady_clock::now();
+				for (int i = 0; i < count; i++) {
+					auto msg = signals[i];
+					auto steamID = msg->m_identityPeer.GetSteamID().ConvertToUint64();
+					auto data = std::span<const uint8_t>(static_cast<const uint8_t *>(msg->m_pData), msg->GetSize());
+					bool known;
+					{
+						auto reader = peers.read();
+						known = reader.find(steamID) != nullptr;
+					}
+					if (!known) {
+						dropUnknownPeer.add();
+					} else if (!data.empty()) {
+						for (auto &transport : transports) {
+							if (transport->kind() == data[0]) {
+								transport->accept(steamID, data.subspan(1));
+								offer(steamID, now, true);
+							}
+						}
+					}
+					msg->Release();
+				}
+			}
+		}
+
+		// what transports deliver, on the Steam event loop thread like
+		// everything Steam delivers
+		void receiveDirect(uint64_t steamID, int channel, std::span<uint8_t> data) {
+			switch (channel) {
+				case 0:
+					receiver->receive(steamID, data);
+					break;
+				case probe::CHANNEL:
+					receiveProbe(steamID, data, std::chrono::steady_clock::now());
+					break;
+				default:
+					dropMalformed.add();
+					break;
+			}
+		}
+
+		void forward(uint64_t steamID, std::span<const uint8_t> message) {
+			// a frame too big to split goes out whole and Steam deals with it
+			if (oversized(message) && fragment(message, options.tunnelMTU, [&](std::span<const uint8_t> piece) {
+				forward(steamID, piece);
+			})) {
+				return;
+			}
+			if (batcher != nullptr) {
+				batcher->enqueue(steamID, message);
+				return;
+			}
+			send(steamID, message);
+		}
+
+		// fan-out, the batch queues share a single copy of the message
+		void forward(std::span<const uint64_t> steamIDs, std::span<const uint8_t> message) {
+			if (steamIDs.empty()) {
+				return;
+			}
+			if (oversized(message) && fragment(message, options.tunnelMTU, [&](std::span<const uint8_t> piece) {
+				forward(steamIDs, piece);
+			})) {
+				return;
+			}
+			if (batcher != nullptr) {
+				batcher->enqueue(steamIDs, pool::Buffer::copy(message));
+				return;
+			}
+			for (auto steamID : steamIDs) {
+				send(steamID, message);
+			}
+		}
+
+		// FEC frames skip the batcher: a lost message with several frames
+		// of one group in it would take more of the group than its parity
+		// can bring back
+		void sendFEC(uint64_t steamID, std::span<const uint8_t> frame) {
+			if (oversized(frame) && fragment(frame, options.tunnelMTU, [&](std::span<const uint8_t> piece) {
+				send(steamID, piece);
+			})) {
+				return;
+			}
+			send(steamID, frame);
+		}
+
+		// closes groups that didn't fill up in time, so the last frames of
+		// a burst are covered too
+		void flushParity() {
+			thread_local std::vector<std::pair<uint64_t, std::vector<uint8_t>>> parity;
+			parity.clear();
+			encoder.flush(std::chrono::steady_clock::now(), parity);
+			for (auto &[steamID, frame] : parity) {
+				sendFEC(steamID, frame);
+			}
+		}
+
+		// full size segments must fit the tunnel MTU, TCP is never
+		// wrapped in FEC's framing
+		uint16_t mss() {
+			return static_cast<uint16_t>(options.tunnelMTU - TCP_IP_HEADERS);
+		}
+
+		bool oversized(std::span<const uint8_t> message) {
+			return options.tunnelMTU != 0 && message.size() > options.tunnelMTU;
+		}
+
+		template<typename F>
+		bool fragment(std::span<const uint8_t> message, size_t mtu, F cb) {
+			auto id = nextFragmentID.fetch_add(1, std::memory_order_relaxed);
+			return frag::split(id, message, mtu, cb);
+		}
+
+		// true if a transport took the message. Messages over its MTU are
+		// split here, transports only ever see what fits in one datagram.
+		bool sendDirect(transport::Transport &transport, uint64_t steamID, std::span<const uint8_t> message, int channel) {
+			auto mtu = transport.mtu();
+			if (message.size() <= mtu) {
+				return transport.send(steamID, channel, message, deferring);
+			}
+			if (channel != 0 || !transport.connected(steamID)) {
+				return false;
+			}
+			// the pieces are held back and leave together
+			bool sent = true;
+			auto split = fragment(message, mtu, [&](std::span<const uint8_t> piece) {
+				sent = transport.send(steamID, channel, piece, true) && sent;
+			});
+			if (!deferring) {
+				transport.flush();
+			}
+			return split && sent;
+		}
+
+		// records how much each peer has queued inside Steam
+		void sampleQueues() {
+			auto reader = peers.read();
+			for (auto &peer : reader.peers()) {
+				SteamNetworkingIdentity identity;
+				identity.SetSteamID64(peer.steamID);
+				SteamNetConnectionRealTimeStatus_t status;
+				auto state = messages->GetSessionConnectionInfo(identity, nullptr, &status);
+				auto pending = state == k_ESteamNetworkingConnectionState_None ? 0 : status.m_cbPendingUnreliable;
+				PeerMetrics::of(peer).pendingBytes.set(pending);
+				// the share of what we send that arrives, as the peer sees it
+				if (options.fec && state != k_ESteamNetworkingConnectionState_None && status.m_flConnectionQualityRemote >= 0) {
+					auto parity = encoder.setLoss(peer.steamID, 1 - status.m_flConnectionQualityRemote);
+					PeerMetrics::of(peer).fecParity.set(static_cast<int64_t>(parity));
+				}
+			}
+		}
+
+		EResult send(uint64_t steamID, std::span<const uint8_t> message, int channel = 0) {
+			if (channel != SIGNAL_CHANNEL) {
+				for (auto &transport : transports) {
+					if (sendDirect(*transport, steamID, message, channel)) {
+						return k_EResultOK;
+					}
+				}
+			}
+			SteamNetworkingIdentity identity;
+			identity.SetSteamID64(steamID);
+			auto result = messages->SendMessageToUser(
+				identity,
+				message.data(), static_cast<uint32>(message.size()),
+				k_nSteamNetworkingSend_Unreliable | k_nSteamNetworkingSend_AutoRestartBrokenSession,
+				channel
+			);
+			if (result == k_EResultOK && !forwarded.load(std::memory_order_relaxed) && !forwarded.exchange(true)) {
+				auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
+				LOG("First packet forwarded " << elapsed.count() << " ms after start");
+			}
+			if (result != k_EResultOK) {
+				// failures come in bursts when a peer goes away, LOG rate
+				// limits them and the counter keeps the exact number
+				sendFailures(result).add();
+				LOG("Failed to send packet to " << steamID << ", error " << result);
+			}
+			return result;
+		}
+
+		// failures come in bursts, only the first of each code goes to the
+		// registry. Racing threads get the same counter back from it.
+		metrics::Counter &sendFailures(EResult result) {
+			auto index = static_cast<size_t>(result);
+			if (index >= SEND_RESULTS) {
+				return metrics::registry().counter("lpvpn_send_failures_total", "Failed sends to Steam, by EResult", {{"result", std::to_string(result)}});
+			}
+			auto counter = sendFailureCounters[index].load(std::memory_order_acquire);
+			if (counter == nullptr) {
+				counter = &metrics::registry().counter("lpvpn_send_failures_total", "Failed sends to Steam, by EResult", {{"result", std::to_string(result)}});
+				sendFailureCounters[index].store(counter, std::memory_order_release);
+			}
+			return *counter;
+		}
+
+		void publishPeers() {
+			std::vector<route::Peer> list;
+			for (auto &[steamID, addr] : addrs.assignments()) {
+				if (steamID != localSteamID.ConvertToUint64()) {
+					list.push_back({steamID, addr, std::make_shared<PeerMetrics>(steamID)});
+				}
+			}
+			peers.publish(std::move(list));
+		}
+
+		// Serves routing and the menu from the cache file. Every cached friend
+		// is marked dirty and a sweep queued, so the update timer reconciles
+		// with Steam on the event loop instead of the constructor.
+		bool loadCache() {
+			if (options.peerCache.empty()) {
+				return false;
+			}
+			auto start = std::chrono::steady_clock::now();
+			auto entries = cache::load(options.peerCache, localSteamID.ConvertToUint64());
+			if (entries.empty()) {
+				return false;
+			}
+			{
+				std::lock_guard<std::mutex> lk(refreshMutex);
+				// peers get the address they had last time, which only a
+				// damaged file can have taken already
+				std::vector<uint64_t> displaced;
+				for (auto &entry : entries) {
+					if (!addrs.restore(entry.steamID, entry.addr)) {
+						displaced.push_back(entry.steamID);
+					}
+					dirty.insert(entry.steamID);
+				}
+				addrs.assignAll(displaced);
+				for (auto &entry : entries) {
+					auto addr = *addrs.find(entry.steamID);
+					auto canonicalAddr = route::AddressAllocator::compute(entry.steamID);
+					_endpoints.insert_or_assign(entry.steamID, Endpoint{entry.steamID, entry.name, addr, canonicalAddr, entry.online, {}});
+				}
+				publishPeers();
+				sweepPending = true;
+			}
+			steam->loop().arm(updateTimer, std::chrono::microseconds(0));
+			auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+			LOG("Loaded " << entries.size() << " peers from " << options.peerCache << " in " << elapsed.count() << " us");
+			return true;
+		}
+
+		void saveCache() {
+			if (options.peerCache.empty()) {
+				return;
+			}
+			std::vector<cache::Entry> entries;
+			{
+				std::lock_guard<std::mutex> lk(refreshMutex);
+				if (!cacheDirty) {
+					return;
+				}
+				for (auto &[steamID, endpoint] : _endpoints) {
+					entries.push_back({steamID, endpoint.addr, endpoint.name, endpoint.isOnline});
+				}
+				cacheDirty = false;
+			}
+			cache::save(options.peerCache, localSteamID.ConvertToUint64(), entries);
+		}
+
+		// must hold refreshMutex, assigns an address on first sight
+		Endpoint queryEndpoint(CSteamID steamID) {
+			auto canonicalAddr = route::AddressAllocator::compute(steamID.ConvertToUint64());
+			auto addr = addrs.assign(steamID.ConvertToUint64());
+			bool online = SteamFriends()->GetFriendPersonaState(steamID) != k_EPersonaStateOffline;
+			if (online) {
+				FriendGameInfo_t gameInfo;
+				auto inGame = SteamFriends()->GetFriendGamePlayed(steamID, &gameInfo);
+				if (!inGame || gameInfo.m_gameID.AppID() != appID) {
+					online = false;
+				}
+			}
+			return {steamID.ConvertToUint64(), SteamFriends()->GetFriendPersonaName(steamID), addr, canonicalAddr, online, prober.stats(steamID.ConvertToUint64())};
+		}
+
+		// Re-queries the friends with pending persona changes and, with
+		// sweep, walks the friend list for additions and removals. Only
+		// the difference reaches onEndpointsCb.
+		void updateEndpoints(bool sweep) {
+			std::lock_guard<std::mutex> deliverLk(deliverMutex);
+			EndpointDiff diff;
+			std::function<void(const EndpointDiff&)> cb;
+			{
+				std::lock_guard<std::mutex> lk(refreshMutex);
+				auto pending = std::move(dirty);
+				dirty.clear();
+				if (sweep) {
+					std::set<uint64_t> friends;
+					for (auto i = 0; i < SteamFriends()->GetFriendCount(k_EFriendFlagImmediate); i++) {
+						friends.insert(SteamFriends()->GetFriendByIndex(i, k_EFriendFlagImmediate).ConvertToUint64());
+					}
+					for (auto it = _endpoints.begin(); it != _endpoints.end();) {
+						if (friends.contains(it->first)) {
+							it++;
+							continue;
+						}
+						diff.removed.push_back(it->second);
+						it = _endpoints.erase(it);
+					}
+					for (auto steamID : friends) {
+						if (!_endpoints.contains(steamID)) {
+							pending.insert(steamID);
+						}
+					}
+				}
+
+				// newcomers are laid out together, nobody known moves
+				std::vector<uint64_t> newcomers;
+				for (auto id : pending) {
+					if (!_endpoints.contains(id) && SteamFriends()->HasFriend(CSteamID(static_cast<uint64>(id)), k_EFriendFlagImmediate)) {
+						newcomers.push_back(id);
+					}
+				}
+				addrs.assignAll(newcomers);
+				for (auto id : pending) {
+					auto steamID = CSteamID(static_cast<uint64>(id));
+					auto it = _endpoints.find(id);
+					// persona changes also fire for people who aren't friends
+					if (!SteamFriends()->HasFriend(steamID, k_EFriendFlagImmediate)) {
+						if (it != _endpoints.end()) {
+							diff.removed.push_back(it->second);
+							_endpoints.erase(it);
+						}
+						continue;
+					}
+					auto endpoint = queryEndpoint(steamID);
+					if (it == _endpoints.end()) {
+						diff.added.push_back(endpoint);
+						_endpoints.emplace(id, endpoint);
+					} else if (it->second.name != endpoint.name || it->second.isOnline != endpoint.isOnline || it->second.addr != endpoint.addr) {
+						diff.changed.push_back(endpoint);
+						it->second = endpoint;
+					}
+				}
+				// only additions can bring new address assignments
+				if (!diff.added.empty()) {
+					publishPeers();
+				}
+				// transports only ever run on the event loop, like this
+				for (auto &endpoint : diff.removed) {
+					for (auto &transport : transports) {
+						transport->forget(endpoint.steamID);
+					}
+					offered.erase(endpoint.steamID);
+				}
+				if (!diff.added.empty() || !diff.removed.empty() || !diff.changed.empty()) {
+					cacheDirty = true;
+				}
+				// latency isn't cached and moves all the time, so it only
+				// rides along with the sweep
+				if (sweep) {
+					for (auto &[steamID, endpoint] : _endpoints) {
+						auto latency = prober.stats(steamID);
+						if (latency == endpoint.latency) {
+							continue;
+						}
+						endpoint.latency = latency;
+						auto matches = [id = steamID](const Endpoint &endpoint) {
+							return endpoint.steamID == id;
+						};
+						auto added = std::find_if(diff.added.begin(), diff.added.end(), matches);
+						auto changed = std::find_if(diff.changed.begin(), diff.changed.end(), matches);
+						if (added != diff.added.end()) {
+							*added = endpoint;
+						} else if (changed != diff.changed.end()) {
+							*changed = endpoint;
+						} else {
+							diff.changed.push_back(endpoint);
+						}
+					}
+				}
+				cb = onEndpointsCb;
+			}
+			if (cb != nullptr && (!diff.added.empty() || !diff.removed.empty() || !diff.changed.empty())) {
+				cb(diff);
 			}
 		}
 	};
@@ -270,21 +1004,30 @@ namespace lpvpn::steam {
 	}
 
 	void SteamNet::Impl::onPersonaStateChange(PersonaStateChange_t *ev) {
-		// refresh endpoints
 		if (ev == nullptr) {
 			return;
 		}
-		refreshEndpoints();
+		bool first;
+		{
+			std::lock_guard<std::mutex> lk(refreshMutex);
+			first = dirty.empty();
+			dirty.insert(ev->m_ulSteamID);
+		}
+		// later changes ride along with the first one's update
+		if (first) {
+			steam->loop().arm(updateTimer, PERSONA_DEBOUNCE);
+		}
 	}
 
-	SteamNet::SteamNet(std::shared_ptr<Steam> steam) : impl(std::make_unique<Impl>(steam)) {}
+	SteamNet::SteamNet(std::shared_ptr<Steam> steam) : impl(std::make_unique<Impl>(steam, Options())) {}
+	SteamNet::SteamNet(std::shared_ptr<Steam> steam, const Options &options) : impl(std::make_unique<Impl>(steam, options)) {}
 	SteamNet::~SteamNet() {}
 
 	Subnet4 SteamNet::localAddr() {
 		return impl->localAddr();
 	}
 
-	void SteamNet::onEndpoints(std::function<void(std::vector<Endpoint>&)> cb) {
+	void SteamNet::onEndpoints(std::function<void(const EndpointDiff&)> cb) {
 		return impl->onEndpoints(cb);
 	}
 
@@ -292,7 +1035,15 @@ namespace lpvpn::steam {
 		return impl->write(packet);
 	}
 
+	void SteamNet::flush() {
+		return impl->flush();
+	}
+
 	void SteamNet::onData(std::function<void(Packet&)> cb) {
 		return impl->onData(cb);
 	}
+
+	void SteamNet::onFlush(std::function<void()> cb) {
+		return impl->onFlush(cb);
+	}
 }
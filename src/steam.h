@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <map>
@@ -10,36 +11,100 @@
 
 #include <steam_api.h>
 #include "ip.h"
+#include "event.h"
+#include "probe.h"
 
 
 namespace lpvpn::steam {
 	using namespace lpvpn::ip;
 
-	// RAII wrapper for Steam API
+	// RAII wrapper for Steam API. Callbacks are dispatched from an event
+	// loop thread, which SteamNet also runs its timers on.
 	class Steam {
 		public:
 		Steam();
 		~Steam();
+		event::Loop &loop();
 		private:
-		std::atomic<bool> running;
+		event::Loop _loop;
 		std::thread thread;
 	};
 
 	class SteamNet {
 		public:
 		struct Endpoint {
+			uint64_t steamID;
 			std::string name;
 			Address4 addr;
 			Address4 canonicalAddr;
 			bool isOnline;
+			// measured while packets flow, refreshed with the friend list
+			probe::Stats latency;
+		};
+
+		// what changed in the friend list since the last delivery, the
+		// first one after onEndpoints() lists everyone as added
+		struct EndpointDiff {
+			std::vector<Endpoint> added;
+			std::vector<Endpoint> removed;
+			std::vector<Endpoint> changed;
+		};
+
+		struct Options {
+			// how long a packet may wait to share a message with others bound
+			// for the same peer, 0 sends every packet on its own
+			std::chrono::microseconds batchLatency = std::chrono::microseconds(0);
+			// largest message built from coalesced packets
+			size_t mtu = 1200;
+			// send IPv4 / UDP headers as per-flow deltas, peers can always
+			// decode them regardless of this setting
+			bool compressHeaders = false;
+			// file the peer table is kept in across restarts, so routing
+			// and the menu work before Steam has been asked about every
+			// friend; empty disables it
+			std::string peerCache;
+			// largest message put on the wire; bigger frames are split and
+			// TCP SYNs have their MSS lowered to fit. 0 leaves both to Steam.
+			// Peers can always reassemble, but older builds can't.
+			size_t tunnelMTU = 0;
+			// send parity with unicast frames other than TCP so lost ones
+			// can be rebuilt, as much as each peer's loss calls for. Peers can
+			// always decode it, but older builds can't.
+			bool fec = false;
+			// reach peers over UDP directly where a path can be found,
+			// offers are exchanged through Steam, which still carries
+			// whatever can't go direct. Linux only.
+			bool udp = false;
+			// 0 picks any free port
+			uint16_t udpPort = 0;
+			// offered to peers besides our own interface addresses, e.g.
+			// the public address of a forwarded port
+			std::vector<Address4> udpAdvertise;
+			// broadcast and multicast packets each local sender (address,
+			// protocol and port) may send per second, 0 for no limit
+			double broadcastRate = 0;
+			// back to back packets allowed by broadcastRate, 0 for one
+			// second's worth
+			double broadcastBurst = 0;
+			// identical broadcasts within this long of each other are sent
+			// once, 0 sends every copy
+			std::chrono::milliseconds broadcastDedup = std::chrono::milliseconds(0);
 		};
 
 		SteamNet(std::shared_ptr<Steam> steam);
+		SteamNet(std::shared_ptr<Steam> steam, const Options &options);
 		~SteamNet();
 
 		void write(Packet &packet);
+		// sends what write() held back on this thread, call at the end of
+		// a burst of writes
+		void flush();
 		void onData(std::function<void(Packet&)> cb);
-		void onEndpoints(std::function<void(std::vector<Endpoint>&)> cb);
+		// called after every burst of packets delivered through onData
+		void onFlush(std::function<void()> cb);
+		// persona changes are coalesced for a short while, diffs are
+		// delivered on the Steam event loop thread without any lock held
+		void onEndpoints(std::function<void(const EndpointDiff&)> cb);
 
 		Subnet4 localAddr();
 
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "storm.h"
+
+namespace lpvpn::storm {
+	// murmur3's 64 bit finalizer
+	static uint64_t mix(uint64_t key) {
+		key ^= key >> 33;
+		key *= 0xFF51AFD7ED558CCDull;
+		key ^= key >> 33;
+		key *= 0xC4CEB9FE1A85EC53ull;
+		key ^= key >> 33;
+		return key;
+	}
+
+	uint64_t hash(std::span<const uint8_t> data, uint64_t seed) {
+		uint64_t h = seed ^ (data.size() * 0x9E3779B97F4A7C15ull);
+		size_t i = 0;
+		for (; i + 8 <= data.size(); i += 8) {
+			uint64_t word;
+			memcpy(&word, data.data() + i, 8);
+			h = (h ^ mix(word)) * 0x9E3779B97F4A7C15ull;
+		}
+		uint64_t tail = 0;
+		memcpy(&tail, data.data() + i, data.size() - i);
+		return mix(h ^ tail);
+	}
+
+	Limiter::Limiter(const Options &options): options(options) {
+		if (this->options.burst <= 0) {
+			this->options.burst = std::max(this->options.rate, 1.0);
+		}
+	}
+
+	Limiter::~Limiter() {}
+
+	bool Limiter::admit(Packet4 &packet, Clock::time_point now) {
+		if (options.rate <= 0 && options.dedupWindow.count() <= 0) {
+			return true;
+		}
+		auto protocol = packet.protocol();
+		auto payload = packet.payload();
+		uint16_t srcPort = 0;
+		uint16_t dstPort = 0;
+		if ((protocol == PROTOCOL_TCP || protocol == PROTOCOL_UDP) && !packet.isFragment() && payload.size() >= 4) {
+			srcPort = (payload[0] << 8) | payload[1];
+			dstPort = (payload[2] << 8) | payload[3];
+		}
+		// the IP header changes between copies (ID, checksum), the L4 header
+		// and payload of a rebroadcast don't
+		uint64_t h = 0;
+		Slot *slot = nullptr;
+		std::lock_guard<std::mutex> lk(mutex);
+		if (options.dedupWindow.count() > 0) {
+			h = hash(payload, (uint64_t(packet.dstAddr().toUint32()) << 8) | protocol);
+			slot = &recent[h % DEDUP_SLOTS];
+			// the window isn't extended by dropped copies
+			if (slot->hash == h && now - slot->sent < options.dedupWindow) {
+				drop(dropDuplicate, "duplicate", dstPort);
+				return false;
+			}
+		}
+		if (options.rate > 0) {
+			auto source = (uint64_t(packet.srcAddr().toUint32()) << 32) | (uint64_t(protocol) << 16) | srcPort;
+			auto it = sources.find(source);
+			if (it == sources.end()) {
+				if (sources.size() >= MAX_SOURCES) {
+					// a bucket that has refilled is the same as no bucket
+					std::erase_if(sources, [&](auto &entry) {
+						return entry.second.tokens + std::chrono::duration<double>(now - entry.second.updated).count() * options.rate >= options.burst;
+					});
+					if (sources.size() >= MAX_SOURCES) {
+						sources.erase(sources.begin());
+					}
+				}
+				it = sources.emplace(source, Bucket{options.burst, now}).first;
+			}
+			auto &bucket = it->second;
+			auto elapsed = std::chrono::duration<double>(now - bucket.updated).count();
+			bucket.tokens = std::min(options.burst, bucket.tokens + std::max(elapsed, 0.0) * options.rate);
+			bucket.updated = now;
+			if (bucket.tokens < 1) {
+				drop(dropRateLimit, "rate_limit", dstPort);
+				return false;
+			}
+			bucket.tokens -= 1;
+		}
+		// only what goes out opens a window, a rate limited copy would
+		// otherwise suppress the next one too
+		if (slot != nullptr) {
+			slot->hash = h;
+			slot->sent = now;
+		}
+		return true;
+	}
+
+	void Limiter::drop(metrics::Counter &total, const char *reason, uint16_t port) {
+		total.add();
+		auto &counter = portDrops[{reason, port}];
+		if (counter == nullptr) {
+			counter = &metrics::registry().counter("lpvpn_broadcast_drops_total", "Broadcast and multicast packets held back, by reason and destination port", {{"reason", reason}, {"port", std::to_string(port)}});
+		}
+		counter->add();
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <span>
+#include <utility>
+
+#include "ip.h"
+#include "metrics.h"
+
+namespace lpvpn::storm {
+	using namespace lpvpn::ip;
+
+	// every broadcast costs one send per peer, so these are tracked at most
+	const size_t MAX_SOURCES = 64;
+	const size_t DEDUP_SLOTS = 256;
+
+	// 64 bit hash of data, word at a time, for telling payloads apart
+	uint64_t hash(std::span<const uint8_t> data, uint64_t seed = 0);
+
+	// Broadcast storm control for the packets this host sends to everyone.
+	// A source (address, protocol and port) gets a token bucket, and a
+	// copy of a payload already sent within the dedup window is dropped;
+	// the first copy after the window goes out again, so a game repeating
+	// its announcement is slowed down rather than cut off. Drops count
+	// towards drops{reason} and, to tell games apart, towards
+	// lpvpn_broadcast_drops_total by destination port.
+	class Limiter {
+		public:
+		using Clock = std::chrono::steady_clock;
+
+		struct Options {
+			// packets per second per source, 0 leaves the rate alone
+			double rate = 0;
+			// packets a source may send back to back, 0 uses rate
+			double burst = 0;
+			// identical packets within this long of each other go out
+			// once, 0 sends every copy
+			std::chrono::milliseconds dedupWindow = std::chrono::milliseconds(0);
+		};
+
+		Limiter(const Options &options);
+		~Limiter();
+
+		// false if packet, a broadcast or multicast, should be dropped
+		bool admit(Packet4 &packet, Clock::time_point now);
+
+		private:
+		struct Bucket {
+			double tokens;
+			Clock::time_point updated;
+		};
+
+		struct Slot {
+			uint64_t hash = 0;
+			Clock::time_point sent;
+		};
+
+		// under mutex
+		void drop(metrics::Counter &total, const char *reason, uint16_t port);
+
+		Options options;
+		std::mutex mutex;
+		std::map<uint64_t, Bucket> sources;
+		std::array<Slot, DEDUP_SLOTS> recent;
+		// lpvpn_broadcast_drops_total children by reason and port, looked
+		// up once each
+		std::map<std::pair<const char *, uint16_t>, metrics::Counter *> portDrops;
+		metrics::Counter &dropDuplicate = metrics::drops("broadcast_duplicate");
+		metrics::Counter &dropRateLimit = metrics::drops("broadcast_rate_limit");
+	};
+}
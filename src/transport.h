@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+namespace lpvpn::transport {
+	// A way to reach peers other than Steam's relays. SteamNet tries every
+	// transport before Steam and falls back to it when none of them has a
+	// working path. Setting a path up is the transport's business: SteamNet
+	// carries offers between peers over Steam, which authenticates both
+	// ends and encrypts, so offers may carry keys, and the transport takes
+	// it from there. offer(), accept(), tick() and forget() run on the
+	// transport's loop.
+	class Transport {
+		public:
+		virtual ~Transport() {}
+
+		// tags offers, so peers hand them to the matching transport
+		virtual uint8_t kind() = 0;
+		// what peer needs to reach us, passed to its accept()
+		virtual std::vector<uint8_t> offer(uint64_t peer) = 0;
+		virtual void accept(uint64_t peer, std::span<const uint8_t> offer) = 0;
+		// keeps paths alive and finds new ones, called about once a second
+		virtual void tick() = 0;
+		virtual bool connected(uint64_t peer) = 0;
+		// drops everything known about a peer that is no longer a friend
+		virtual void forget(uint64_t peer) = 0;
+		// largest message send() takes, SteamNet fragments bigger ones
+		virtual size_t mtu() = 0;
+
+		// false if there is no working path to peer. With defer the
+		// message may wait for flush() from the same thread, so bursts
+		// leave in as few system calls as possible.
+		virtual bool send(uint64_t peer, int channel, std::span<const uint8_t> message, bool defer) = 0;
+		virtual void flush() = 0;
+		// messages arrive on the loop the transport was created with, and
+		// the flush callback follows every burst of them
+		virtual void onReceive(std::function<void(uint64_t peer, int channel, std::span<uint8_t> message)> cb) = 0;
+		virtual void onFlush(std::function<void()> cb) = 0;
+	};
+}
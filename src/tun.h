@@ -11,10 +11,27 @@ namespace lpvpn::tun {
 	using namespace lpvpn::ip;
 	class Tun {
 		public:
+		struct Options {
+			// Linux: number of queues / reader threads, 0 picks one per core
+			size_t queues = 0;
+			// Linux: enable IFF_VNET_HDR and TCP segmentation offload, so
+			// reads return up to 64 KB super-packets and writes coalesce
+			bool offload = false;
+			// Linux: keep reads outstanding and batch writes through io_uring,
+			// falls back to read / write if the kernel doesn't support it
+			bool uring = false;
+		};
+
 		Tun();
+		Tun(const Options &options);
 		~Tun();
 		void write(Packet &packet);
+		// write out anything write() held back (coalesced segments, queued
+		// io_uring writes), call at the end of a burst
+		void flush();
 		void onData(std::function<void(Packet&)> cb);
+		// called after every burst of packets delivered through onData
+		void onFlush(std::function<void()> cb);
 		void setIP4(const Subnet4 &subnet);
 
 		private:
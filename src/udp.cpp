@@ -0,0 +1,751 @@
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include "udp.h"
+#include "aead.h"
+#include "frame.h"
+#include "log.h"
+#include "metrics.h"
+
+// older headers don't have the offload options
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// session ID and counter, authenticated but in the clear
+#define HEADER_SIZE 16
+// kinds below 0x80 are channels
+#define KIND_PING 0xFE
+#define KIND_PONG 0xFF
+// header, kind and tag around every message
+#define OVERHEAD (HEADER_SIZE + 1 + aead::TAG_SIZE)
+// a path check carries a u64 challenge
+#define CHECK_SIZE (OVERHEAD + 8)
+// session ID, key, port and candidate count
+#define OFFER_HEADER_SIZE (8 + aead::KEY_SIZE + 3)
+// replay window, in 64 bit words: the last 4032 counters are remembered
+#define REPLAY_WORDS 64
+
+#define RECV_BATCH 32
+// GRO hands over up to 64 KB of segments at once
+#define RECV_BUFFER_SIZE 65536
+// deferred datagrams queued before a flush is forced
+#define SEND_BATCH 64
+// the kernel's limits for a single UDP_SEGMENT send
+#define MAX_SEGMENTS 64
+#define MAX_GSO_SIZE 65000
+#define MAX_CANDIDATES 8
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+
+const auto PATH_TIMEOUT = std::chrono::seconds(5);
+
+namespace lpvpn::udp {
+	using frame::readU16;
+	using frame::readU32;
+	using frame::writeU16;
+	using frame::writeU32;
+	using Clock = std::chrono::steady_clock;
+
+	static bool sameAddr(const sockaddr_in &a, const sockaddr_in &b) {
+		return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+	}
+
+	static std::string toString(const sockaddr_in &addr) {
+		Address4 ip;
+		memcpy(ip.addr.data(), &addr.sin_addr, 4);
+		return ip.toString() + ":" + std::to_string(ntohs(addr.sin_port));
+	}
+
+	static uint64_t readU64(const uint8_t *p) {
+		return (uint64_t(readU32(p)) << 32) | readU32(p + 4);
+	}
+
+	static void writeU64(uint8_t *p, uint64_t value) {
+		writeU32(p, static_cast<uint32_t>(value >> 32));
+		writeU32(p + 4, static_cast<uint32_t>(value));
+	}
+
+	static uint64_t randomU64() {
+		std::random_device random;
+		return (uint64_t(random()) << 32) | random();
+	}
+
+	// session ID and counter, then kind and message sealed with the key.
+	// out takes OVERHEAD + message.size() bytes.
+	static void seal(const aead::Key &key, uint64_t id, uint64_t counter, uint8_t kind, std::span<const uint8_t> message, uint8_t *out) {
+		writeU64(out, id);
+		writeU64(out + 8, counter);
+		out[HEADER_SIZE] = kind;
+		memcpy(out + HEADER_SIZE + 1, message.data(), message.size());
+		auto sealed = std::span<uint8_t>(out + HEADER_SIZE, 1 + message.size());
+		aead::seal(key, aead::nonce(counter), std::span<const uint8_t>(out, HEADER_SIZE), sealed, sealed.data() + sealed.size());
+	}
+
+	class Transport::Impl {
+		public:
+		Impl(event::Loop &loop, const Options &options): loop(loop), options(options) {
+			if (options.mtu <= OVERHEAD || options.mtu > RECV_BUFFER_SIZE) {
+				throw std::runtime_error("Invalid UDP MTU");
+			}
+			challenge = randomU64();
+			previousChallenge = challenge;
+
+			fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (fd < 0) {
+				throw std::system_error(errno, std::generic_category(), "Failed to create UDP socket");
+			}
+			sockaddr_in addr = {};
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_ANY);
+			addr.sin_port = htons(options.port);
+			socklen_t len = sizeof(addr);
+			if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+				auto err = errno;
+				close(fd);
+				throw std::system_error(err, std::generic_category(), "Failed to bind UDP socket");
+			}
+			_port = ntohs(addr.sin_port);
+
+			int size = SOCKET_BUFFER_SIZE;
+			setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+			// a segment size of 0 turns GSO off for now, but fails on
+			// kernels without it
+			int off = 0;
+			gso = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+			int on = 1;
+			gro = setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+
+			recvSlab.resize(RECV_BATCH * RECV_BUFFER_SIZE);
+			loop.watch(fd, [this]() {
+				receive();
+			});
+			LOG("UDP transport on port " << _port << (gso ? ", GSO" : "") << (gro ? ", GRO" : ""));
+		}
+
+		~Impl() {
+			flush();
+			loop.unwatch(fd);
+			close(fd);
+		}
+
+		uint16_t port() {
+			return _port;
+		}
+
+		// u64 session ID, key, u16 port, u8 count, then count IPv4
+		// addresses. The ID and key are the peer's alone and stay the same
+		// until it is forgotten, so repeated offers don't reset anything.
+		std::vector<uint8_t> offer(uint64_t peer) {
+			std::vector<Address4> candidates = options.advertise;
+			struct ifaddrs *ifaddr;
+			if (getifaddrs(&ifaddr) == 0) {
+				for (auto ifa = ifaddr; ifa != nullptr; ifa = ifa->ifa_next) {
+					if (ifa->ifa_addr == nullptr || ifa->ifa_addr->sa_family != AF_INET || (ifa->ifa_flags & IFF_UP) == 0) {
+						continue;
+					}
+					Address4 addr;
+					memcpy(addr.addr.data(), &reinterpret_cast<sockaddr_in *>(ifa->ifa_addr)->sin_addr, 4);
+					auto excluded = std::any_of(options.exclude.begin(), options.exclude.end(), [&](const Subnet4 &subnet) {
+						return !(addr < subnet.start()) && !(addr > subnet.end());
+					});
+					if (!excluded && std::find(candidates.begin(), candidates.end(), addr) == candidates.end()) {
+						candidates.push_back(addr);
+					}
+				}
+				freeifaddrs(ifaddr);
+			}
+			candidates.resize(std::min(candidates.size(), size_t(MAX_CANDIDATES)));
+
+			std::vector<uint8_t> out(OFFER_HEADER_SIZE + 4 * candidates.size());
+			{
+				std::unique_lock<std::shared_mutex> lk(pathMutex);
+				auto &p = local(peer);
+				writeU64(out.data(), p.txID);
+				memcpy(out.data() + 8, p.txKey.data(), aead::KEY_SIZE);
+			}
+			auto header = out.data() + 8 + aead::KEY_SIZE;
+			writeU16(header, _port);
+			header[2] = static_cast<uint8_t>(candidates.size());
+			for (size_t i = 0; i < candidates.size(); i++) {
+				memcpy(out.data() + OFFER_HEADER_SIZE + 4 * i, candidates[i].addr.data(), 4);
+			}
+			return out;
+		}
+
+		void accept(uint64_t peer, std::span<const uint8_t> offer) {
+			if (offer.size() < OFFER_HEADER_SIZE) {
+				dropMalformed.add();
+				return;
+			}
+			auto header = offer.data() + 8 + aead::KEY_SIZE;
+			auto count = header[2];
+			auto id = readU64(offer.data());
+			if (offer.size() != OFFER_HEADER_SIZE + 4 * size_t(count) || count > MAX_CANDIDATES || id == 0) {
+				dropMalformed.add();
+				return;
+			}
+			aead::Key key;
+			memcpy(key.data(), offer.data() + 8, aead::KEY_SIZE);
+			auto port = readU16(header);
+			std::vector<sockaddr_in> candidates;
+			for (size_t i = 0; i < count; i++) {
+				sockaddr_in addr = {};
+				addr.sin_family = AF_INET;
+				addr.sin_port = htons(port);
+				memcpy(&addr.sin_addr, offer.data() + OFFER_HEADER_SIZE + 4 * i, 4);
+				candidates.push_back(addr);
+			}
+			auto session = sessions.find(id);
+			if (session != sessions.end() && session->second.peer != peer) {
+				// IDs are in the clear, a peer could claim another's
+				LOG("Ignoring offer from " << peer << ", its session ID is taken");
+				dropMalformed.add();
+				return;
+			}
+			std::vector<Check> checks;
+			{
+				std::unique_lock<std::shared_mutex> lk(pathMutex);
+				auto &p = local(peer);
+				if (session == sessions.end() || session->second.key != key) {
+					// a restart, the old path may be gone with it
+					sessions.erase(p.rxID);
+					if (p.connected) {
+						pathsUp.add(-1);
+						LOG("Direct path to " << peer << " reset");
+					}
+					p.connected = false;
+					p.rxID = id;
+					sessions[id] = Session{peer, key};
+				}
+				p.candidates = candidates;
+				// no need to wait for the next tick
+				for (auto &addr : candidates) {
+					checks.push_back(check(p, addr, KIND_PING, challenge));
+				}
+			}
+			send(checks);
+		}
+
+		void tick() {
+			auto now = Clock::now();
+			// an answer must echo one of the last two, so a recorded one
+			// can't bring a path back
+			previousChallenge = challenge;
+			challenge = randomU64();
+			std::vector<Check> checks;
+			{
+				std::unique_lock<std::shared_mutex> lk(pathMutex);
+				for (auto &[peer, p] : peers) {
+					if (p.connected && now - p.lastHeard > PATH_TIMEOUT) {
+						p.connected = false;
+						pathsUp.add(-1);
+						LOG("Direct path to " << peer << " lost, back to Steam");
+					}
+					if (p.connected) {
+						checks.push_back(check(p, p.path, KIND_PING, challenge));
+					} else {
+						for (auto &addr : p.candidates) {
+							checks.push_back(check(p, addr, KIND_PING, challenge));
+						}
+					}
+				}
+			}
+			send(checks);
+		}
+
+		bool connected(uint64_t peer) {
+			std::shared_lock<std::shared_mutex> lk(pathMutex);
+			auto it = peers.find(peer);
+			return it != peers.end() && it->second.connected;
+		}
+
+		void forget(uint64_t peer) {
+			std::unique_lock<std::shared_mutex> lk(pathMutex);
+			auto it = peers.find(peer);
+			if (it == peers.end()) {
+				return;
+			}
+			sessions.erase(it->second.rxID);
+			if (it->second.connected) {
+				pathsUp.add(-1);
+			}
+			peers.erase(it);
+		}
+
+		size_t mtu() {
+			return options.mtu - OVERHEAD;
+		}
+
+		bool send(uint64_t peer, int channel, std::span<const uint8_t> message, bool defer) {
+			if (message.size() > mtu()) {
+				return false;
+			}
+			sockaddr_in to;
+			aead::Key key;
+			uint64_t id;
+			uint64_t counter;
+			{
+				std::shared_lock<std::shared_mutex> lk(pathMutex);
+				auto it = peers.find(peer);
+				if (it == peers.end() || !it->second.connected) {
+					return false;
+				}
+				auto &p = it->second;
+				to = p.path;
+				key = p.txKey;
+				id = p.txID;
+				counter = p.counter.fetch_add(1, std::memory_order_relaxed);
+			}
+			auto &q = queue;
+			if (q.owner != this) {
+				// another transport's leftovers, only when there are several.
+				// They leave through their own socket.
+				if (q.owner != nullptr) {
+					q.owner->flush();
+				}
+				q.owner = this;
+			}
+			auto offset = q.arena.size();
+			q.arena.resize(offset + OVERHEAD + message.size());
+			seal(key, id, counter, static_cast<uint8_t>(channel), message, q.arena.data() + offset);
+			q.entries.push_back({to, offset, OVERHEAD + message.size()});
+			if (!defer) {
+				flush();
+			} else if (q.entries.size() >= SEND_BATCH) {
+				send(q);
+			}
+			return true;
+		}
+
+		// an empty queue lets go of its owner, so only a burst still in
+		// flight on a thread points at a transport
+		void flush() {
+			if (queue.owner == this) {
+				send(queue);
+				queue.owner = nullptr;
+			}
+		}
+
+		void onReceive(std::function<void(uint64_t, int, std::span<uint8_t>)> cb) {
+			receiveCb = cb;
+		}
+
+		void onFlush(std::function<void()> cb) {
+			flushCb = cb;
+		}
+
+		private:
+		struct Peer {
+			// ours, sent in our offers; every datagram takes the next
+			// counter as its nonce
+			aead::Key txKey;
+			uint64_t txID = 0;
+			std::atomic<uint64_t> counter = 1;
+			// from the peer's offer, its key is in sessions
+			uint64_t rxID = 0;
+			std::vector<sockaddr_in> candidates;
+			bool connected = false;
+			sockaddr_in path = {};
+			Clock::time_point lastHeard;
+		};
+
+		// what a peer seals with, found by the ID in front of its datagrams
+		struct Session {
+			uint64_t peer;
+			aead::Key key;
+			// highest counter seen, and a bitmap of those before it
+			uint64_t highest = 0;
+			uint64_t seen[REPLAY_WORDS] = {};
+		};
+
+		struct Check {
+			sockaddr_in to;
+			uint8_t data[CHECK_SIZE];
+		};
+
+		struct Entry {
+			sockaddr_in to;
+			size_t offset;
+			size_t size;
+		};
+
+		// datagrams waiting for flush(), in one arena so runs to the same
+		// peer are already laid out the way UDP_SEGMENT wants them
+		struct Queue {
+			Impl *owner = nullptr;
+			std::vector<uint8_t> arena;
+			std::vector<Entry> entries;
+		};
+
+		static thread_local Queue queue;
+
+		// our state for a peer, made on first use. Under the unique lock.
+		Peer &local(uint64_t peer) {
+			auto &p = peers[peer];
+			while (p.txID == 0) {
+				p.txKey = aead::randomKey();
+				p.txID = randomU64();
+			}
+			return p;
+		}
+
+		// a path check or its answer, sealed so only the peer can read it
+		// and only it can answer
+		Check check(Peer &p, const sockaddr_in &to, uint8_t kind, uint64_t value) {
+			Check out;
+			out.to = to;
+			uint8_t payload[8];
+			writeU64(payload, value);
+			seal(p.txKey, p.txID, p.counter.fetch_add(1, std::memory_order_relaxed), kind, payload, out.data);
+			return out;
+		}
+
+		void send(const std::vector<Check> &checks) {
+			for (auto &c : checks) {
+				sendto(fd, c.data, sizeof(c.data), 0, reinterpret_cast<const sockaddr *>(&c.to), sizeof(c.to));
+			}
+		}
+
+		// false for a counter seen before or too old to tell, as in RFC 6479
+		static bool fresh(Session &s, uint64_t counter) {
+			const uint64_t WINDOW = (REPLAY_WORDS - 1) * 64;
+			if (counter + WINDOW < s.highest) {
+				return false;
+			}
+			auto word = counter / 64;
+			if (counter > s.highest) {
+				auto current = s.highest / 64;
+				auto clear = std::min<uint64_t>(word - current, REPLAY_WORDS);
+				for (uint64_t i = 1; i <= clear; i++) {
+					s.seen[(current + i) % REPLAY_WORDS] = 0;
+				}
+				s.highest = counter;
+			}
+			auto &bits = s.seen[word % REPLAY_WORDS];
+			auto bit = uint64_t(1) << (counter % 64);
+			if (bits & bit) {
+				return false;
+			}
+			bits |= bit;
+			return true;
+		}
+
+		void send(Queue &q) {
+			if (q.entries.empty()) {
+				return;
+			}
+			thread_local std::vector<struct mmsghdr> msgs;
+			thread_local std::vector<struct iovec> iovs;
+			union Control {
+				char buf[CMSG_SPACE(sizeof(uint16_t))];
+				struct cmsghdr align;
+			};
+			thread_local std::vector<Control> controls;
+			// first entry of every message, to resume after a failure
+			thread_local std::vector<size_t> starts;
+			msgs.clear();
+			starts.clear();
+			iovs.resize(q.entries.size());
+			controls.resize(q.entries.size());
+
+			bool useGSO = gso.load(std::memory_order_relaxed);
+			for (size_t i = 0; i < q.entries.size();) {
+				auto &first = q.entries[i];
+				// a run: same peer, same size, only the last may be shorter
+				size_t end = i + 1;
+				size_t total = first.size;
+				while (useGSO && end < q.entries.size() && end - i < MAX_SEGMENTS) {
+					auto &next = q.entries[end];
+					if (!sameAddr(next.to, first.to) || next.size > first.size || total + next.size > MAX_GSO_SIZE || q.entries[end - 1].size != first.size) {
+						break;
+					}
+					total += next.size;
+					end++;
+				}
+				auto n = msgs.size();
+				iovs[n] = {q.arena.data() + first.offset, total};
+				struct mmsghdr msg = {};
+				msg.msg_hdr.msg_name = &first.to;
+				msg.msg_hdr.msg_namelen = sizeof(first.to);
+				msg.msg_hdr.msg_iov = &iovs[n];
+				msg.msg_hdr.msg_iovlen = 1;
+				if (end - i > 1) {
+					msg.msg_hdr.msg_control = controls[n].buf;
+					msg.msg_hdr.msg_controllen = sizeof(controls[n].buf);
+					auto cmsg = CMSG_FIRSTHDR(&msg.msg_hdr);
+					cmsg->cmsg_level = SOL_UDP;
+					cmsg->cmsg_type = UDP_SEGMENT;
+					cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+					uint16_t segment = static_cast<uint16_t>(first.size);
+					memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+					gsoSends.add();
+				}
+				msgs.push_back(msg);
+				starts.push_back(i);
+				i = end;
+			}
+
+			for (size_t i = 0; i < msgs.size();) {
+				auto sent = sendmmsg(fd, msgs.data() + i, static_cast<unsigned>(msgs.size() - i), 0);
+				if (sent > 0) {
+					i += sent;
+					continue;
+				}
+				if (errno == EINTR) {
+					continue;
+				}
+				if (msgs[i].msg_hdr.msg_control != nullptr && (errno == EIO || errno == EINVAL) && gso.exchange(false)) {
+					// the socket takes it but the device can't, retry without
+					LOG("UDP GSO failed, sending datagrams one by one: " << strerror(errno));
+					datagramsSent.add(starts[i]);
+					q.entries.erase(q.entries.begin(), q.entries.begin() + starts[i]);
+					send(q);
+					return;
+				}
+				sendFailures.add();
+				i++;
+			}
+			datagramsSent.add(q.entries.size());
+			q.entries.clear();
+			q.arena.clear();
+		}
+
+		// on the loop, one recvmmsg worth per call since the watch is
+		// level triggered
+		void receive() {
+			thread_local struct mmsghdr msgs[RECV_BATCH];
+			thread_local struct iovec iovs[RECV_BATCH];
+			thread_local sockaddr_in addrs[RECV_BATCH];
+			union Control {
+				char buf[CMSG_SPACE(sizeof(int))];
+				struct cmsghdr align;
+			};
+			thread_local Control controls[RECV_BATCH];
+			wakeups.add();
+			for (size_t i = 0; i < RECV_BATCH; i++) {
+				iovs[i] = {recvSlab.data() + i * RECV_BUFFER_SIZE, RECV_BUFFER_SIZE};
+				msgs[i] = {};
+				msgs[i].msg_hdr.msg_name = &addrs[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+				msgs[i].msg_hdr.msg_control = controls[i].buf;
+				msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+			}
+			auto count = recvmmsg(fd, msgs, RECV_BATCH, MSG_DONTWAIT, nullptr);
+			if (count <= 0) {
+				if (count < 0 && errno != EAGAIN && errno != EINTR) {
+					LOG("Failed to receive UDP: " << strerror(errno));
+				}
+				return;
+			}
+			for (int i = 0; i < count; i++) {
+				size_t size = msgs[i].msg_len;
+				size_t segment = size;
+				for (auto cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+					if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+						int value;
+						memcpy(&value, CMSG_DATA(cmsg), sizeof(value));
+						segment = static_cast<size_t>(value);
+					}
+				}
+				if (segment == 0) {
+					continue;
+				}
+				auto data = static_cast<uint8_t *>(iovs[i].iov_base);
+				for (size_t offset = 0; offset < size; offset += segment) {
+					datagram(addrs[i], std::span<uint8_t>(data + offset, std::min(segment, size - offset)));
+				}
+			}
+			if (flushCb != nullptr) {
+				flushCb();
+			}
+		}
+
+		void datagram(const sockaddr_in &from, std::span<uint8_t> data) {
+			datagramsReceived.add();
+			if (data.size() < OVERHEAD) {
+				dropMalformed.add();
+				return;
+			}
+			auto it = sessions.find(readU64(data.data()));
+			if (it == sessions.end()) {
+				// our own checks looped back through a shared address too
+				dropUnknownSession.add();
+				return;
+			}
+			auto &s = it->second;
+			auto counter = readU64(data.data() + 8);
+			auto sealed = data.subspan(HEADER_SIZE, data.size() - HEADER_SIZE - aead::TAG_SIZE);
+			if (!aead::open(s.key, aead::nonce(counter), data.first(HEADER_SIZE), sealed, sealed.data() + sealed.size())) {
+				dropForged.add();
+				return;
+			}
+			// only after the tag, or forgeries could fill the window
+			if (!fresh(s, counter)) {
+				dropReplayed.add();
+				return;
+			}
+			auto kind = sealed[0];
+			auto message = sealed.subspan(1);
+			if (kind == KIND_PING || kind == KIND_PONG) {
+				if (message.size() != 8) {
+					dropMalformed.add();
+					return;
+				}
+				checked(s.peer, from, kind, readU64(message.data()));
+			} else if (receiveCb != nullptr) {
+				receiveCb(s.peer, kind, message);
+			}
+		}
+
+		// an authenticated check from peer. Answers bind the path, checks
+		// only get answered: anyone can bounce a check to another address.
+		void checked(uint64_t peer, const sockaddr_in &from, uint8_t kind, uint64_t value) {
+			if (kind == KIND_PING) {
+				std::vector<Check> answer;
+				{
+					std::shared_lock<std::shared_mutex> lk(pathMutex);
+					auto it = peers.find(peer);
+					if (it == peers.end()) {
+						return;
+					}
+					answer.push_back(check(it->second, from, KIND_PONG, value));
+				}
+				send(answer);
+				return;
+			}
+			if (value != challenge && value != previousChallenge) {
+				dropStaleCheck.add();
+				return;
+			}
+			std::unique_lock<std::shared_mutex> lk(pathMutex);
+			auto it = peers.find(peer);
+			if (it == peers.end()) {
+				return;
+			}
+			auto &p = it->second;
+			// the first address to answer sticks until it goes quiet,
+			// several candidates often reach the same peer
+			if (!p.connected) {
+				pathsUp.add(1);
+				p.connected = true;
+				p.path = from;
+				LOG("Direct path to " << peer << " via " << toString(from));
+			}
+			if (sameAddr(p.path, from)) {
+				p.lastHeard = Clock::now();
+			}
+		}
+
+		event::Loop &loop;
+		Options options;
+		int fd = -1;
+		uint16_t _port = 0;
+		std::atomic<bool> gso = false;
+		bool gro = false;
+
+		// peers, written on the loop and read by senders
+		std::shared_mutex pathMutex;
+		std::map<uint64_t, Peer> peers;
+		// the loop's alone, like the challenges
+		std::unordered_map<uint64_t, Session> sessions;
+		uint64_t challenge = 0;
+		uint64_t previousChallenge = 0;
+
+		std::vector<uint8_t> recvSlab;
+		std::function<void(uint64_t, int, std::span<uint8_t>)> receiveCb;
+		std::function<void()> flushCb;
+
+		metrics::Counter &datagramsSent = metrics::registry().counter("lpvpn_udp_datagrams_total", "Datagrams through the UDP transport, by direction", {{"direction", "tx"}});
+		metrics::Counter &datagramsReceived = metrics::registry().counter("lpvpn_udp_datagrams_total", "Datagrams through the UDP transport, by direction", {{"direction", "rx"}});
+		metrics::Counter &gsoSends = metrics::registry().counter("lpvpn_udp_gso_sends_total", "UDP sends segmented by the kernel");
+		metrics::Counter &sendFailures = metrics::registry().counter("lpvpn_udp_send_failures_total", "UDP sends the kernel refused");
+		metrics::Gauge &pathsUp = metrics::registry().gauge("lpvpn_udp_paths", "Peers reachable over direct UDP");
+		metrics::Counter &wakeups = metrics::wakeups("udp_receiver");
+		metrics::Counter &dropMalformed = metrics::drops("udp_malformed");
+		metrics::Counter &dropUnknownSession = metrics::drops("udp_unknown_session");
+		metrics::Counter &dropForged = metrics::drops("udp_forged");
+		metrics::Counter &dropReplayed = metrics::drops("udp_replayed");
+		metrics::Counter &dropStaleCheck = metrics::drops("udp_stale_check");
+	};
+
+	thread_local Transport::Impl::Queue Transport::Impl::queue;
+
+	Transport::Transport(event::Loop &loop, const Options &options): impl(std::make_unique<Impl>(loop, options)) {}
+	Transport::~Transport() {}
+
+	uint16_t Transport::port() {
+		return impl->port();
+	}
+
+	uint8_t Transport::kind() {
+		return KIND;
+	}
+
+	std::vector<uint8_t> Transport::offer(uint64_t peer) {
+		return impl->offer(peer);
+	}
+
+	void Transport::accept(uint64_t peer, std::span<const uint8_t> offer) {
+		impl->accept(peer, offer);
+	}
+
+	void Transport::tick() {
+		impl->tick();
+	}
+
+	bool Transport::connected(uint64_t peer) {
+		return impl->connected(peer);
+	}
+
+	void Transport::forget(uint64_t peer) {
+		impl->forget(peer);
+	}
+
+	size_t Transport::mtu() {
+		return impl->mtu();
+	}
+
+	bool Transport::send(uint64_t peer, int channel, std::span<const uint8_t> message, bool defer) {
+		return impl->send(peer, channel, message, defer);
+	}
+
+	void Transport::flush() {
+		impl->flush();
+	}
+
+	void Transport::onReceive(std::function<void(uint64_t, int, std::span<uint8_t>)> cb) {
+		impl->onReceive(cb);
+	}
+
+	void Transport::onFlush(std::function<void()> cb) {
+		impl->onFlush(cb);
+	}
+}
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "event.h"
+#include "ip.h"
+#include "transport.h"
+
+namespace lpvpn::udp {
+	using namespace lpvpn::ip;
+
+	// Direct UDP between peers, Linux only. Each end picks a session ID
+	// and key for each peer and sends them in its offer, which only ever
+	// travels over Steam. Every datagram is the sender's session ID and a
+	// counter, then a kind byte (the channel of the message that follows,
+	// or a path check) and the message, sealed with ChaCha20-Poly1305
+	// under the session key and the counter. Forged, altered and replayed
+	// datagrams are dropped. A peer's path is the address the first
+	// answer to one of our checks came from, answers echo a challenge that
+	// changes every tick; it is checked every tick and dropped once the
+	// peer has been silent for PATH_TIMEOUT.
+	//
+	// Deferred sends queue per thread and leave through sendmmsg, with runs
+	// of equal sized datagrams to one peer (fragment trains, bulk TCP) as
+	// a single UDP_SEGMENT send. Receives use recvmmsg and UDP_GRO. Both
+	// offloads are used when the kernel has them.
+	const uint8_t KIND = 1;
+
+	class Transport: public transport::Transport {
+		public:
+		struct Options {
+			// 0 picks any free port
+			uint16_t port = 0;
+			// offered besides our interfaces' addresses, for a public
+			// address that has the port forwarded to us
+			std::vector<Address4> advertise;
+			// interface addresses in these are never offered, the tunnel's
+			// own for a start
+			std::vector<Subnet4> exclude;
+			// largest UDP payload sent, headers and tags included
+			size_t mtu = 1400;
+		};
+
+		Transport(event::Loop &loop, const Options &options);
+		~Transport();
+
+		uint16_t port();
+
+		uint8_t kind() override;
+		std::vector<uint8_t> offer(uint64_t peer) override;
+		void accept(uint64_t peer, std::span<const uint8_t> offer) override;
+		void tick() override;
+		bool connected(uint64_t peer) override;
+		void forget(uint64_t peer) override;
+		size_t mtu() override;
+		bool send(uint64_t peer, int channel, std::span<const uint8_t> message, bool defer) override;
+		void flush() override;
+		void onReceive(std::function<void(uint64_t peer, int channel, std::span<uint8_t> message)> cb) override;
+		void onFlush(std::function<void()> cb) override;
+
+		private:
+		class Impl;
+		std::unique_ptr<Impl> impl;
+	};
+}
@@ -0,0 +1,209 @@
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+namespace lpvpn::uring {
+	static int setup(unsigned entries, struct io_uring_params *params) {
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+	}
+
+	static int enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+	}
+
+	static int registerRing(int fd, unsigned op, const void *arg, unsigned count) {
+		return static_cast<int>(syscall(__NR_io_uring_register, fd, op, arg, count));
+	}
+
+	static void *mapRing(int fd, size_t size, off_t offset) {
+		auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+		if (ptr == MAP_FAILED) {
+			throw std::system_error(errno, std::generic_category(), "Failed to map io_uring");
+		}
+		return ptr;
+	}
+
+	template<typename T>
+	static T *at(void *base, unsigned offset) {
+		return reinterpret_cast<T *>(static_cast<uint8_t *>(base) + offset);
+	}
+
+	// Ring
+	Ring::Ring(unsigned entries) {
+		struct io_uring_params params = {};
+		// only run completion work when we enter the kernel anyway
+		params.flags = IORING_SETUP_COOP_TASKRUN;
+		ringFd = setup(entries, &params);
+		if (ringFd < 0 && errno == EINVAL) {
+			// kernels before 5.19
+			params = {};
+			ringFd = setup(entries, &params);
+		}
+		if (ringFd < 0) {
+			throw std::system_error(errno, std::generic_category(), "Failed to set up io_uring");
+		}
+
+		try {
+			sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+			if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+				sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+				sqRing = mapRing(ringFd, sqRingSize, IORING_OFF_SQ_RING);
+				cqRing = sqRing;
+			} else {
+				sqRing = mapRing(ringFd, sqRingSize, IORING_OFF_SQ_RING);
+				cqRing = mapRing(ringFd, cqRingSize, IORING_OFF_CQ_RING);
+			}
+			sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+			sqes = static_cast<struct io_uring_sqe *>(mapRing(ringFd, sqesSize, IORING_OFF_SQES));
+		} catch (...) {
+			unmap();
+			close(ringFd);
+			throw;
+		}
+
+		sqHead = at<unsigned>(sqRing, params.sq_off.head);
+		sqTail = at<unsigned>(sqRing, params.sq_off.tail);
+		sqMask = *at<unsigned>(sqRing, params.sq_off.ring_mask);
+		sqEntries = *at<unsigned>(sqRing, params.sq_off.ring_entries);
+		// submission slots map 1:1 onto entries, set the indirection up once
+		auto array = at<unsigned>(sqRing, params.sq_off.array);
+		for (unsigned i = 0; i < sqEntries; i++) {
+			array[i] = i;
+		}
+		sqeTail = submitted = *sqTail;
+
+		cqHead = at<unsigned>(cqRing, params.cq_off.head);
+		cqTail = at<unsigned>(cqRing, params.cq_off.tail);
+		cqMask = *at<unsigned>(cqRing, params.cq_off.ring_mask);
+		cqes = at<struct io_uring_cqe>(cqRing, params.cq_off.cqes);
+	}
+
+	Ring::~Ring() {
+		unmap();
+		close(ringFd);
+	}
+
+	void Ring::unmap() {
+		if (sqes != nullptr) {
+			munmap(sqes, sqesSize);
+		}
+		if (cqRing != nullptr && cqRing != sqRing) {
+			munmap(cqRing, cqRingSize);
+		}
+		if (sqRing != nullptr) {
+			munmap(sqRing, sqRingSize);
+		}
+	}
+
+	struct io_uring_sqe *Ring::sqe() {
+		auto head = std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire);
+		if (sqeTail - head >= sqEntries) {
+			return nullptr;
+		}
+		auto entry = &sqes[sqeTail & sqMask];
+		memset(entry, 0, sizeof(*entry));
+		sqeTail++;
+		return entry;
+	}
+
+	int Ring::submit(unsigned waitFor) {
+		auto toSubmit = sqeTail - submitted;
+		if (toSubmit == 0 && waitFor == 0) {
+			return 0;
+		}
+		std::atomic_ref<unsigned>(*sqTail).store(sqeTail, std::memory_order_release);
+		submitted = sqeTail;
+		while (true) {
+			auto ret = enter(ringFd, toSubmit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+			if (ret < 0 && errno == EINTR) {
+				// the submissions went through, only the wait was cut short
+				toSubmit = 0;
+				continue;
+			}
+			return ret < 0 ? -errno : ret;
+		}
+	}
+
+	void Ring::registerBuffers(const struct iovec *iovs, unsigned count) {
+		if (registerRing(ringFd, IORING_REGISTER_BUFFERS, iovs, count) < 0) {
+			throw std::system_error(errno, std::generic_category(), "Failed to register io_uring buffers");
+		}
+	}
+
+	int Ring::fd() const {
+		return ringFd;
+	}
+
+	// BufferRing
+	BufferRing::BufferRing(Ring &ring, uint16_t group, unsigned count, size_t size): ring(ring), group(group), count(count), size(size) {
+		bufsSize = count * sizeof(struct io_uring_buf);
+		auto bufsPtr = mmap(nullptr, bufsSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		auto memoryPtr = mmap(nullptr, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (bufsPtr == MAP_FAILED || memoryPtr == MAP_FAILED) {
+			auto err = errno;
+			if (bufsPtr != MAP_FAILED) {
+				munmap(bufsPtr, bufsSize);
+			}
+			if (memoryPtr != MAP_FAILED) {
+				munmap(memoryPtr, count * size);
+			}
+			throw std::system_error(err, std::generic_category(), "Failed to allocate io_uring buffers");
+		}
+		bufs = static_cast<struct io_uring_buf *>(bufsPtr);
+		memory = static_cast<uint8_t *>(memoryPtr);
+
+		struct io_uring_buf_reg reg = {};
+		reg.ring_addr = reinterpret_cast<uint64_t>(bufs);
+		reg.ring_entries = count;
+		reg.bgid = group;
+		if (registerRing(ring.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			auto err = errno;
+			munmap(bufs, bufsSize);
+			munmap(memory, count * size);
+			throw std::system_error(err, std::generic_category(), "Failed to register io_uring buffer ring");
+		}
+		for (unsigned i = 0; i < count; i++) {
+			recycle(static_cast<uint16_t>(i));
+		}
+		commit();
+	}
+
+	BufferRing::~BufferRing() {
+		struct io_uring_buf_reg reg = {};
+		reg.bgid = group;
+		registerRing(ring.fd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+		munmap(bufs, bufsSize);
+		munmap(memory, count * size);
+	}
+
+	uint8_t *BufferRing::buffer(uint16_t id) {
+		return memory + id * size;
+	}
+
+	void BufferRing::recycle(uint16_t id) {
+		auto &buf = bufs[(tail + pending) & (count - 1)];
+		buf.addr = reinterpret_cast<uint64_t>(buffer(id));
+		buf.len = static_cast<uint32_t>(size);
+		buf.bid = id;
+		pending++;
+	}
+
+	void BufferRing::commit() {
+		if (pending == 0) {
+			return;
+		}
+		tail += pending;
+		pending = 0;
+		// the ring tail overlays the reserved field of the first entry
+		std::atomic_ref<uint16_t>(bufs[0].resv).store(tail, std::memory_order_release);
+	}
+}
+#endif
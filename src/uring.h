@@ -0,0 +1,96 @@
+#pragma once
+#ifdef __linux__
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+namespace lpvpn::uring {
+	// Just enough io_uring on top of the raw syscalls for the TUN engine,
+	// so there is no liburing dependency. A ring must only be submitted to
+	// and reaped from by one thread at a time.
+	class Ring {
+		public:
+		Ring(unsigned entries);
+		~Ring();
+		Ring(const Ring &) = delete;
+		Ring &operator=(const Ring &) = delete;
+
+		// a zeroed submission entry, nullptr if the queue is full
+		struct io_uring_sqe *sqe();
+		// submits everything prepared since the last call and waits for at
+		// least waitFor completions, in a single io_uring_enter
+		int submit(unsigned waitFor = 0);
+
+		// calls cb for every completion that's ready, returns how many
+		template<typename F>
+		unsigned reap(F cb) {
+			auto head = *cqHead;
+			auto tail = std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire);
+			unsigned count = 0;
+			for (; head != tail; head++, count++) {
+				cb(cqes[head & cqMask]);
+			}
+			std::atomic_ref<unsigned>(*cqHead).store(head, std::memory_order_release);
+			return count;
+		}
+
+		void registerBuffers(const struct iovec *iovs, unsigned count);
+		int fd() const;
+
+		private:
+		void unmap();
+
+		int ringFd = -1;
+		void *sqRing = nullptr;
+		size_t sqRingSize = 0;
+		void *cqRing = nullptr;
+		size_t cqRingSize = 0;
+		struct io_uring_sqe *sqes = nullptr;
+		size_t sqesSize = 0;
+
+		unsigned *sqHead;
+		unsigned *sqTail;
+		unsigned sqMask;
+		unsigned sqEntries;
+		// prepared but not yet visible to the kernel
+		unsigned sqeTail = 0;
+		unsigned submitted = 0;
+
+		unsigned *cqHead;
+		unsigned *cqTail;
+		unsigned cqMask;
+		struct io_uring_cqe *cqes;
+	};
+
+	// Provided buffer ring (IORING_REGISTER_PBUF_RING). Reads submitted with
+	// IOSQE_BUFFER_SELECT take a buffer from it only once data is there, so
+	// many reads can be outstanding without pinning a buffer each.
+	class BufferRing {
+		public:
+		// count must be a power of two
+		BufferRing(Ring &ring, uint16_t group, unsigned count, size_t size);
+		~BufferRing();
+		BufferRing(const BufferRing &) = delete;
+		BufferRing &operator=(const BufferRing &) = delete;
+
+		uint8_t *buffer(uint16_t id);
+		// hands a consumed buffer back, the kernel sees it after commit()
+		void recycle(uint16_t id);
+		void commit();
+
+		private:
+		Ring &ring;
+		uint16_t group;
+		unsigned count;
+		size_t size;
+		struct io_uring_buf *bufs = nullptr;
+		size_t bufsSize = 0;
+		uint8_t *memory = nullptr;
+		uint16_t tail = 0;
+		uint16_t pending = 0;
+	};
+}
+#endif
@@ -1,3 +1,5 @@
+#ifdef _WIN32
+
 #include <iostream>
 #include <thread>
 #include <stdexcept>
@@ -12,6 +14,10 @@
 
 #include "tun.h"
 #include "log.h"
+#include "metrics.h"
+
+// packets handed on before onFlush is called, even if more are waiting
+#define READ_BATCH 64
 
 extern "C" {
 
@@ -92,7 +98,18 @@ namespace lpvpn::tun {
 				throw std::runtime_error("Failed to start session");
 			}
 
+			quitEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+			if (quitEvent == nullptr) {
+				WintunEndSession(sessionHandle);
+				sessionHandle = nullptr;
+				WintunCloseAdapter(wintun);
+				wintun = nullptr;
+				throw std::runtime_error("Failed to create quit event");
+			}
+
 			thread = std::thread([this]() {
+				HANDLE events[2] = { WintunGetReadWaitEvent(sessionHandle), quitEvent };
+				size_t burst = 0;
 				while (this->running) {
 					DWORD incomingPacketSize;
 					auto incomingPacket = WintunReceivePacket(sessionHandle, &incomingPacketSize);
@@ -103,8 +120,19 @@ namespace lpvpn::tun {
 							this->dataCb(packet);
 						}
 						WintunReleaseReceivePacket(sessionHandle, incomingPacket);
+						// the ring may never run dry under load
+						if (++burst >= READ_BATCH && this->flushCb != nullptr) {
+							this->flushCb();
+							burst = 0;
+						}
 					} else if (GetLastError() == ERROR_NO_MORE_ITEMS) {
-						WaitForSingleObject(WintunGetReadWaitEvent(sessionHandle), 1000);
+						if (burst > 0 && this->flushCb != nullptr) {
+							this->flushCb();
+						}
+						burst = 0;
+						// no timeout, shutdown signals quitEvent
+						WaitForMultipleObjects(2, events, FALSE, INFINITE);
+						wakeups.add();
 					} else {
 						break;
 					}
@@ -114,9 +142,15 @@ namespace lpvpn::tun {
 
 		~Impl() {
 			running = false;
+			if (quitEvent) {
+				SetEvent(quitEvent);
+			}
 			if (thread.joinable()) {
 				thread.join();
 			}
+			if (quitEvent) {
+				CloseHandle(quitEvent);
+			}
 			if (sessionHandle) {
 				WintunEndSession(sessionHandle);
 			}
@@ -136,6 +170,8 @@ namespace lpvpn::tun {
 			if (wintunPacket != nullptr) {
 				memcpy(wintunPacket, packet.packet.data(), packet.packet.size());
 				WintunSendPacket(sessionHandle, wintunPacket);
+			} else {
+				dropRingFull.add();
 			}
 		};
 
@@ -143,6 +179,10 @@ namespace lpvpn::tun {
 			this->dataCb = cb;
 		};
 
+		void onFlush(std::function<void()> cb) {
+			this->flushCb = cb;
+		};
+
 		void setCategory() {
 			HRESULT hr = S_OK;
 			CComPtr<INetworkListManager> pLocalNLM;
@@ -223,6 +263,7 @@ namespace lpvpn::tun {
 		HMODULE wintunModule = nullptr;
 		std::thread thread;
 		std::atomic<bool> running = true;
+		HANDLE quitEvent = nullptr;
 		std::unique_ptr<Subnet4> currentSubnet;
 
 		ULONG ipContext = 0;
@@ -233,17 +274,29 @@ namespace lpvpn::tun {
 		NET_LUID wintunLUID;
 
 		std::function<void(Packet &packet)> dataCb;
+		std::function<void()> flushCb;
+
+		metrics::Counter &wakeups = metrics::wakeups("tun_reader");
+		metrics::Counter &dropRingFull = metrics::drops("tun_ring_full");
 	};
 
 	Tun::Tun() : impl(std::make_unique<Impl>()) {};
+	// Wintun has a single ring and no offloads, nothing to configure
+	Tun::Tun(const Options &options) : impl(std::make_unique<Impl>()) {};
 	Tun::~Tun() {};
 	void Tun::write(Packet &packet) {
 		this->impl->write(packet);
 	};
+	void Tun::flush() {};
 	void Tun::onData(std::function<void(Packet &packet)> cb) {
 		this->impl->onData(cb);
 	};
+	void Tun::onFlush(std::function<void()> cb) {
+		this->impl->onFlush(cb);
+	};
 	void Tun::setIP4(const Subnet4 &subnet) {
 		this->impl->setIP4(subnet);
 	};
 }
+
+#endif
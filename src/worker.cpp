@@ -0,0 +1,125 @@
+#include <algorithm>
+
+#include "worker.h"
+
+#define QUEUE_SIZE 1024
+
+namespace lpvpn::worker {
+	size_t flowHash(Packet &packet) {
+		auto p = packet.packet;
+		if (p.size() < 20 || packet.version() != 4) {
+			return 0;
+		}
+		auto packet4 = Packet4(p);
+		uint64_t key = (uint64_t(packet4.srcAddr().toUint32()) << 32) | packet4.dstAddr().toUint32();
+		auto protocol = packet4.protocol();
+		uint64_t ports = protocol;
+		size_t ihl = packet4.headerLength();
+		bool hasPorts = protocol == PROTOCOL_TCP || protocol == PROTOCOL_UDP;
+		if (hasPorts && !packet4.isFragment() && p.size() >= ihl + 4) {
+			ports |= (uint64_t(p[ihl]) << 40) | (uint64_t(p[ihl + 1]) << 32) | (uint64_t(p[ihl + 2]) << 24) | (uint64_t(p[ihl + 3]) << 16);
+		}
+		// murmur3 finalizer over both halves
+		key ^= ports * 0x9E3779B97F4A7C15ull;
+		key ^= key >> 33;
+		key *= 0xFF51AFD7ED558CCDull;
+		key ^= key >> 33;
+		key *= 0xC4CEB9FE1A85EC53ull;
+		key ^= key >> 33;
+		return static_cast<size_t>(key);
+	}
+
+	size_t sourceHash(Packet &packet) {
+		if (packet.packet.size() < 20 || packet.version() != 4) {
+			return 0;
+		}
+		uint64_t key = Packet4(packet.packet).srcAddr().toUint32();
+		return static_cast<size_t>(key * 0x9E3779B97F4A7C15ull >> 32);
+	}
+
+	Pipeline::Pipeline(const std::string &name, size_t count, Handler handler, std::function<void()> flush):
+		handler(handler), flush(flush),
+		dropQueueFull(metrics::drops(name + "_queue_full")),
+		wakeups(metrics::wakeups(name + "_worker")),
+		burst(metrics::registry().histogram("lpvpn_worker_burst_packets", "Packets handled per worker wakeup, by pipeline", {{"pipeline", name}})) {
+		for (size_t i = 0; i < std::max<size_t>(count, 1); i++) {
+			auto worker = std::make_unique<Worker>();
+			worker->queue.reserve(QUEUE_SIZE);
+			worker->thread = std::thread([this, worker = worker.get()]() {
+				run(*worker);
+			});
+			workers.push_back(std::move(worker));
+		}
+	}
+
+	Pipeline::~Pipeline() {
+		stop();
+	}
+
+	void Pipeline::stop() {
+		for (auto &worker : workers) {
+			{
+				std::lock_guard<std::mutex> lk(worker->mutex);
+				worker->running = false;
+			}
+			worker->cv.notify_one();
+		}
+		for (auto &worker : workers) {
+			if (worker->thread.joinable()) {
+				worker->thread.join();
+			}
+		}
+	}
+
+	void Pipeline::dispatch(size_t key, std::span<const uint8_t> packet) {
+		auto &worker = *workers[key % workers.size()];
+		auto buffer = pool::Buffer::copy(packet);
+		bool wake;
+		{
+			std::lock_guard<std::mutex> lk(worker.mutex);
+			if (!worker.running) {
+				return;
+			}
+			if (worker.queue.size() >= QUEUE_SIZE) {
+				dropQueueFull.add();
+				return;
+			}
+			worker.queue.push_back(std::move(buffer));
+			wake = worker.waiting;
+			worker.waiting = false;
+		}
+		// only pay for the wakeup when the worker is actually asleep
+		if (wake) {
+			worker.cv.notify_one();
+		}
+	}
+
+	void Pipeline::run(Worker &worker) {
+		std::vector<pool::Buffer> batch;
+		batch.reserve(QUEUE_SIZE);
+		std::unique_lock<std::mutex> lk(worker.mutex);
+		while (true) {
+			while (worker.running && worker.queue.empty()) {
+				worker.waiting = true;
+				worker.cv.wait(lk);
+			}
+			if (!worker.running) {
+				return;
+			}
+			// take the whole queue, dispatch() can refill it meanwhile
+			std::swap(batch, worker.queue);
+			lk.unlock();
+			wakeups.add();
+			burst.observe(batch.size());
+			for (auto &buffer : batch) {
+				auto packet = Packet(buffer.span());
+				handler(packet);
+			}
+			batch.clear();
+			if (flush != nullptr) {
+				flush();
+			}
+			lk.lock();
+		}
+	}
+}
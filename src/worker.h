@@ -0,0 +1,65 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ip.h"
+#include "metrics.h"
+#include "pool.h"
+
+namespace lpvpn::worker {
+	using namespace lpvpn::ip;
+
+	// Hash of the IPv4 5-tuple, ports are left out for fragments (only the
+	// first one carries them) and for protocols without any. Packets that
+	// aren't IPv4 all hash the same.
+	size_t flowHash(Packet &packet);
+	// Hash of the source address, which for packets from peers is the
+	// sending peer's address.
+	size_t sourceHash(Packet &packet);
+
+	// Spreads packet handling across worker threads. Packets with the same
+	// shard key always land on the same worker, so ordering holds within a
+	// flow / peer while different ones run in parallel. dispatch() copies
+	// the packet into a pool buffer and never blocks; when a worker falls
+	// QUEUE_SIZE packets behind, new ones are dropped.
+	class Pipeline {
+		public:
+		using Handler = std::function<void(Packet &packet)>;
+
+		// flush, if set, runs on a worker after each burst it drained
+		Pipeline(const std::string &name, size_t workers, Handler handler, std::function<void()> flush = nullptr);
+		~Pipeline();
+
+		void dispatch(size_t key, std::span<const uint8_t> packet);
+		// joins the workers, later dispatches are dropped
+		void stop();
+
+		private:
+		struct Worker {
+			std::mutex mutex;
+			std::condition_variable cv;
+			std::vector<pool::Buffer> queue;
+			bool waiting = false;
+			bool running = true;
+			std::thread thread;
+		};
+
+		void run(Worker &worker);
+
+		Handler handler;
+		std::function<void()> flush;
+		std::vector<std::unique_ptr<Worker>> workers;
+
+		metrics::Counter &dropQueueFull;
+		metrics::Counter &wakeups;
+		metrics::Histogram &burst;
+	};
+}